@@ -12,7 +12,7 @@ LOCAL_SRC_FILES :=  bpf.c cache.c dbus.c dhcp.c dnsmasq.c \
 	            dnssec.c dnssec-openssl.c blockdata.c tables.c \
 		    loop.c inotify.c poll.c rrfilter.c edns0.c arp.c \
 		    crypto.c dump.c ubus.c metrics.c \
-                    domain-match.c nftset.c
+                    domain-match.c nftset.c warmup.c dnstap.c openmetrics.c
 
 LOCAL_MODULE := dnsmasq
 
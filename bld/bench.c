@@ -0,0 +1,447 @@
+/* dnsmasq is Copyright (c) 2000-2026 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Micro-benchmarks for the inner loops of the cache, server selection and
+   packet code, built and run by "make bench". They are linked against the
+   same objects as dnsmasq, with main() renamed, and run against a daemon
+   state made from a generated config, hosts file and packets.
+
+   dnsmasq-bench [-s <names>] [-t <ms>] [<pattern>...]
+
+   -s sets the number of hosts, servers and cache entries (default 10000),
+   -t the minimum time to run each benchmark for (default 200ms), and
+   only benchmarks whose names contain one of the patterns are run.
+
+   Allocations are counted by wrapping malloc(), calloc() and realloc()
+   at link time, so only those made by dnsmasq's own code are seen. */
+
+/* Declare static char *compiler_opts  in config.h */
+#define DNSMASQ_COMPILE_OPTS
+
+#include "dnsmasq.h"
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  allocs++;
+  return __real_realloc(ptr, size);
+}
+
+static int names = 10000;
+static char **hosts, **inserts, **lookups, **misses;
+static time_t now;
+
+/* Packets, built once. */
+static unsigned char answer_pkt[4096], filter_pkt[4096], work_pkt[4096];
+static size_t answer_len, filter_len;
+static int name_offsets[64], name_count;
+#ifdef HAVE_DNSSEC
+#define SORT_RRS 16
+static unsigned char sort_pkt[4096], *sort_rrs[SORT_RRS];
+static size_t sort_len;
+#endif
+
+static char *name_alloc(const char *fmt, int i)
+{
+  char buf[MAXDNAME];
+
+  snprintf(buf, sizeof(buf), fmt, i, i);
+  return strcpy(safe_malloc(strlen(buf) + 1), buf);
+}
+
+static FILE *create(char *dir, char *file, char *path)
+{
+  FILE *f;
+
+  sprintf(path, "%s/%s", dir, file);
+  if (!(f = fopen(path, "w")))
+    {
+      perror(path);
+      exit(1);
+    }
+
+  return f;
+}
+
+static void make_state(char *dir)
+{
+  char conf[PATH_MAX], hostsfile[PATH_MAX];
+  char *argv[] = { "dnsmasq-bench", "-C", conf, NULL };
+  FILE *f;
+  int i;
+
+  hosts = safe_malloc(names * sizeof(char *));
+  inserts = safe_malloc(4 * names * sizeof(char *));
+  lookups = safe_malloc(names * sizeof(char *));
+  misses = safe_malloc(names * sizeof(char *));
+
+  f = create(dir, "hosts", hostsfile);
+  for (i = 0; i < names; i++)
+    {
+      hosts[i] = name_alloc("host%d.lan", i);
+      fprintf(f, "10.%d.%d.%d %s\n", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, hosts[i]);
+      lookups[i] = name_alloc("www.name%d.domain%d.bench", i);
+      misses[i] = name_alloc("miss%d.unknown%d.example", i);
+    }
+  fclose(f);
+
+  for (i = 0; i < 4 * names; i++)
+    inserts[i] = name_alloc("x%d.insert%d.example", i);
+
+  f = create(dir, "dnsmasq.conf", conf);
+  fprintf(f, "no-resolv\nno-hosts\naddn-hosts=%s\ncache-size=%d\nlog-facility=/dev/null\nserver=192.0.2.1\n",
+	  hostsfile, names);
+  for (i = 0; i < names; i++)
+    fprintf(f, "server=/domain%d.bench/192.0.2.%d\n", i, 2 + (i % 250));
+  fclose(f);
+
+  rand_init();
+  optind = 0; /* read_opts() uses getopt() too */
+  read_opts(3, argv, compile_opts);
+
+  daemon->edns_pktsz = EDNS_PKTSZ;
+  daemon->packet_buff_sz = daemon->edns_pktsz + MAXDNAME + RRFIXEDSZ;
+  daemon->packet = safe_malloc(daemon->packet_buff_sz);
+  daemon->pipe_to_parent = -1;
+#ifdef HAVE_DNSSEC
+  daemon->keyname = safe_malloc(MAXDNAMESTR + 1);
+  daemon->workspacename = safe_malloc(MAXDNAMESTR + 1);
+#endif
+
+  log_start(NULL, -1);
+  now = dnsmasq_time();
+  cache_init();
+  blockdata_init();
+  check_servers(0);
+  cache_reload();
+}
+
+/* A reply with compressed and uncompressed names, and one with DNSSEC records to filter. */
+static void make_packets(void)
+{
+  struct dns_header *header;
+  unsigned char *p;
+  int i, trunc = 0;
+  char target[MAXDNAME], sig[64];
+  struct in_addr a;
+
+  memset(sig, 0x5a, sizeof(sig));
+  a.s_addr = htonl(0xc0000201);
+
+  header = (struct dns_header *)answer_pkt;
+  memset(header, 0, sizeof(*header));
+  header->hb3 = HB3_QR | HB3_RD;
+  header->qdcount = htons(1);
+  p = (unsigned char *)(header + 1);
+  p = do_rfc1035_name(p, "www.example.com", NULL);
+  *p++ = 0;
+  PUTSHORT(T_A, p);
+  PUTSHORT(C_IN, p);
+
+  name_offsets[name_count++] = sizeof(struct dns_header);
+
+  for (i = 0; i < 20; i++)
+    {
+      int offset;
+
+      snprintf(target, sizeof(target), "edge%d.cdn%d.example.net", i, i % 3);
+      name_offsets[name_count++] = p - answer_pkt;
+      add_resource_record(header, (char *)answer_pkt + sizeof(answer_pkt), &trunc, sizeof(struct dns_header), &p,
+			  300, &offset, T_CNAME, C_IN, "d", target);
+      name_offsets[name_count++] = offset;
+    }
+  header->ancount = htons(20);
+  answer_len = p - answer_pkt;
+
+  header = (struct dns_header *)filter_pkt;
+  memset(header, 0, sizeof(*header));
+  header->hb3 = HB3_QR | HB3_RD;
+  header->qdcount = htons(1);
+  p = (unsigned char *)(header + 1);
+  p = do_rfc1035_name(p, "www.example.com", NULL);
+  *p++ = 0;
+  PUTSHORT(T_A, p);
+  PUTSHORT(C_IN, p);
+
+  for (i = 0; i < 4; i++)
+    {
+      a.s_addr = htonl(0xc0000201 + i);
+      add_resource_record(header, (char *)filter_pkt + sizeof(filter_pkt), &trunc, sizeof(struct dns_header), &p,
+			  300, NULL, T_A, C_IN, "4", &a);
+    }
+  add_resource_record(header, (char *)filter_pkt + sizeof(filter_pkt), &trunc, sizeof(struct dns_header), &p,
+		      300, NULL, T_RRSIG, C_IN, "sbblllsdt", T_A, 13, 3, 300L, 0x70000000L, 0x60000000L, 12345,
+		      "example.com", (int)sizeof(sig), sig);
+  header->ancount = htons(5);
+  add_resource_record(header, (char *)filter_pkt + sizeof(filter_pkt), &trunc, 0, &p,
+		      300, NULL, T_NS, C_IN, "d", "example.com", "ns1.example.com");
+  add_resource_record(header, (char *)filter_pkt + sizeof(filter_pkt), &trunc, 0, &p,
+		      300, NULL, T_RRSIG, C_IN, "sbblllsdt", "example.com", T_NS, 13, 2, 300L, 0x70000000L, 0x60000000L, 12345,
+		      "example.com", (int)sizeof(sig), sig);
+  header->nscount = htons(2);
+  filter_len = p - filter_pkt;
+
+#ifdef HAVE_DNSSEC
+  /* An MX RRset in reverse canonical order, names in the RDATA. */
+  header = (struct dns_header *)sort_pkt;
+  memset(header, 0, sizeof(*header));
+  header->hb3 = HB3_QR | HB3_RD;
+  header->qdcount = htons(1);
+  p = (unsigned char *)(header + 1);
+  p = do_rfc1035_name(p, "example.com", NULL);
+  *p++ = 0;
+  PUTSHORT(T_MX, p);
+  PUTSHORT(C_IN, p);
+
+  for (i = 0; i < SORT_RRS; i++)
+    {
+      snprintf(target, sizeof(target), "MX%02d.Mail.Example.com", SORT_RRS - i);
+      sort_rrs[i] = p;
+      add_resource_record(header, (char *)sort_pkt + sizeof(sort_pkt), &trunc, sizeof(struct dns_header), &p,
+			  300, NULL, T_MX, C_IN, "sd", 10, target);
+    }
+  header->ancount = htons(SORT_RRS);
+  sort_len = p - sort_pkt;
+#endif
+}
+
+static void bench_find_hit(int i)
+{
+  cache_find_by_name(NULL, hosts[i % names], now, F_IPV4);
+}
+
+static void bench_find_miss(int i)
+{
+  cache_find_by_name(NULL, misses[i % names], now, F_IPV4);
+}
+
+/* hash_bucket() just masks this, which cache entries keep. */
+static volatile unsigned int sink;
+
+static void bench_hash(int i)
+{
+  sink = hostname_hash(lookups[i % names]);
+}
+
+static void bench_isequal(int i)
+{
+  sink = hostname_isequal(hosts[i % names], hosts[(i + 1) % names]);
+}
+
+static void bench_insert(int i)
+{
+  union all_addr addr;
+
+  addr.addr4.s_addr = htonl(0x0a000000 + i);
+  cache_start_insert();
+  cache_insert(inserts[i % (4 * names)], &addr, C_IN, now, 300, F_IPV4 | F_FORWARD);
+  cache_end_insert();
+}
+
+static void bench_lookup_hit(int i)
+{
+  int low, high;
+
+  lookup_domain(lookups[i % names], 0, &low, &high);
+}
+
+static void bench_lookup_miss(int i)
+{
+  int low, high;
+
+  lookup_domain(misses[i % names], 0, &low, &high);
+}
+
+static void bench_extract_name(int i)
+{
+  unsigned char *p = answer_pkt + name_offsets[i % name_count];
+
+  extract_name((struct dns_header *)answer_pkt, answer_len, &p, daemon->namebuff, EXTR_NAME_EXTRACT, 0);
+}
+
+static void bench_add_rr(int i)
+{
+  static unsigned char *p;
+  struct dns_header *header = (struct dns_header *)work_pkt;
+  struct in_addr a;
+  int trunc = 0;
+
+  if (i % 50 == 0)
+    p = work_pkt + sizeof(struct dns_header) + 21;
+
+  a.s_addr = htonl(0xc0000200 + (i & 0xff));
+  add_resource_record(header, (char *)work_pkt + sizeof(work_pkt), &trunc, sizeof(struct dns_header), &p,
+		      300, NULL, T_A, C_IN, "4", &a);
+}
+
+static void bench_rrfilter(int i)
+{
+  size_t plen = filter_len;
+
+  (void)i;
+  memcpy(work_pkt, filter_pkt, filter_len);
+  rrfilter((struct dns_header *)work_pkt, &plen, RRFILTER_DNSSEC);
+}
+
+#ifdef HAVE_DNSSEC
+static void bench_sort_rrset(int i)
+{
+  unsigned char *rrs[SORT_RRS];
+
+  (void)i;
+  memcpy(rrs, sort_rrs, sizeof(rrs));
+  sort_rrset((struct dns_header *)sort_pkt, sort_len, rrfilter_desc(T_MX), SORT_RRS, rrs, daemon->workspacename);
+}
+#endif
+
+static struct benchmark {
+  char *name, *note;
+  void (*func)(int);
+} benchmarks[] = {
+  { "cache_find_by_name/hit", "hosts-file names", bench_find_hit },
+  { "cache_find_by_name/miss", "hash_bucket() and chain walk", bench_find_miss },
+  { "hash_bucket/hostname_hash", "name hash alone", bench_hash },
+  { "hostname_isequal", "same length, differ at the end", bench_isequal },
+  { "cache_insert", "start/insert/end, evicting", bench_insert },
+  { "lookup_domain/hit", "--server=/domain/ match", bench_lookup_hit },
+  { "lookup_domain/miss", "falls back to default server", bench_lookup_miss },
+  { "extract_name", "per name, half compressed", bench_extract_name },
+  { "add_resource_record", "A record, compressed owner", bench_add_rr },
+  { "rrfilter/dnssec", "includes copying the packet", bench_rrfilter },
+#ifdef HAVE_DNSSEC
+  { "sort_rrset", "16 MX records, reversed", bench_sort_rrset },
+#else
+  { "sort_rrset", "skipped, needs HAVE_DNSSEC", NULL },
+#endif
+};
+
+static double elapsed(struct timespec *start)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+  char dir[] = "/tmp/dnsmasq-bench.XXXXXX", path[PATH_MAX];
+  double target = 200e6;
+  unsigned int b;
+  int opt, patterns, i;
+
+  while ((opt = getopt(argc, argv, "s:t:")) != -1)
+    switch (opt)
+      {
+      case 's':
+	if ((names = atoi(optarg)) < 10)
+	  names = 10;
+	break;
+      case 't':
+	target = atof(optarg) * 1e6;
+	break;
+      default:
+	fprintf(stderr, "usage: dnsmasq-bench [-s <names>] [-t <ms>] [<pattern>...]\n");
+	exit(1);
+      }
+
+  patterns = optind;
+  
+  if (!mkdtemp(dir))
+    {
+      perror(dir);
+      exit(1);
+    }
+
+  make_state(dir);
+  make_packets();
+
+  sprintf(path, "%s/hosts", dir);
+  unlink(path);
+  sprintf(path, "%s/dnsmasq.conf", dir);
+  unlink(path);
+  rmdir(dir);
+
+  /* Make sure we're measuring what we think we are. */
+  if (daemon->serverarraysz <= names || !cache_find_by_name(NULL, hosts[names - 1], now, F_IPV4))
+    {
+      fprintf(stderr, "dnsmasq-bench: failed to set up daemon state\n");
+      exit(1);
+    }
+
+  printf("%d names, %s\n\n", names, compile_opts);
+  printf("%-26s %10s %10s  %s\n", "benchmark", "ns/op", "allocs/op", "");
+
+  for (b = 0; b < sizeof(benchmarks)/sizeof(benchmarks[0]); b++)
+    {
+      struct benchmark *bm = &benchmarks[b];
+      unsigned long iters = 1000, start_allocs;
+      struct timespec start;
+      double ns;
+
+      if (patterns < argc)
+	{
+	  for (i = patterns; i < argc && !strstr(bm->name, argv[i]); i++);
+	  if (i == argc)
+	    continue;
+	}
+
+      if (!bm->func)
+	{
+	  printf("%-26s %10s %10s  %s\n", bm->name, "-", "-", bm->note);
+	  continue;
+	}
+
+      /* Warm up, then grow the run until it takes long enough to time. */
+      for (i = 0; i < 1000; i++)
+	bm->func(i);
+
+      while (1)
+	{
+	  start_allocs = allocs;
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+	  for (i = 0; i < (int)iters; i++)
+	    bm->func(i);
+	  ns = elapsed(&start);
+
+	  if (ns >= target || iters >= 1UL << 30)
+	    break;
+
+	  iters = (ns < target / 10) ? iters * 10 : (unsigned long)(iters * 1.2 * target / ns);
+	}
+
+      printf("%-26s %10.1f %10.3f  %s\n", bm->name, ns / iters, (double)(allocs - start_allocs) / iters, bm->note);
+    }
+
+  return 0;
+}
@@ -0,0 +1,678 @@
+/* dnsmasq is Copyright (c) 2000-2026 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+/* dns_replay [options] <capture> */
+
+/* Replay the client queries in a packet dump made by dnsmasq's --dumpfile
+   against a running dnsmasq, whilst acting as its upstream server and
+   answering from the upstream replies in the same capture. Prints the
+   throughput, latency percentiles and cache hit rate seen.
+
+   In a pcapng capture (--dumpformat=pcapng) each packet's type is known
+   from its interface. In a pcap capture all queries are taken as client
+   queries and all replies as upstream replies, so it should be made
+   with --dumpmask=0x0009.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+#define PCAP_MAGIC  0xa1b2c3d4
+#define PCAPNG_SHB  0x0A0D0D0A
+#define PCAPNG_IDB  0x00000001
+#define PCAPNG_EPB  0x00000006
+#define PCAPNG_BOM  0x1A2B3C4D
+#define MAX_IFACES  64
+#define HASH_SIZE   65536
+#define PACKETSZ    4096
+
+#define SERVFAIL    2
+
+struct query {
+  u8 *data;
+  size_t len;
+  u64 time; /* ns */
+};
+
+struct answer {
+  u8 *data, *key;
+  size_t len, keylen;
+  struct answer *next;
+};
+
+/* Queries awaiting an answer, indexed by the ID we gave them, and
+   linked oldest first for timeouts. */
+static struct pending {
+  u64 sent;
+  int in_use, prev, next;
+} pending[65536];
+
+static int oldest = -1, newest = -1;
+
+static struct query *queries;
+static size_t query_count, query_max;
+static struct answer *answers[HASH_SIZE];
+static size_t answer_count;
+
+static void die(char *message, char *arg)
+{
+  fprintf(stderr, "dns_replay: ");
+  fprintf(stderr, message, arg ? arg : "", strerror(errno));
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static u64 now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u32 get32(u8 *p)
+{
+  u32 v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* The question of a DNS message, lower-cased, for use as a key.
+   Returns its length or zero if there isn't one. */
+static size_t question_key(u8 *msg, size_t len, u8 *key)
+{
+  size_t p = 12;
+
+  if (len < 12 || ((msg[4] << 8) | msg[5]) == 0)
+    return 0;
+
+  while (p < len && msg[p] != 0)
+    {
+      if ((msg[p] & 0xc0) || p + msg[p] + 1 > len || p + msg[p] + 1 > PACKETSZ)
+	return 0;
+      p += msg[p] + 1;
+    }
+
+  if ((p += 5) > len)
+    return 0;
+
+  for (len = 12; len < p; len++)
+    key[len - 12] = tolower(msg[len]);
+
+  return p - 12;
+}
+
+static unsigned int hash_key(u8 *key, size_t len)
+{
+  unsigned int h = 0;
+
+  while (len--)
+    h = h * 31 + *key++;
+
+  return h % HASH_SIZE;
+}
+
+static struct answer *find_answer(u8 *key, size_t keylen)
+{
+  struct answer *a;
+
+  for (a = answers[hash_key(key, keylen)]; a; a = a->next)
+    if (a->keylen == keylen && memcmp(a->key, key, keylen) == 0)
+      return a;
+
+  return NULL;
+}
+
+/* Take the DNS message from a raw IPv4 or IPv6 UDP packet, or return NULL. */
+static u8 *dns_payload(u8 *pkt, size_t caplen, size_t *len)
+{
+  size_t hl;
+
+  if (caplen < 20)
+    return NULL;
+
+  if ((pkt[0] >> 4) == 4)
+    {
+      hl = (pkt[0] & 15) * 4;
+      if (pkt[9] != IPPROTO_UDP)
+	return NULL;
+    }
+  else if ((pkt[0] >> 4) == 6 && caplen >= 40)
+    {
+      hl = 40;
+      if (pkt[6] != IPPROTO_UDP)
+	return NULL;
+    }
+  else
+    return NULL;
+
+  if (caplen < hl + 8 + 12)
+    return NULL;
+
+  *len = caplen - hl - 8;
+  return pkt + hl + 8;
+}
+
+/* type is 1 for a client query, 2 for an upstream reply, 0 for unknown
+   in which case the QR bit decides. */
+static void add_packet(u8 *pkt, size_t caplen, u64 time, int type)
+{
+  size_t len;
+  u8 *msg, key[PACKETSZ];
+  int qr;
+
+  if (!(msg = dns_payload(pkt, caplen, &len)))
+    return;
+
+  qr = msg[2] & 0x80;
+
+  if (type == 0)
+    type = qr ? 2 : 1;
+
+  if (type == 1 && !qr)
+    {
+      if (query_count == query_max)
+	{
+	  query_max = query_max ? 2 * query_max : 1024;
+	  if (!(queries = realloc(queries, query_max * sizeof(struct query))))
+	    die("out of memory", NULL);
+	}
+      queries[query_count].data = msg;
+      queries[query_count].len = len;
+      queries[query_count++].time = time;
+    }
+  else if (type == 2 && qr)
+    {
+      struct answer *a;
+      size_t keylen = question_key(msg, len, key);
+
+      if (keylen == 0)
+	return;
+
+      /* Latest reply wins. */
+      if (!(a = find_answer(key, keylen)))
+	{
+	  unsigned int h = hash_key(key, keylen);
+
+	  if (!(a = malloc(sizeof(struct answer))) || !(a->key = malloc(keylen)))
+	    die("out of memory", NULL);
+	  memcpy(a->key, key, keylen);
+	  a->keylen = keylen;
+	  a->next = answers[h];
+	  answers[h] = a;
+	  answer_count++;
+	}
+      a->data = msg;
+      a->len = len;
+    }
+}
+
+static void read_capture(char *file)
+{
+  FILE *f;
+  u8 *buf;
+  long size;
+  size_t p;
+
+  if (!(f = fopen(file, "r")) ||
+      fseek(f, 0, SEEK_END) == -1 ||
+      (size = ftell(f)) == -1 ||
+      fseek(f, 0, SEEK_SET) == -1)
+    die("cannot open %s: %s", file);
+
+  if (size < 24 || !(buf = malloc(size)) || fread(buf, 1, size, f) != (size_t)size)
+    die("cannot read %s: %s", file);
+
+  fclose(f);
+
+  if (get32(buf) == PCAP_MAGIC)
+    {
+      for (p = 24; p + 16 <= (size_t)size; )
+	{
+	  u32 incl_len = get32(buf + p + 8);
+
+	  if (p + 16 + incl_len > (size_t)size)
+	    break;
+	  add_packet(buf + p + 16, incl_len, (u64)get32(buf + p) * 1000000000 + (u64)get32(buf + p + 4) * 1000, 0);
+	  p += 16 + incl_len;
+	}
+    }
+  else if (get32(buf) == PCAPNG_SHB && get32(buf + 8) == PCAPNG_BOM)
+    {
+      int types[MAX_IFACES];
+      u64 units[MAX_IFACES];
+      int ifaces = 0;
+
+      for (p = 0; p + 12 <= (size_t)size; )
+	{
+	  u32 type = get32(buf + p), len = get32(buf + p + 4);
+
+	  if (len < 12 || p + len > (size_t)size)
+	    break;
+
+	  if (type == PCAPNG_SHB)
+	    ifaces = 0;
+	  else if (type == PCAPNG_IDB && ifaces < MAX_IFACES)
+	    {
+	      size_t o = p + 16;
+	      u16 link_type;
+
+	      memcpy(&link_type, buf + p + 8, 2);
+	      types[ifaces] = -1;
+	      units[ifaces] = 1000; /* microseconds unless told otherwise */
+
+	      while (o + 4 <= p + len - 4)
+		{
+		  u16 code, olen;
+
+		  memcpy(&code, buf + o, 2);
+		  memcpy(&olen, buf + o + 2, 2);
+
+		  if (code == 0 || o + 4 + olen > p + len - 4)
+		    break;
+
+		  if (code == 2) /* if_name, the packet type in dnsmasq's captures */
+		    {
+		      if (olen == 5 && memcmp(buf + o + 4, "query", 5) == 0)
+			types[ifaces] = 1;
+		      else if (olen == 14 && memcmp(buf + o + 4, "upstream-reply", 14) == 0)
+			types[ifaces] = 2;
+		      else
+			types[ifaces] = -2;
+		    }
+		  else if (code == 9 && olen >= 1 && !(buf[o + 4] & 0x80)) /* if_tsresol */
+		    {
+		      int i;
+
+		      for (units[ifaces] = 1000000000, i = 0; i < buf[o + 4] && units[ifaces] > 1; i++)
+			units[ifaces] /= 10;
+		    }
+
+		  o += 4 + ((olen + 3) & ~3);
+		}
+
+	      /* -2: ignore, -1: unnamed, go by the QR bit. Only raw IP is understood. */
+	      if (link_type != 101)
+		types[ifaces] = -2;
+
+	      ifaces++;
+	    }
+	  else if (type == PCAPNG_EPB && len >= 32)
+	    {
+	      u32 iface = get32(buf + p + 8), incl_len = get32(buf + p + 20);
+	      u64 ts = ((u64)get32(buf + p + 12) << 32) | get32(buf + p + 16);
+
+	      if (iface < (u32)ifaces && types[iface] != -2 && 28 + incl_len <= len)
+		add_packet(buf + p + 28, incl_len, ts * units[iface], types[iface] == -1 ? 0 : types[iface]);
+	    }
+
+	  p += len;
+	}
+    }
+  else
+    die("%s is not a pcap or pcapng file written by dnsmasq", file);
+
+  if (query_count == 0)
+    die("no client queries in %s", file);
+}
+
+/* <address>[#<port>], as in dnsmasq's own options. */
+static void parse_addr(char *arg, struct sockaddr_storage *addr, socklen_t *len)
+{
+  struct sockaddr_in *in = (struct sockaddr_in *)addr;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+  char *hash = strchr(arg, '#');
+  int port = 53;
+
+  if (hash)
+    {
+      *hash = 0;
+      port = atoi(hash + 1);
+    }
+
+  memset(addr, 0, sizeof(*addr));
+
+  if (inet_pton(AF_INET, arg, &in->sin_addr) == 1)
+    {
+      in->sin_family = AF_INET;
+      in->sin_port = htons(port);
+      *len = sizeof(*in);
+    }
+  else if (inet_pton(AF_INET6, arg, &in6->sin6_addr) == 1)
+    {
+      in6->sin6_family = AF_INET6;
+      in6->sin6_port = htons(port);
+      *len = sizeof(*in6);
+    }
+  else
+    die("bad address %s", arg);
+}
+
+/* Answer queries sent to us by dnsmasq. */
+static void upstream_reply(int fd, unsigned long *upstream, unsigned long *unknown)
+{
+  u8 msg[PACKETSZ], key[PACKETSZ];
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  ssize_t n;
+
+  while ((fromlen = sizeof(from)),
+	 (n = recvfrom(fd, msg, sizeof(msg), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen)) > 0)
+    {
+      size_t keylen = question_key(msg, n, key);
+      struct answer *a;
+
+      (*upstream)++;
+
+      if (keylen != 0 && (a = find_answer(key, keylen)))
+	{
+	  u8 reply[65536];
+
+	  memcpy(reply, a->data, a->len);
+	  memcpy(reply, msg, 2); /* ID */
+	  sendto(fd, reply, a->len, 0, (struct sockaddr *)&from, fromlen);
+	}
+      else
+	{
+	  (*unknown)++;
+
+	  if (keylen != 0)
+	    {
+	      /* SERVFAIL, with the question. */
+	      msg[2] = (msg[2] & 0x01) | 0x80;
+	      msg[3] = (msg[3] & 0x70) | SERVFAIL;
+	      memset(msg + 6, 0, 6);
+	      sendto(fd, msg, 12 + keylen, 0, (struct sockaddr *)&from, fromlen);
+	    }
+	}
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(u32 *v, size_t n, double p)
+{
+  size_t i = (size_t)(p * n / 100);
+
+  if (n == 0)
+    return 0;
+
+  return (i >= n ? v[n - 1] : v[i]) / 1000.0;
+}
+
+static void pending_add(int id, u64 now)
+{
+  pending[id].in_use = 1;
+  pending[id].sent = now;
+  pending[id].prev = newest;
+  pending[id].next = -1;
+
+  if (newest == -1)
+    oldest = id;
+  else
+    pending[newest].next = id;
+
+  newest = id;
+}
+
+static void pending_remove(int id)
+{
+  pending[id].in_use = 0;
+
+  if (pending[id].prev == -1)
+    oldest = pending[id].next;
+  else
+    pending[pending[id].prev].next = pending[id].next;
+
+  if (pending[id].next == -1)
+    newest = pending[id].prev;
+  else
+    pending[pending[id].next].prev = pending[id].prev;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+	  "usage: dns_replay [-s <address>[#<port>]] [-u <address>[#<port>]|-U] [-r <qps>|-x <factor>|-f]\n"
+	  "                  [-w <outstanding>] [-n <queries>] [-t <timeout>] <capture>\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_storage server, stub;
+  socklen_t server_len, stub_len;
+  char server_arg[] = "127.0.0.1", stub_arg[] = "127.0.0.1#5353";
+  double rate = 0, factor = 1;
+  unsigned long total = 0, window = 0, sent = 0, answered = 0, lost = 0, upstream = 0, unknown = 0;
+  unsigned long rcodes[16];
+  u64 timeout = 2000000000ULL, start, last_answer, span;
+  unsigned int outstanding = 0;
+  int c, sfd, ufd = -1, use_stub = 1, flood = 0, bufsize = 4 * 1024 * 1024;
+  u16 next_id = 0;
+  u32 *latency;
+  double elapsed, sum = 0;
+  size_t i;
+
+  parse_addr(server_arg, &server, &server_len);
+  parse_addr(stub_arg, &stub, &stub_len);
+
+  while ((c = getopt(argc, argv, "s:u:Ur:x:fw:n:t:")) != -1)
+    switch (c)
+      {
+      case 's':
+	parse_addr(optarg, &server, &server_len);
+	break;
+      case 'u':
+	parse_addr(optarg, &stub, &stub_len);
+	break;
+      case 'U':
+	use_stub = 0;
+	break;
+      case 'r':
+	rate = atof(optarg);
+	break;
+      case 'x':
+	if ((factor = atof(optarg)) <= 0)
+	  usage();
+	break;
+      case 'f':
+	flood = 1;
+	break;
+      case 'w':
+	window = strtoul(optarg, NULL, 10);
+	break;
+      case 'n':
+	total = strtoul(optarg, NULL, 10);
+	break;
+      case 't':
+	timeout = (u64)(atof(optarg) * 1e9);
+	break;
+      default:
+	usage();
+      }
+
+  if (optind != argc - 1)
+    usage();
+
+  read_capture(argv[optind]);
+
+  if (total == 0)
+    total = query_count;
+  if (window == 0 || window > 65535)
+    window = 65535;
+
+  if (!(latency = malloc(total * sizeof(u32))))
+    die("out of memory", NULL);
+  memset(rcodes, 0, sizeof(rcodes));
+
+  printf("%zu client queries and %zu upstream answers in %s\n", query_count, answer_count, argv[optind]);
+
+  if (use_stub &&
+      ((ufd = socket(stub.ss_family, SOCK_DGRAM, 0)) == -1 ||
+       bind(ufd, (struct sockaddr *)&stub, stub_len) == -1))
+    die("cannot listen for upstream queries: %s", NULL);
+
+  if ((sfd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1 ||
+      connect(sfd, (struct sockaddr *)&server, server_len) == -1)
+    die("cannot connect to dnsmasq: %s", NULL);
+
+  setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+  /* Duration of one pass through the capture, for looping with recorded timing. */
+  span = queries[query_count - 1].time - queries[0].time + 1000000;
+
+  start = last_answer = now_ns();
+
+  while (sent < total || outstanding != 0)
+    {
+      u64 now = now_ns(), due = 0;
+      struct pollfd fds[2];
+      struct timespec ts;
+      u8 msg[65536];
+      ssize_t n;
+
+      /* Send everything which is due, whilst there are IDs free. */
+      while (sent < total && outstanding < window && outstanding < 65536)
+	{
+	  struct query *q = &queries[sent % query_count];
+
+	  if (flood)
+	    due = 0;
+	  else if (rate > 0)
+	    due = start + (u64)(sent * 1e9 / rate);
+	  else
+	    due = start + (u64)(((sent / query_count) * span + (q->time - queries[0].time)) / factor);
+
+	  if (due > now)
+	    break;
+
+	  while (pending[next_id].in_use)
+	    next_id++;
+
+	  memcpy(msg, q->data, q->len);
+	  msg[0] = next_id >> 8;
+	  msg[1] = next_id & 0xff;
+
+	  if (send(sfd, msg, q->len, 0) == -1)
+	    {
+	      if (errno == EAGAIN || errno == ENOBUFS)
+		break;
+	      die("cannot send to dnsmasq: %s", NULL);
+	    }
+
+	  pending_add(next_id++, now);
+	  outstanding++;
+	  sent++;
+	}
+
+      /* Give up on old queries. */
+      while (oldest != -1 && now - pending[oldest].sent >= timeout)
+	{
+	  pending_remove(oldest);
+	  outstanding--;
+	  lost++;
+	}
+
+      /* Sleep until the next send, timeout or packet. */
+      fds[0].fd = sfd;
+      fds[0].events = POLLIN;
+      fds[1].fd = ufd;
+      fds[1].events = POLLIN;
+
+      if (sent < total && outstanding < window && outstanding < 65536 && due > now)
+	now = due - now;
+      else if (oldest != -1)
+	now = pending[oldest].sent + timeout - now;
+      else
+	now = 1000000;
+
+      ts.tv_sec = now / 1000000000;
+      ts.tv_nsec = now % 1000000000;
+
+      if (ppoll(fds, ufd == -1 ? 1 : 2, &ts, NULL) == -1 && errno != EINTR)
+	die("poll failed: %s", NULL);
+
+      if (ufd != -1 && (fds[1].revents & POLLIN))
+	upstream_reply(ufd, &upstream, &unknown);
+
+      if (fds[0].revents & POLLIN)
+	while ((n = recv(sfd, msg, sizeof(msg), MSG_DONTWAIT)) >= 12)
+	  {
+	    u16 id = (msg[0] << 8) | msg[1];
+	    u64 t = now_ns();
+
+	    if (!pending[id].in_use)
+	      continue;
+
+	    pending_remove(id);
+	    outstanding--;
+	    latency[answered++] = (t - pending[id].sent) / 1000;
+	    rcodes[msg[3] & 0x0f]++;
+	    last_answer = t;
+	  }
+    }
+
+  /* Anything sent to the stub after the last answer. */
+  if (ufd != -1)
+    upstream_reply(ufd, &upstream, &unknown);
+
+  elapsed = (last_answer - start) / 1e9;
+  qsort(latency, answered, sizeof(u32), cmp_u32);
+  for (i = 0; i < answered; i++)
+    sum += latency[i];
+
+  printf("queries sent:      %lu\n", sent);
+  printf("answers received:  %lu (%.2f%%)\n", answered, sent ? 100.0 * answered / sent : 0);
+  printf("lost:              %lu\n", lost);
+  printf("duration:          %.3f s\n", elapsed);
+  printf("throughput:        %.1f answers/s\n", elapsed > 0 ? answered / elapsed : 0);
+  printf("latency (ms):      mean %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+	 answered ? sum / answered / 1000 : 0,
+	 percentile(latency, answered, 50), percentile(latency, answered, 90),
+	 percentile(latency, answered, 99), percentile(latency, answered, 99.9),
+	 percentile(latency, answered, 100));
+  printf("rcodes:            NOERROR %lu NXDOMAIN %lu SERVFAIL %lu REFUSED %lu other %lu\n",
+	 rcodes[0], rcodes[3], rcodes[2], rcodes[5], answered - rcodes[0] - rcodes[2] - rcodes[3] - rcodes[5]);
+
+  if (ufd != -1)
+    {
+      printf("upstream queries:  %lu (%lu not in capture)\n", upstream, unknown);
+      printf("cache hit rate:    %.2f%%\n",
+	     (answered && upstream < answered) ? 100.0 * (answered - upstream) / answered : 0);
+    }
+
+  return lost != 0;
+}
@@ -79,7 +79,7 @@ static struct blockdata *new_block(void)
   return NULL;
 }
 
-static struct blockdata *blockdata_alloc_real(int fd, char *data, size_t len)
+struct blockdata *blockdata_alloc(char *data, size_t len)
 {
   struct blockdata *block, *ret = NULL;
   struct blockdata **prev = &ret;
@@ -94,19 +94,10 @@ static struct blockdata *blockdata_alloc_real(int fd, char *data, size_t len)
 	  return NULL;
 	}
 
-      if ((blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len) > 0)
+      if ((blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len) > 0 && data)
 	{
-	  if (data)
-	    {
-	      memcpy(block->key, data, blen);
-	      data += blen;
-	    }
-	  else if (!read_write(fd, block->key, blen, RW_READ))
-	    {
-	      /* failed read free partial chain */
-	      blockdata_free(ret);
-	      return NULL;
-	    }
+	  memcpy(block->key, data, blen);
+	  data += blen;
 	}
       
       len -= blen;
@@ -117,11 +108,6 @@ static struct blockdata *blockdata_alloc_real(int fd, char *data, size_t len)
   return ret;
 }
 
-struct blockdata *blockdata_alloc(char *data, size_t len)
-{
-  return blockdata_alloc_real(0, data, len);
-}
-
 /* Add data to the end of the block. 
    newlen is length of new data, NOT total new length. 
    Use blockdata_alloc(NULL, 0) to make empty block to add to. */
@@ -224,18 +210,3 @@ void *blockdata_retrieve(struct blockdata *block, size_t len, void *data)
   return data;
 }
 
-
-void blockdata_write(struct blockdata *block, size_t len, int fd)
-{
-  for (; len > 0 && block; block = block->next)
-    {
-      size_t blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
-      read_write(fd, block->key, blen, RW_WRITE);
-      len -= blen;
-    }
-}
-
-struct blockdata *blockdata_read(int fd, size_t len)
-{
-  return blockdata_alloc_real(fd, NULL, len);
-}
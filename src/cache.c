@@ -16,12 +16,106 @@
 
 #include "dnsmasq.h"
 
-static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL;
+/* The cache is split into daemon->cache_shards shards. Each owns a fixed
+   part of the cache array, with its own LRU lists, hash tables and expiry
+   heap, so that eviction and expiry only ever touch one shard. An entry
+   lives in the shard chosen by the hash of its name, except for reverse-only
+   entries, which are found by address and so go in the shard chosen by that. */
+struct cache_shard {
+  struct crec *head, *tail, **hash_table, **type_table, **expire_heap;
+  struct crec *probe_head, *probe_tail; /* --cache-policy=2q */
+  unsigned int *type_unindexed; /* per hash bucket, entries not in the type index */
+  int size, live, hash_size, expire_count, probe_count, probe_max;
+};
+
+static struct cache_shard *shards = NULL;
 static struct crec *config_spare = NULL;
 static struct crec *new_chain = NULL;
 static int insert_error;
 static union bigname *big_free = NULL;
-static int bignames_left, hash_size;
+static int bignames_left;
+
+/* Entries which can be found by name are also kept in a second hash table
+   keyed on name and record type, so that a lookup for one type doesn't
+   walk past the entries for all the other types of the same name. */
+#define TYPE_CLASSES (F_IPV4 | F_IPV6 | F_CNAME | F_DNSKEY | F_DS | F_RR)
+
+/* --cache-policy=2q: new entries go on a probation list, and are
+   promoted to the main LRU list if they're used again before they reach its
+   end. Names evicted from probation are remembered in a count-min sketch,
+   and go straight to the main list if they're fetched again soon. */
+static unsigned char *sketch = NULL;
+static unsigned int sketch_mask, sketch_ops;
+
+/* Answer cache: complete replies built by answer_request() from local data. */
+struct answer {
+  unsigned int hash;
+  unsigned short flags, udp_size, qend, len, size, names;
+  unsigned short name_hash[ANSWER_CACHE_NAMES];
+  unsigned char *reply;
+};
+
+static struct answer *answer_cache = NULL;
+static struct answer answer_key;
+static int answer_recording, answer_volatile;
+static unsigned int answer_name_map[ANSWER_CACHE_MAP];
+
+/* Subnet cache: replies to queries with an EDNS0 client subnet, each good
+   for clients inside the scope prefix the upstream server returned.
+   A name hashes to a set of daemon->subnet_cache_scopes slots, which
+   bounds the number of scopes kept for any one name. */
+struct subnet_answer {
+  unsigned int hash;
+  unsigned short flags, qend, len, size, opt_offset;
+  struct subnet_opt subnet; /* scope_netmask is the prefix the answer covers. */
+  time_t stored, expires;
+  unsigned char *reply;
+};
+
+static struct subnet_answer *subnet_cache = NULL;
+static int subnet_sets;
+
+/* A TCP child sends each insert transaction to the main process as one
+   message: PIPE_OP_INSERT, a struct pipe_insert, then for each entry a
+   struct pipe_rec followed by the name and any block data. A cache
+   snapshot holds the same records after a struct snapshot_hdr, with
+   ttd as wall-clock time, and the target name as a CNAME's data. */
+struct pipe_insert {
+  unsigned int version, len;
+};
+
+struct pipe_rec {
+  time_t ttd;
+  union all_addr addr;
+  unsigned int flags, datalen;
+  unsigned short namelen, class;
+};
+
+struct snapshot_hdr {
+  char magic[8];
+  unsigned int version, recsize, count, len;
+};
+
+static unsigned char *pipe_buff = NULL;
+static size_t pipe_size, pipe_used;
+static int pipe_error, bulk_load;
+
+/* Shared cache: address records committed by the main process are copied
+   into a ring in memory shared with the TCP children, which import
+   what's new before answering each query. The main process is the only
+   writer, a reader skips a slot whose sequence number is odd, or changes
+   whilst it's being copied. Each slot records the index at which its
+   insert transaction started, so that a reader which has been lapped
+   never takes part of an RRset. */
+struct shared_entry {
+  unsigned int seq, batch, flags;
+  time_t ttd;
+  union all_addr addr;
+  char name[SHARED_CACHE_NAME];
+};
+
+static struct shared_entry *shared_cache = NULL;
+static unsigned int *shared_head, shared_next, shared_batch, shared_mask;
 
 struct nameblock {
   struct nameblock *next;
@@ -33,9 +127,12 @@ static void make_non_terminals(struct crec *source);
 static struct crec *really_insert(char *name, union all_addr *addr, unsigned short class,
 				  time_t now,  unsigned long ttl, unsigned int flags);
 static void dump_cache_entry(struct crec *cache, time_t now);
+static void end_insert(int fd);
 static char *querystr(char *desc, unsigned short type);
+static unsigned int answer_name_index(char *name);
+static void answer_cache_check(char *name);
 
-/* type->string mapping: this is also used by the name-hash function as a mixing table. */
+/* type->string mapping */
 /* taken from https://www.iana.org/assignments/dns-parameters/dns-parameters.xhtml */
 static const struct {
   unsigned int type;
@@ -141,8 +238,13 @@ static const struct {
 };
 
 static void cache_free(struct crec *crecp);
+static void expire_add(struct crec *crecp);
+static void expire_remove(struct crec *crecp);
 static void cache_unlink(struct crec *crecp);
 static void cache_link(struct crec *crecp);
+static void cache_link_tail(struct crec *crecp);
+static void cache_hit(struct crec *crecp);
+static unsigned int sketch_count(unsigned int hash);
 static void rehash(int size);
 static void cache_hash(struct crec *crecp);
 
@@ -176,24 +278,82 @@ void next_uid(struct crec *crecp)
 void cache_init(void)
 {
   struct crec *crecp;
-  int i;
+  int i, n;
  
   bignames_left = daemon->cachesize/10;
+
+  /* Every shard needs at least one entry. */
+  if (daemon->cache_shards > daemon->cachesize)
+    daemon->cache_shards = daemon->cachesize > 0 ? daemon->cachesize : 1;
+
+  shards = safe_malloc(daemon->cache_shards * sizeof(struct cache_shard));
   
   if (daemon->cachesize > 0)
     {
       crecp = safe_malloc(daemon->cachesize*sizeof(struct crec));
       
-      for (i=0; i < daemon->cachesize; i++, crecp++)
+      for (n = 0; n < daemon->cache_shards; n++)
 	{
-	  cache_link(crecp);
-	  crecp->flags = 0;
-	  crecp->uid = UID_NONE;
+	  struct cache_shard *sh = &shards[n];
+
+	  sh->size = daemon->cachesize / daemon->cache_shards;
+	  if (n < daemon->cachesize % daemon->cache_shards)
+	    sh->size++;
+	  sh->expire_heap = safe_malloc(sh->size * sizeof(struct crec *));
+	  
+	  for (i = 0; i < sh->size; i++, crecp++)
+	    {
+	      crecp->shard = n;
+	      cache_link(crecp);
+	      crecp->flags = 0;
+	      crecp->uid = UID_NONE;
+	      crecp->expire_idx = 0;
+	    }
 	}
     }
   
   /* create initial hash table*/
   rehash(daemon->cachesize);
+
+  if (daemon->answer_cache_size > 0)
+    answer_cache = safe_malloc(daemon->answer_cache_size * sizeof(struct answer));
+
+  if (daemon->subnet_cache_size > 0)
+    {
+      if ((subnet_sets = daemon->subnet_cache_size / daemon->subnet_cache_scopes) == 0)
+	subnet_sets = 1;
+      subnet_cache = safe_malloc(subnet_sets * daemon->subnet_cache_scopes * sizeof(struct subnet_answer));
+    }
+
+  if (daemon->shared_cache_size > 0)
+    {
+      void *mem;
+
+      /* A power of two, so that the slot index survives the indices wrapping. */
+      for (shared_mask = 1; shared_mask < (unsigned int)daemon->shared_cache_size; shared_mask <<= 1);
+      daemon->shared_cache_size = (int)shared_mask--;
+      
+      /* The head index gets a slot of its own, at the start. */
+      mem = mmap(NULL, (daemon->shared_cache_size + 1) * sizeof(struct shared_entry),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+      if (mem == MAP_FAILED)
+	die(_("cannot create shared cache: %s"), NULL, EC_NOMEM);
+
+      shared_head = mem;
+      shared_cache = (struct shared_entry *)mem + 1;
+    }
+
+  if (daemon->cache_policy == CACHE_POLICY_2Q && daemon->cachesize > 0)
+    {
+      for (sketch_mask = 64; sketch_mask < (unsigned int)daemon->cachesize; sketch_mask <<= 1);
+      sketch = safe_malloc(CACHE_SKETCH_DEPTH * sketch_mask);
+      sketch_mask--;
+      
+      for (n = 0; n < daemon->cache_shards; n++)
+	if ((shards[n].probe_max = (shards[n].size * CACHE_PROBATION) / 100) == 0)
+	  shards[n].probe_max = 1;
+    }
 }
 
 static struct crec *get_config_crec(void)
@@ -254,59 +414,165 @@ static void free_names(unsigned int index)
       block->last = 0;
 }
 
-/* In most cases, we create the hash table once here by calling this with (hash_table == NULL)
-   but if the hosts file(s) are big (some people have 50000 ad-block entries), the table
+/* In most cases, we create the hash tables once here by calling this with (hash_table == NULL)
+   but if the hosts file(s) are big (some people have 50000 ad-block entries), the tables
    will be much too small, so the hosts reading code calls rehash every 1000 addresses, to
-   expand the table. */
+   expand them. size is for the whole cache, the shards get a share each. */
 static void rehash(int size)
 {
-  struct crec **new, **old, *p, *tmp;
-  int i, new_size, old_size;
+  int n;
+
+  for (n = 0; n < daemon->cache_shards; n++)
+    {
+      struct cache_shard *sh = &shards[n];
+      struct crec **new, **new_type, **old, *p, *tmp;
+      unsigned int *new_unindexed;
+      int i, new_size, old_size;
+      
+      /* hash_size is a power of two. */
+      for (new_size = 64; new_size < size/(10 * daemon->cache_shards); new_size = new_size << 1);
+      
+      /* must succeed in getting first instance, failure later is non-fatal */
+      if (!sh->hash_table)
+	{
+	  new = safe_malloc(new_size * sizeof(struct crec *));
+	  new_type = safe_malloc(new_size * sizeof(struct crec *));
+	  new_unindexed = safe_malloc(new_size * sizeof(unsigned int));
+	}
+      else if (new_size <= sh->hash_size || !(new = whine_malloc(new_size * sizeof(struct crec *))))
+	continue;
+      else if (!(new_type = whine_malloc(new_size * sizeof(struct crec *))))
+	{
+	  free(new);
+	  continue;
+	}
+      else if (!(new_unindexed = whine_malloc(new_size * sizeof(unsigned int))))
+	{
+	  free(new);
+	  free(new_type);
+	  continue;
+	}
+      
+      for (i = 0; i < new_size; i++)
+	{
+	  new[i] = new_type[i] = NULL;
+	  new_unindexed[i] = 0;
+	}
+      
+      old = sh->hash_table;
+      old_size = sh->hash_size;
+      sh->hash_table = new;
+      sh->hash_size = new_size;
+      free(sh->type_table);
+      sh->type_table = new_type;
+      free(sh->type_unindexed);
+      sh->type_unindexed = new_unindexed;
+      
+      if (old)
+	{
+	  for (i = 0; i < old_size; i++)
+	    for (p = old[i]; p ; p = tmp)
+	      {
+		tmp = p->hash_next;
+		cache_hash(p);
+	      }
+	  free(old);
+	}
+    }
+}
+
+/* The shard for an entry with these flags, name hash and address. */
+static int shard_index(unsigned int flags, unsigned int hash, union all_addr *addr)
+{
+  if (daemon->cache_shards == 1)
+    return 0;
+
+  if ((flags & (F_FORWARD | F_REVERSE)) == F_REVERSE && addr)
+    {
+      unsigned char *p = (unsigned char *)addr;
+      int i, len = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
 
-  /* hash_size is a power of two. */
-  for (new_size = 64; new_size < size/10; new_size = new_size << 1);
+      for (hash = 0, i = 0; i < len; i++)
+	hash = (hash * 31) + p[i];
+    }
   
-  /* must succeed in getting first instance, failure later is non-fatal */
-  if (!hash_table)
-    new = safe_malloc(new_size * sizeof(struct crec *));
-  else if (new_size <= hash_size || !(new = whine_malloc(new_size * sizeof(struct crec *))))
-    return;
+  /* Mix, so as not to depend on the low bits which choose the hash bucket. */
+  return ((hash * 0x9e3779b9u) >> 16) % daemon->cache_shards;
+}
+
+static struct cache_shard *name_shard(unsigned int hash)
+{
+  return &shards[shard_index(F_FORWARD, hash, NULL)];
+}
+
+static struct crec **hash_bucket(struct cache_shard *sh, unsigned int hash)
+{
+  /* hash_size is a power of two */
+  return sh->hash_table + (hash & (sh->hash_size - 1));
+}
+
+/* The type index list an entry belongs on. Negative answers for a name
+   have their own list, since they match lookups for any type. Zero for
+   entries which can't be found by name, or which have no record type. */
+static unsigned int type_class(unsigned int flags)
+{
+  if (!(flags & F_FORWARD))
+    return 0;
 
-  for (i = 0; i < new_size; i++)
-    new[i] = NULL;
+  if (flags & F_NXDOMAIN)
+    return F_NXDOMAIN;
 
-  old = hash_table;
-  old_size = hash_size;
-  hash_table = new;
-  hash_size = new_size;
+  return flags & TYPE_CLASSES;
+}
+
+static struct crec **type_bucket(struct cache_shard *sh, unsigned int hash, unsigned int class)
+{
+  return sh->type_table + ((hash + class * 0x9e3779b9u) & (sh->hash_size - 1));
+}
+
+static unsigned int *unindexed_count(struct cache_shard *sh, unsigned int hash)
+{
+  return sh->type_unindexed + (hash & (sh->hash_size - 1));
+}
+
+static void type_hash(struct crec *crecp)
+{
+  unsigned int class = type_class(crecp->flags);
+  struct crec **up;
+  
+  crecp->type_next = NULL;
+  crecp->type_pprev = NULL;
   
-  if (old)
+  if (class == 0)
+    return;
+
+  /* More than one type: only the hash chains can find it, so
+     lookups of names in its hash bucket have to use them. */
+  if (class & (class - 1))
     {
-      for (i = 0; i < old_size; i++)
-	for (p = old[i]; p ; p = tmp)
-	  {
-	    tmp = p->hash_next;
-	    cache_hash(p);
-	  }
-      free(old);
+      (*unindexed_count(&shards[crecp->shard], crecp->name_hash))++;
+      return;
     }
-}
+
+  /* Append, so that entries for one name stay in the order they arrived. */
+  for (up = type_bucket(&shards[crecp->shard], crecp->name_hash, class); *up; up = &(*up)->type_next);
   
-static struct crec **hash_bucket(char *name)
+  *up = crecp;
+  crecp->type_pprev = up;
+}
+
+static void type_unhash(struct crec *crecp)
 {
-  unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
-  const unsigned char *mix_tab = (const unsigned char*)typestr; 
+  unsigned int class = type_class(crecp->flags);
 
-  while((c = (unsigned char) *name++))
+  if (crecp->type_pprev)
     {
-      /* don't use tolower and friends here - they may be messed up by LOCALE */
-      if (c >= 'A' && c <= 'Z')
-	c += 'a' - 'A';
-      val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
-    } 
-  
-  /* hash_size is a power of two */
-  return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
+      if ((*crecp->type_pprev = crecp->type_next))
+	crecp->type_next->type_pprev = crecp->type_pprev;
+      crecp->type_pprev = NULL;
+    }
+  else if (class & (class - 1))
+    (*unindexed_count(&shards[crecp->shard], crecp->name_hash))--;
 }
 
 static void cache_hash(struct crec *crecp)
@@ -317,8 +583,17 @@ static void cache_hash(struct crec *crecp)
      This allows reverse searches and garbage collection to be optimised */
 
   char *name = cache_get_name(crecp);
-  struct crec **up = hash_bucket(name);
+  unsigned int hash = crecp->name_hash = hostname_hash(name);
+  struct crec **up;
   unsigned int flags = crecp->flags & (F_IMMORTAL | F_REVERSE);
+
+  /* Entries from the cache array are already in this shard, since
+     really_insert() takes them from there. */
+  crecp->shard = shard_index(crecp->flags, hash, &crecp->addr);
+  up = hash_bucket(&shards[crecp->shard], hash);
+
+  if (answer_cache && !(flags & F_REVERSE))
+    answer_cache_check(name);
   
   if (!(flags & F_REVERSE))
     {
@@ -333,12 +608,15 @@ static void cache_hash(struct crec *crecp)
   /* Preserve order when inserting the same name multiple times.
      Do not mess up the flag invariants. */
   while (*up &&
+	 (*up)->name_hash == hash &&
 	 hostname_isequal(cache_get_name(*up), name) &&
 	 flags == ((*up)->flags & (F_IMMORTAL | F_REVERSE)))
     up = &((*up)->hash_next);
   
   crecp->hash_next = *up;
   *up = crecp;
+
+  type_hash(crecp);
 }
 
 static void cache_blockdata_free(struct crec *crecp)
@@ -356,19 +634,142 @@ static void cache_blockdata_free(struct crec *crecp)
     }
 }
 
+/* Entries from the cache array which can expire are kept in a binary
+   min-heap ordered on the time they expire, so that cache_expire()
+   can find and free them without scanning the hash table. */
+static time_t expire_time(struct crec *crecp)
+{
+  /* See is_expired() */
+  if (daemon->cache_max_expiry > 0 && !(crecp->flags & (F_DS | F_DNSKEY)))
+    return crecp->ttd + daemon->cache_max_expiry;
+
+  return crecp->ttd;
+}
+
+static void expire_set(struct cache_shard *sh, int i, struct crec *crecp)
+{
+  sh->expire_heap[i] = crecp;
+  crecp->expire_idx = i + 1;
+}
+
+static void expire_sift(struct cache_shard *sh, int i)
+{
+  struct crec *crecp = sh->expire_heap[i];
+  time_t t = expire_time(crecp);
+  int child;
+  
+  /* up */
+  while (i != 0 && difftime(t, expire_time(sh->expire_heap[(i - 1) / 2])) < 0)
+    {
+      expire_set(sh, i, sh->expire_heap[(i - 1) / 2]);
+      i = (i - 1) / 2;
+    }
+
+  /* down */
+  while ((child = (2 * i) + 1) < sh->expire_count)
+    {
+      if (child + 1 < sh->expire_count &&
+	  difftime(expire_time(sh->expire_heap[child + 1]), expire_time(sh->expire_heap[child])) < 0)
+	child++;
+      
+      if (difftime(expire_time(sh->expire_heap[child]), t) >= 0)
+	break;
+      
+      expire_set(sh, i, sh->expire_heap[child]);
+      i = child;
+    }
+  
+  expire_set(sh, i, crecp);
+}
+
+static void expire_add(struct crec *crecp)
+{
+  struct cache_shard *sh = &shards[crecp->shard];
+  
+  /* Entries which never expire. */
+  if (!sh->expire_heap || (crecp->flags & F_IMMORTAL) ||
+      (daemon->cache_max_expiry == -1 && !(crecp->flags & (F_DS | F_DNSKEY))))
+    return;
+
+  if (sh->expire_count == sh->size)
+    return;
+
+  expire_set(sh, sh->expire_count++, crecp);
+  expire_sift(sh, sh->expire_count - 1);
+}
+
+static void expire_remove(struct crec *crecp)
+{
+  struct cache_shard *sh = &shards[crecp->shard];
+  int i = crecp->expire_idx - 1;
+
+  crecp->expire_idx = 0;
+
+  if (--sh->expire_count != i)
+    {
+      expire_set(sh, i, sh->expire_heap[sh->expire_count]);
+      expire_sift(sh, i);
+    }
+}
+
+/* Free expired entries in one shard, a batch at a time. */
+static void shard_expire(struct cache_shard *sh, time_t now)
+{
+  unsigned int reaped = 0;
+  
+  while (sh->expire_count != 0 && reaped < CACHE_EXPIRE_BATCH &&
+	 difftime(now, expire_time(sh->expire_heap[0])) >= 0)
+    {
+      struct crec *crecp = sh->expire_heap[0], **up;
+      
+      for (up = hash_bucket(sh, crecp->name_hash); *up; up = &(*up)->hash_next)
+	if (*up == crecp)
+	  break;
+
+      /* Not hashed, can't happen, but don't loop forever if it does. */
+      if (!*up)
+	{
+	  expire_remove(crecp);
+	  continue;
+	}
+      
+      *up = crecp->hash_next;
+      type_unhash(crecp);
+      cache_unlink(crecp);
+      cache_free(crecp);
+      reaped++;
+    }
+
+  if (reaped != 0)
+    {
+      daemon->metrics[METRIC_DNS_CACHE_REAPED] += reaped;
+      if (reaped > daemon->metrics[METRIC_DNS_CACHE_REAP_HWM])
+	daemon->metrics[METRIC_DNS_CACHE_REAP_HWM] = reaped;
+    }
+}
+
+/* This is called every time round the main loop. really_insert() calls
+   shard_expire() when the end of the LRU list it wants is still in use. */
+void cache_expire(time_t now)
+{
+  int n;
+  
+  for (n = 0; n < daemon->cache_shards; n++)
+    shard_expire(&shards[n], now);
+}
+
 static void cache_free(struct crec *crecp)
 {
+  if (crecp->expire_idx != 0)
+    expire_remove(crecp);
+
+  shards[crecp->shard].live--;
+  
   crecp->flags &= ~F_FORWARD;
   crecp->flags &= ~F_REVERSE;
   crecp->uid = UID_NONE; /* invalidate CNAMES pointing to this. */
 
-  if (cache_tail)
-    cache_tail->next = crecp;
-  else
-    cache_head = crecp;
-  crecp->prev = cache_tail;
-  crecp->next = NULL;
-  cache_tail = crecp;
+  cache_link_tail(crecp);
   
   /* retrieve big name for further use. */
   if (crecp->flags & F_BIGNAME)
@@ -381,30 +782,141 @@ static void cache_free(struct crec *crecp)
   cache_blockdata_free(crecp);
 }    
 
-/* insert a new cache entry at the head of the list (youngest entry) */
+/* insert a new cache entry at the head of its shard's list (youngest entry) */
 static void cache_link(struct crec *crecp)
 {
-  if (cache_head) /* check needed for init code */
-    cache_head->prev = crecp;
-  crecp->next = cache_head;
+  struct cache_shard *sh = &shards[crecp->shard];
+  
+  if (sh->head) /* check needed for init code */
+    sh->head->prev = crecp;
+  crecp->next = sh->head;
+  crecp->prev = NULL;
+  sh->head = crecp;
+  if (!sh->tail)
+    sh->tail = crecp;
+}
+
+/* put a free cache entry at the tail of the list, to be re-used first. */
+static void cache_link_tail(struct crec *crecp)
+{
+  struct cache_shard *sh = &shards[crecp->shard];
+  
+  if (sh->tail)
+    sh->tail->next = crecp;
+  else
+    sh->head = crecp;
+  crecp->prev = sh->tail;
+  crecp->next = NULL;
+  sh->tail = crecp;
+}
+
+/* insert a new cache entry at the head of the probation list */
+static void probe_link(struct crec *crecp)
+{
+  struct cache_shard *sh = &shards[crecp->shard];
+  
+  if (sh->probe_head)
+    sh->probe_head->prev = crecp;
+  crecp->next = sh->probe_head;
   crecp->prev = NULL;
-  cache_head = crecp;
-  if (!cache_tail)
-    cache_tail = crecp;
+  sh->probe_head = crecp;
+  if (!sh->probe_tail)
+    sh->probe_tail = crecp;
+  crecp->probation = 1;
+  sh->probe_count++;
 }
 
 /* remove an arbitrary cache entry for promotion */ 
 static void cache_unlink (struct crec *crecp)
 {
+  struct cache_shard *sh = &shards[crecp->shard];
+  
+  if (crecp->probation)
+    {
+      if (crecp->prev)
+	crecp->prev->next = crecp->next;
+      else
+	sh->probe_head = crecp->next;
+      
+      if (crecp->next)
+	crecp->next->prev = crecp->prev;
+      else
+	sh->probe_tail = crecp->prev;
+
+      crecp->probation = 0;
+      sh->probe_count--;
+      return;
+    }
+  
   if (crecp->prev)
     crecp->prev->next = crecp->next;
   else
-    cache_head = crecp->next;
+    sh->head = crecp->next;
 
   if (crecp->next)
     crecp->next->prev = crecp->prev;
   else
-    cache_tail = crecp->prev;
+    sh->tail = crecp->prev;
+}
+
+/* Cache entry used to answer a query: move it to the head of the main list.
+   cache_find_by_name() and cache_find_by_addr() rely on this to chain
+   their answers. */
+static void cache_hit(struct crec *crecp)
+{
+  if (crecp->probation)
+    daemon->metrics[METRIC_DNS_CACHE_PROMOTED]++;
+  
+  cache_unlink(crecp);
+  cache_link(crecp);
+}
+
+static void sketch_add(unsigned int hash)
+{
+  unsigned int i, step = (hash >> 17) | (hash << 15) | 1;
+  
+  for (i = 0; i < CACHE_SKETCH_DEPTH; i++, hash += step)
+    {
+      unsigned char *c = &sketch[(i * (sketch_mask + 1)) + (hash & sketch_mask)];
+      
+      if (*c != 255)
+	(*c)++;
+    }
+  
+  /* Age the counts, so that we remember about as many names as fit in the cache. */
+  if (++sketch_ops >= sketch_mask + 1)
+    {
+      for (i = 0; i < CACHE_SKETCH_DEPTH * (sketch_mask + 1); i++)
+	sketch[i] >>= 1;
+      sketch_ops = 0;
+    }
+}
+
+static unsigned int sketch_count(unsigned int hash)
+{
+  unsigned int i, step = (hash >> 17) | (hash << 15) | 1, count = 255;
+  
+  for (i = 0; i < CACHE_SKETCH_DEPTH; i++, hash += step)
+    {
+      unsigned char c = sketch[(i * (sketch_mask + 1)) + (hash & sketch_mask)];
+      
+      if (c < count)
+	count = c;
+    }
+
+  return count;
+}
+
+/* Choose a live entry to evict to make space, with --cache-policy=2q */
+static struct crec *cache_victim(struct cache_shard *sh)
+{
+  if (sh->probe_tail && (sh->probe_count >= sh->probe_max || !sh->tail))
+    {
+      sketch_add(sh->probe_tail->name_hash);
+      return sh->probe_tail;
+    }
+
+  return sh->tail;
 }
 
 char *cache_get_name(struct crec *crecp)
@@ -429,12 +941,12 @@ char *cache_get_cname_target(struct crec *crecp)
 
 struct crec *cache_enumerate(int init)
 {
-  static int bucket;
+  static int shard, bucket;
   static struct crec *cache;
 
   if (init)
     {
-      bucket = 0;
+      shard = bucket = 0;
       cache = NULL;
     }
   else if (cache && cache->hash_next)
@@ -442,9 +954,12 @@ struct crec *cache_enumerate(int init)
   else
     {
        cache = NULL; 
-       while (bucket < hash_size)
-	 if ((cache = hash_table[bucket++]))
-	   break;
+       for (; shard < daemon->cache_shards; shard++, bucket = 0)
+	 {
+	   while (bucket < shards[shard].hash_size)
+	     if ((cache = shards[shard].hash_table[bucket++]))
+	       return cache;
+	 }
     }
   
   return cache;
@@ -492,29 +1007,48 @@ static int is_expired(time_t now, struct crec *crecp)
 /* Remove entries with a given UID from the cache */
 unsigned int cache_remove_uid(const unsigned int uid)
 {
-  int i;
+  int i, n;
   unsigned int removed = 0;
   struct crec *crecp, *tmp, **up;
 
-  for (i = 0; i < hash_size; i++)
-    for (crecp = hash_table[i], up = &hash_table[i]; crecp; crecp = tmp)
-      {
-	tmp = crecp->hash_next;
-	if ((crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) && crecp->uid == uid)
-	  {
-	    *up = tmp;
-	    free_config_crec(crecp);
-	    removed++;
-	  }
-	else
-	  up = &crecp->hash_next;
-      }
+  for (n = 0; n < daemon->cache_shards; n++)
+    for (i = 0; i < shards[n].hash_size; i++)
+      for (crecp = shards[n].hash_table[i], up = &shards[n].hash_table[i]; crecp; crecp = tmp)
+	{
+	  tmp = crecp->hash_next;
+	  if ((crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) && crecp->uid == uid)
+	    {
+	      *up = tmp;
+	      type_unhash(crecp);
+	      free_config_crec(crecp);
+	      removed++;
+	    }
+	  else
+	    up = &crecp->hash_next;
+	}
 
   free_names(uid);
   
   return removed;
 }
 
+/* Does a new entry for the same name, with flags and addr, take the place of crecp? */
+static int is_replaced_by(struct crec *crecp, unsigned int flags, union all_addr *addr)
+{
+  if (addr && (crecp->flags & flags & F_RR))
+    {
+      unsigned short rrc = (crecp->flags & F_KEYTAG) ? crecp->addr.rrblock.rrtype : crecp->addr.rrdata.rrtype;
+      unsigned short rra = (flags & F_KEYTAG) ? addr->rrblock.rrtype : addr->rrdata.rrtype;
+      
+      if (rrc == rra)
+	return 1;
+    }
+  
+  /* Don't delete DNSSEC in favour of a CNAME, they can co-exist */
+  return (flags & crecp->flags & (F_IPV4 | F_IPV6 | F_NXDOMAIN)) || 
+    (((crecp->flags | flags) & F_CNAME) && !(crecp->flags & (F_DNSKEY | F_DS)));
+}
+
 static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned short class, time_t now,
 				    unsigned int flags, struct crec **target_crec, unsigned int *target_uid)
 {
@@ -522,7 +1056,8 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
      If (flags & F_FORWARD) then remove any forward entries for name and any expired
      entries but only in the same hash bucket as name.
      If (flags & F_REVERSE) then remove any reverse entries for addr and any expired
-     entries in the whole cache.
+     entries in the whole cache. When the expiry heap is in use, cache_expire() 
+     deals with expired entries, so only the reverse entries in addr's shard are scanned.
      If (flags == 0) remove any expired entries in the whole cache. 
 
      In the flags & F_FORWARD case, the return code is valid, and returns a non-NULL pointer
@@ -540,28 +1075,18 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
   
   if (flags & F_FORWARD)
     {
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = crecp->hash_next)
+      unsigned int hash = hostname_hash(name);
+      
+      for (up = hash_bucket(name_shard(hash), hash), crecp = *up; crecp; crecp = crecp->hash_next)
 	{
-	  if ((crecp->flags & F_FORWARD) && hostname_isequal(cache_get_name(crecp), name))
+	  if ((crecp->flags & F_FORWARD) && crecp->name_hash == hash && hostname_isequal(cache_get_name(crecp), name))
 	    {
-	      int rrmatch = 0;
-	      if (addr && (crecp->flags & flags & F_RR))
-		{
-		  unsigned short rrc = (crecp->flags & F_KEYTAG) ? crecp->addr.rrblock.rrtype : crecp->addr.rrdata.rrtype;
-		  unsigned short rra = (flags & F_KEYTAG) ? addr->rrblock.rrtype : addr->rrdata.rrtype;
-
-		  if (rrc == rra)
-		    rrmatch = 1;
-		}
-
-	      /* Don't delete DNSSEC in favour of a CNAME, they can co-exist */
-	      if ((flags & crecp->flags & (F_IPV4 | F_IPV6 | F_NXDOMAIN)) || 
-		  (((crecp->flags | flags) & F_CNAME) && !(crecp->flags & (F_DNSKEY | F_DS))) ||
-		  rrmatch)
+	      if (is_replaced_by(crecp, flags, addr))
 		{
 		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
 		    return crecp;
 		  *up = crecp->hash_next;
+		  type_unhash(crecp);
 		  /* If this record is for the name we're inserting and is the target
 		     of a CNAME record. Make the new record for the same name, in the same
 		     crec, with the same uid to avoid breaking the existing CNAME. */
@@ -584,6 +1109,7 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 		  if (crecp->flags & F_CONFIG)
 		    return crecp;
 		  *up = crecp->hash_next;
+		  type_unhash(crecp);
 		  cache_unlink(crecp);
 		  cache_free(crecp);
 		  continue;
@@ -594,6 +1120,7 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 	  if (is_expired(now, crecp) || is_outdated_cname_pointer(crecp))
 	    { 
 	      *up = crecp->hash_next;
+	      type_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{
 		  cache_unlink(crecp);
@@ -607,33 +1134,45 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
     }
   else
     {
-      int i;
+      int i, n, first = 0, last = daemon->cache_shards;
       int addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
 
-      for (i = 0; i < hash_size; i++)
-	for (crecp = hash_table[i], up = &hash_table[i]; 
-	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
-	     crecp = crecp->hash_next)
-	  if (is_expired(now, crecp))
-	    {
-	      *up = crecp->hash_next;
-	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
-		{ 
-		  cache_unlink(crecp);
-		  cache_free(crecp);
-		}
-	    }
-	  else if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
-		   (flags & crecp->flags & F_REVERSE) && 
-		   (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
-		   addr && memcmp(&crecp->addr, addr, addrlen) == 0)
-	    {
-	      *up = crecp->hash_next;
-	      cache_unlink(crecp);
-	      cache_free(crecp);
-	    }
-	  else
-	    up = &crecp->hash_next;
+      int reverse_only = shards[0].expire_heap && (flags & F_REVERSE);
+
+      /* Cached reverse entries for addr are all in one shard. */
+      if (reverse_only)
+	{
+	  first = shard_index(flags, 0, addr);
+	  last = first + 1;
+	}
+      
+      for (n = first; n < last; n++)
+	for (i = 0; i < shards[n].hash_size; i++)
+	  for (crecp = shards[n].hash_table[i], up = &shards[n].hash_table[i]; 
+	       crecp && ((crecp->flags & F_REVERSE) || (!reverse_only && !(crecp->flags & F_IMMORTAL)));
+	       crecp = crecp->hash_next)
+	    if (is_expired(now, crecp))
+	      {
+		*up = crecp->hash_next;
+		type_unhash(crecp);
+		if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
+		  { 
+		    cache_unlink(crecp);
+		    cache_free(crecp);
+		  }
+	      }
+	    else if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
+		     (flags & crecp->flags & F_REVERSE) && 
+		     (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
+		     addr && memcmp(&crecp->addr, addr, addrlen) == 0)
+	      {
+		*up = crecp->hash_next;
+		type_unhash(crecp);
+		cache_unlink(crecp);
+		cache_free(crecp);
+	      }
+	    else
+	      up = &crecp->hash_next;
     }
   
   return NULL;
@@ -699,6 +1238,7 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   int freed_all = (flags & F_REVERSE);
   struct crec *free_avail = NULL;
   unsigned int target_uid;
+  struct cache_shard *sh = &shards[shard_index(flags, hostname_hash(name ? name : ""), addr)];
   
   /* if previous insertion failed give up now. */
   if (insert_error)
@@ -713,7 +1253,7 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   
   /* First remove any expired entries and entries for the name/address we
      are currently inserting. */
-  if ((new = cache_scan_free(name, addr, class, now, flags, &target_crec, &target_uid)))
+  if (!bulk_load && (new = cache_scan_free(name, addr, class, now, flags, &target_crec, &target_uid)))
     {
       /* We're trying to insert a record over one from 
 	 /etc/hosts or DHCP, or other config. If the 
@@ -737,7 +1277,7 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   /* Now get a cache entry from the end of the LRU list */
   if (!target_crec)
     while (1) {
-      if (!(new = cache_tail)) /* no entries left - cache is too small, bail */
+      if (!(new = sh->tail) && !(new = sh->probe_tail)) /* no entries left - shard is too small, bail */
 	{
 	  insert_error = 1;
 	  return NULL;
@@ -766,6 +1306,12 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
       
       if (freed_all)
 	{
+	  if (sketch && !(new = cache_victim(sh)))
+	    {
+	      insert_error = 1;
+	      return NULL;
+	    }
+	  
 	  /* For DNSSEC records, uid holds class. */
 	  free_avail = new; /* Must be free space now. */
 	  
@@ -777,7 +1323,10 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
 	}
       else
 	{
-	  cache_scan_free(NULL, NULL, class, now, 0, NULL, NULL);
+	  if (sh->expire_heap)
+	    shard_expire(sh, now);
+	  else
+	    cache_scan_free(NULL, NULL, class, now, 0, NULL, NULL);
 	  freed_all = 1;
 	}
     }
@@ -814,6 +1363,7 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   cache_unlink(new);
   
   new->flags = flags;
+  shards[new->shard].live++;
   if (big_name)
     {
       new->name.bname = big_name;
@@ -840,19 +1390,202 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   return new;
 }
 
-/* after end of insertion, commit the new entries */
-void cache_end_insert(void)
+/* Copy an A or AAAA entry committed by the main process into the next
+   slot of the shared ring, for the TCP children to find. */
+static void shared_publish(struct crec *crecp)
 {
-  if (insert_error)
+  struct shared_entry *e;
+  char *name = cache_get_name(crecp);
+  unsigned int seq;
+  
+  if (!(crecp->flags & (F_IPV4 | F_IPV6)) ||
+      (crecp->flags & (F_CNAME | F_RR | F_DNSKEY | F_DS | F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)) ||
+      strlen(name) >= SHARED_CACHE_NAME)
+    return;
+
+  e = &shared_cache[shared_next++ & shared_mask];
+  seq = e->seq;
+  
+  __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->batch = shared_batch;
+  e->flags = crecp->flags;
+  e->ttd = crecp->ttd;
+  e->addr = crecp->addr;
+  strcpy(e->name, name);
+  __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Called in a TCP child: copy entries the main process has committed since
+   we last looked (or since the fork) into our own cache, one transaction
+   at a time. If the writer has lapped us, the oldest are lost. */
+void cache_shared_import(time_t now)
+{
+  struct shared_entry *e, copy;
+  unsigned int head, seq, batch = 0;
+  int open = 0;
+  
+  if (!shared_cache || daemon->pipe_to_parent == -1)
     return;
 
-  /* signal start of cache insert transaction to master process */
-  if (daemon->pipe_to_parent != -1)
+  head = __atomic_load_n(shared_head, __ATOMIC_ACQUIRE);
+
+  if (head - shared_next > (unsigned int)daemon->shared_cache_size)
+    shared_next = head - daemon->shared_cache_size;
+
+  for (; shared_next != head; shared_next++)
     {
-      unsigned char op = PIPE_OP_INSERT;
-      read_write(daemon->pipe_to_parent, &op, sizeof(op), RW_WRITE);
+      e = &shared_cache[shared_next & shared_mask];
+      seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      memcpy(&copy, e, sizeof(copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      
+      if ((seq & 1) || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+	{
+	  /* Overwritten under us: drop the rest of this transaction. */
+	  if (open)
+	    cache_start_insert();
+	  open = 0;
+	  continue;
+	}
+
+      if (copy.batch == shared_next)
+	{
+	  if (open)
+	    end_insert(-1);
+	  cache_start_insert();
+	  open = 1;
+	  batch = shared_next;
+	}
+      else if (!open)
+	continue;
+      else if (copy.batch != batch)
+	{
+	  /* A slot from a later transaction, written after lapping us. */
+	  cache_start_insert();
+	  open = 0;
+	  continue;
+	}
+      
+      if (difftime(copy.ttd, now) > 0)
+	{
+	  copy.name[SHARED_CACHE_NAME - 1] = 0;
+	  really_insert(copy.name, &copy.addr, C_IN, now, (unsigned long)difftime(copy.ttd, now), copy.flags);
+	}
+    }
+
+  /* Don't send them back up the pipe. */
+  if (open)
+    end_insert(-1);
+}
+
+/* Free the pipe buffer after a transaction which made it larger than
+   PIPE_BUFF_KEEP, so that one very large RRset or snapshot doesn't hold
+   on to it for good. */
+static void pipe_trim(void)
+{
+  if (pipe_size > PIPE_BUFF_KEEP)
+    {
+      free(pipe_buff);
+      pipe_buff = NULL;
+      pipe_size = 0;
+    }
+}
+
+/* Reserve len bytes at the end of the pipe buffer. */
+static unsigned char *pipe_space(size_t len)
+{
+  unsigned char *p;
+  
+  if (pipe_used + len > pipe_size)
+    {
+      size_t new_size = pipe_used + len + 4096;
+      
+      if (!(p = whine_realloc(pipe_buff, new_size)))
+	return NULL;
+      
+      pipe_buff = p;
+      pipe_size = new_size;
+    }
+
+  p = pipe_buff + pipe_used;
+  pipe_used += len;
+  return p;
+}
+
+static void pipe_marshal(struct crec *crecp, time_t ttd, char *target)
+{
+  char *name = cache_get_name(crecp);
+  struct pipe_rec rec;
+  struct blockdata *block = NULL;
+  unsigned char *p;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.ttd = ttd;
+  rec.addr = crecp->addr;
+  rec.flags = crecp->flags;
+  rec.namelen = strlen(name);
+  rec.class = crecp->uid;
+  
+  if (target)
+    rec.datalen = strlen(target);
+  else if (crecp->flags & F_RR)
+    {
+      /* A negative RR entry is possible and has no data, obviously. */
+      if (!(crecp->flags & F_NEG) && (crecp->flags & F_KEYTAG))
+	{
+	  block = crecp->addr.rrblock.rrdata;
+	  rec.datalen = crecp->addr.rrblock.datalen;
+	}
+    }
+#ifdef HAVE_DNSSEC
+  else if (crecp->flags & F_DNSKEY)
+    {
+      block = crecp->addr.key.keydata;
+      rec.datalen = crecp->addr.key.keylen;
+    }
+  else if (crecp->flags & F_DS)
+    {
+      /* A negative DS entry is possible and has no data, obviously. */
+      if (!(crecp->flags & F_NEG))
+	{
+	  block = crecp->addr.ds.keydata;
+	  rec.datalen = crecp->addr.ds.keylen;
+	}
     }
+#endif
 
+  if ((p = pipe_space(sizeof(rec) + rec.namelen + rec.datalen)))
+    {
+      memcpy(p, &rec, sizeof(rec));
+      memcpy(p + sizeof(rec), name, rec.namelen);
+      if (target)
+	memcpy(p + sizeof(rec) + rec.namelen, target, rec.datalen);
+      else if (block)
+	blockdata_retrieve(block, rec.datalen, p + sizeof(rec) + rec.namelen);
+    }
+  else
+    pipe_error = 1; /* A CNAME must follow its target, so send none of it. */
+}
+
+/* after end of insertion, commit the new entries */
+static void end_insert(int fd)
+{
+  if (insert_error)
+    return;
+
+#ifdef HAVE_DNSSEC
+  /* DNSSEC validation results are provisional whilst crypto is outstanding
+     in the worker threads, don't commit them. cache_start_insert() will
+     clean up. */
+  if (crypto_async_pending())
+    return;
+#endif
+
+  shared_batch = shared_next;
+  pipe_used = 0;
+  pipe_error = 0;
+  
   while (new_chain)
     { 
       struct crec *tmp = new_chain->next;
@@ -862,58 +1595,54 @@ void cache_end_insert(void)
       else
 	{
 	  cache_hash(new_chain);
-	  cache_link(new_chain);
+	  if (sketch && sketch_count(new_chain->name_hash) == 0)
+	    probe_link(new_chain);
+	  else
+	    cache_link(new_chain);
+	  expire_add(new_chain);
 	  daemon->metrics[METRIC_DNS_CACHE_INSERTED]++;
 
-	  /* If we're a child process, send this cache entry up the pipe to the master.
-	     The marshalling process is rather nasty. */
-	  if (daemon->pipe_to_parent != -1)
-	    {
-	      char *name = cache_get_name(new_chain);
-	      ssize_t m = strlen(name);
-	      unsigned int flags = new_chain->flags;
-#ifdef HAVE_DNSSEC
-	      u16 class = new_chain->uid;
-#endif
-	      
-	      read_write(daemon->pipe_to_parent, (unsigned char *)&m, sizeof(m), RW_WRITE);
-	      read_write(daemon->pipe_to_parent, (unsigned char *)name, m, RW_WRITE);
-	      read_write(daemon->pipe_to_parent, (unsigned char *)&new_chain->ttd, sizeof(new_chain->ttd), RW_WRITE);
-	      read_write(daemon->pipe_to_parent, (unsigned char *)&flags, sizeof(flags), RW_WRITE);
-	      read_write(daemon->pipe_to_parent, (unsigned char *)&new_chain->addr, sizeof(new_chain->addr), RW_WRITE);
-	      
-	      if (flags & F_RR)
-		{
-		  /* A negative RR entry is possible and has no data, obviously. */
-		  if (!(flags & F_NEG) && (flags & F_KEYTAG))
-		    blockdata_write(new_chain->addr.rrblock.rrdata, new_chain->addr.rrblock.datalen, daemon->pipe_to_parent);
-		}
-#ifdef HAVE_DNSSEC
-	      else if (flags & F_DNSKEY)
-		{
-		  read_write(daemon->pipe_to_parent, (unsigned char *)&class, sizeof(class), RW_WRITE);
-		  blockdata_write(new_chain->addr.key.keydata, new_chain->addr.key.keylen, daemon->pipe_to_parent);
-		}
-	      else if (flags & F_DS)
-		{
-		  read_write(daemon->pipe_to_parent, (unsigned char *)&class, sizeof(class), RW_WRITE);
-		  /* A negative DS entry is possible and has no data, obviously. */
-		  if (!(flags & F_NEG))
-		    blockdata_write(new_chain->addr.ds.keydata, new_chain->addr.ds.keylen, daemon->pipe_to_parent);
-		}
-#endif
-	    }
+	  if (shared_cache && daemon->pipe_to_parent == -1)
+	    shared_publish(new_chain);
+
+	  /* If we're a child process, add this cache entry to the
+	     transaction to send up the pipe to the master. */
+	  if (fd != -1)
+	    pipe_marshal(new_chain, new_chain->ttd, NULL);
 	}
       
       new_chain = tmp;
     }
 
-  /* signal end of cache insert in master process */
-  if (daemon->pipe_to_parent != -1)
+  /* Let the TCP children see the whole transaction at once. */
+  if (shared_cache && daemon->pipe_to_parent == -1)
+    __atomic_store_n(shared_head, shared_next, __ATOMIC_RELEASE);
+  
+  /* The whole transaction goes to the master process in one write. */
+  if (fd != -1 && pipe_used != 0 && !pipe_error)
     {
-      ssize_t m = -1;
-      read_write(daemon->pipe_to_parent, (unsigned char *)&m, sizeof(m), RW_WRITE);
+      unsigned char op = PIPE_OP_INSERT;
+      struct pipe_insert hdr;
+      struct iovec iov[3];
+
+      hdr.version = PIPE_INSERT_VERSION;
+      hdr.len = pipe_used;
+      iov[0].iov_base = &op;
+      iov[0].iov_len = sizeof(op);
+      iov[1].iov_base = &hdr;
+      iov[1].iov_len = sizeof(hdr);
+      iov[2].iov_base = pipe_buff;
+      iov[2].iov_len = pipe_used;
+      
+      read_writev(fd, iov, 3, RW_WRITE);
     }
+
+  pipe_trim();
+}
+
+void cache_end_insert(void)
+{
+  end_insert(daemon->pipe_to_parent);
 }
 
 #ifdef HAVE_DNSSEC
@@ -945,6 +1674,36 @@ void cache_send_ipset(unsigned char op, struct ipsets *sets, int flags, union al
 }
 #endif
 
+/* Insert a non-CNAME entry from a struct pipe_rec and its data. */
+static struct crec *unmarshal_insert(struct pipe_rec *rec, char *data, time_t now, unsigned long ttl)
+{
+  unsigned short class = C_IN;
+  struct blockdata *block = NULL;
+  struct crec *crecp;
+  
+  if ((rec->flags & F_RR) && !(rec->flags & F_NEG) && (rec->flags & F_KEYTAG)
+      && !(block = rec->addr.rrblock.rrdata = blockdata_alloc(data, rec->datalen)))
+    return NULL;
+#ifdef HAVE_DNSSEC
+  else if (rec->flags & F_DNSKEY)
+    {
+      class = rec->class;
+      if (!(block = rec->addr.key.keydata = blockdata_alloc(data, rec->datalen)))
+	return NULL;
+    }
+  else  if (rec->flags & F_DS)
+    {
+      class = rec->class;
+      if (!(rec->flags & F_NEG) && !(block = rec->addr.ds.keydata = blockdata_alloc(data, rec->datalen)))
+	return NULL;
+    }
+#endif
+  if (!(crecp = really_insert(daemon->namebuff, &rec->addr, class, now, ttl, rec->flags)))
+    blockdata_free(block);
+
+  return crecp;
+}
+
 /* Retrieve and handle a result from child TCP-handler.
    Return 0 when pipe is closed by far end. */
 int cache_recv_insert(time_t now, int fd)
@@ -958,44 +1717,56 @@ int cache_recv_insert(time_t now, int fd)
     {
     case PIPE_OP_INSERT:
       {
-	/* A marshalled set if cache entries arrives on fd, read, unmarshall and insert into cache of master process. */
-	ssize_t m;
-	union all_addr addr;
+	/* A marshalled set of cache entries arrives on fd, read, unmarshall and insert into cache of master process. */
+	struct pipe_insert hdr;
+	struct pipe_rec rec;
+	unsigned char *p, *end;
 	unsigned long ttl;
-	time_t ttd;
-	unsigned int flags;
 	struct crec *crecp = NULL;
 
+	/* Read the whole transaction before touching the cache, since we
+	   don't want to go back to the poll() loop and start processing
+	   other queries which might pollute the insertion chain. */
+	if (!read_write(fd, (unsigned char *)&hdr, sizeof(hdr), RW_READ))
+	  return 0;
+
+	if (hdr.len > pipe_size)
+	  {
+	    if (!(p = whine_realloc(pipe_buff, hdr.len)))
+	      return 0;
+	    pipe_buff = p;
+	    pipe_size = hdr.len;
+	  }
+	
+	if (!read_write(fd, pipe_buff, hdr.len, RW_READ))
+	  return 0;
+
+	if (hdr.version != PIPE_INSERT_VERSION)
+	  {
+	    my_syslog(LOG_ERR, _("unknown cache insert format %u from TCP process"), hdr.version);
+	    pipe_trim();
+	    return 1;
+	  }
+	
 	cache_start_insert();
 	
-	/* loop reading RRs, since we don't want to go back to the poll() loop
-	   and start processing other queries which might pollute the insertion
-	   chain. The child will never block between the first OP_RR and the
-	   minus-one length marking the end. */
-	while (1)
+	for (p = pipe_buff, end = pipe_buff + hdr.len; end - p >= (ptrdiff_t)sizeof(rec); )
 	  {
-	    if (!read_write(fd, (unsigned char *)&m, sizeof(m), RW_READ))
-	      return 0;
-	    
-	    if (m == -1)
-	      {
-		cache_end_insert();
-		return 1;
-	      }
-	    
-	    if (!read_write(fd, (unsigned char *)daemon->namebuff, m, RW_READ) ||
-		!read_write(fd, (unsigned char *)&ttd, sizeof(ttd), RW_READ) ||
-		!read_write(fd, (unsigned char *)&flags, sizeof(flags), RW_READ) ||
-		!read_write(fd, (unsigned char *)&addr, sizeof(addr), RW_READ))
-	      return 0;
+	    memcpy(&rec, p, sizeof(rec));
+	    p += sizeof(rec);
+
+	    if (rec.namelen >= MAXDNAME || end - p < (ptrdiff_t)(rec.namelen + rec.datalen))
+	      break;
 	    
-	    daemon->namebuff[m] = 0;
+	    memcpy(daemon->namebuff, p, rec.namelen);
+	    daemon->namebuff[rec.namelen] = 0;
+	    p += rec.namelen + rec.datalen;
 	    
-	    ttl = difftime(ttd, now);
+	    ttl = difftime(rec.ttd, now);
 	    
-	    if (flags & F_CNAME)
+	    if (rec.flags & F_CNAME)
 	      {
-		struct crec *newc = really_insert(daemon->namebuff, NULL, C_IN, now, ttl, flags);
+		struct crec *newc = really_insert(daemon->namebuff, NULL, C_IN, now, ttl, rec.flags);
 		/* This relies on the fact that the target of a CNAME immediately precedes
 		   it because of the order of extraction in extract_addresses, and
 		   the order reversal on the new_chain. */
@@ -1013,33 +1784,11 @@ int cache_recv_insert(time_t now, int fd)
 		  }
 	      }
 	    else
-	      {
-		unsigned short class = C_IN;
-		struct blockdata *block = NULL;
-
-		if ((flags & F_RR) && !(flags & F_NEG) && (flags & F_KEYTAG)
-		    && !(block = addr.rrblock.rrdata = blockdata_read(fd, addr.rrblock.datalen)))
-		  continue;
-#ifdef HAVE_DNSSEC
-		else if (flags & F_DNSKEY)
-		  {
-		    if (!read_write(fd, (unsigned char *)&class, sizeof(class), RW_READ))
-		      return 0;
-		    if (!(block = addr.key.keydata = blockdata_read(fd, addr.key.keylen)))
-		      continue;
-		  }
-		else  if (flags & F_DS)
-		  {
-		    if (!read_write(fd, (unsigned char *)&class, sizeof(class), RW_READ))
-		      return 0;
-		    if (!(flags & F_NEG) && !(block = addr.ds.keydata = blockdata_read(fd, addr.ds.keylen)))
-		      continue;
-		  }
-#endif
-		if (!(crecp = really_insert(daemon->namebuff, &addr, class, now, ttl, flags)))
-		  blockdata_free(block);
-	      }
+	      crecp = unmarshal_insert(&rec, (char *)p - rec.datalen, now, ttl);
 	  }
+
+	cache_end_insert();
+	return 1;
       }
       
 #ifdef HAVE_DNSSEC
@@ -1115,6 +1864,16 @@ int cache_recv_insert(time_t now, int fd)
       }
 #endif
       
+#ifdef HAVE_DNSTAP
+    case PIPE_OP_DNSTAP:
+      return dnstap_recv_frame(fd);
+#endif
+
+#ifdef HAVE_HISTOGRAMS
+    case PIPE_OP_LATENCY:
+      return latency_recv(fd);
+#endif
+      
 #if defined(HAVE_IPSET) || defined(HAVE_NFTSET)
     case PIPE_OP_IPSET:
     case PIPE_OP_NFTSET:
@@ -1155,20 +1914,298 @@ int cache_recv_insert(time_t now, int fd)
 
   return 0;
 }
+
+#define SNAPSHOT_MAGIC "dnsmasq"
+#define SNAPSHOT_CNAME_PASSES 8 /* longest CNAME chain rebuilt from a snapshot */
+
+/* Write the live entries of the cache to --cache-snapshot, least recently
+   used first, so that loading them leaves the LRU order as it was. */
+void cache_snapshot_save(time_t now)
+{
+  struct snapshot_hdr hdr;
+  struct crec *crecp, *lists[2];
+  struct iovec iov[2];
+  time_t wall = time(NULL);
+  int i, n, fd, err;
+  char *tmp;
+
+  if (!daemon->cache_snapshot)
+    return;
+  
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  hdr.version = PIPE_INSERT_VERSION;
+  hdr.recsize = sizeof(struct pipe_rec);
+  pipe_used = 0;
+  pipe_error = 0;
+  
+  for (n = 0; n < daemon->cache_shards; n++)
+    for (lists[0] = shards[n].probe_tail, lists[1] = shards[n].tail, i = 0; i < 2; i++)
+      for (crecp = lists[i]; crecp; crecp = crecp->prev)
+	if ((crecp->flags & (F_FORWARD | F_REVERSE)) &&
+	    !(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)) &&
+	    !is_expired(now, crecp) &&
+	    !is_outdated_cname_pointer(crecp))
+	  {
+	    pipe_marshal(crecp, wall + difftime(crecp->ttd, now),
+			 (crecp->flags & F_CNAME) ? cache_get_cname_target(crecp) : NULL);
+	    hdr.count++;
+	  }
+
+  hdr.len = pipe_used;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = pipe_buff;
+  iov[1].iov_len = pipe_used;
+  
+  /* Write a new file and rename it over the old one, so that a crash or a
+     full disk leaves the last complete snapshot in place. */
+  if (pipe_error ||
+      !(tmp = whine_malloc(strlen(daemon->cache_snapshot) + sizeof(".tmp"))))
+    {
+      my_syslog(LOG_ERR, _("cannot write cache snapshot %s: %s"), daemon->cache_snapshot, strerror(ENOMEM));
+      pipe_trim();
+      return;
+    }
+
+  sprintf(tmp, "%s.tmp", daemon->cache_snapshot);
+  
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    err = errno;
+  else
+    {
+      err = (!read_writev(fd, iov, pipe_used ? 2 : 1, RW_WRITE) || fsync(fd) == -1) ? errno : 0;
+      
+      if (close(fd) == -1 && err == 0)
+	err = errno;
+      
+      if (err == 0 && rename(tmp, daemon->cache_snapshot) == -1)
+	err = errno;
+
+      if (err != 0)
+	unlink(tmp);
+    }
+  
+  if (err != 0)
+    my_syslog(LOG_ERR, _("cannot write cache snapshot %s: %s"), daemon->cache_snapshot, strerror(err));
+  else
+    my_syslog(LOG_INFO, _("saved %u cache entries to %s"), hdr.count, daemon->cache_snapshot);
+  
+  free(tmp);
+  pipe_trim();
+}
+
+/* Would a snapshot entry clash with the hosts files, DHCP or other
+   configuration? cache_scan_free() refuses those inserts. */
+static int snapshot_config(char *name, struct pipe_rec *rec)
+{
+  unsigned int hash = hostname_hash(name);
+  struct crec *crecp;
+
+  for (crecp = *hash_bucket(name_shard(hash), hash); crecp; crecp = crecp->hash_next)
+    if (crecp->name_hash == hash &&
+	(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
+	(crecp->flags & F_FORWARD) &&
+	hostname_isequal(cache_get_name(crecp), name) &&
+	is_replaced_by(crecp, rec->flags, &rec->addr))
+      return 1;
+
+  return 0;
+}
+
+/* Any entry for name that a CNAME may point to. */
+static struct crec *snapshot_target(char *name)
+{
+  unsigned int hash = hostname_hash(name);
+  struct crec *crecp;
+
+  for (crecp = *hash_bucket(name_shard(hash), hash); crecp; crecp = crecp->hash_next)
+    if (crecp->name_hash == hash &&
+	(crecp->flags & F_FORWARD) &&
+	!(crecp->flags & (F_DNSKEY | F_DS)) &&
+	hostname_isequal(cache_get_name(crecp), name))
+      return crecp;
+
+  return NULL;
+}
+
+/* Load --cache-snapshot at startup, after the hosts files and DHCP leases.
+   The cache holds nothing else yet, so entries go in without searching
+   for ones they replace, but names which are in the configuration are
+   left alone. A CNAME is loaded once its target is. */
+void cache_snapshot_load(time_t now)
+{
+  struct snapshot_hdr hdr;
+  struct pipe_rec rec;
+  struct stat statbuf;
+  unsigned char *map = MAP_FAILED, *p, *end, *done = NULL;
+  time_t wall = time(NULL);
+  unsigned int i, loaded = 0;
+  int fd, pass, progress;
+  
+  if (!daemon->cache_snapshot || (fd = open(daemon->cache_snapshot, O_RDONLY)) == -1)
+    return;
+
+  if (fstat(fd, &statbuf) == 0 && statbuf.st_size >= (off_t)sizeof(hdr))
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return;
+  
+  memcpy(&hdr, map, sizeof(hdr));
+  
+  if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      hdr.version != PIPE_INSERT_VERSION ||
+      hdr.recsize != sizeof(struct pipe_rec) ||
+      statbuf.st_size != (off_t)(sizeof(hdr) + hdr.len) ||
+      !(done = whine_malloc((hdr.count + 7) / 8 + 1)))
+    {
+      my_syslog(LOG_WARNING, _("ignoring cache snapshot %s: wrong format"), daemon->cache_snapshot);
+      munmap(map, statbuf.st_size);
+      return;
+    }
+  
+  bulk_load = 1;
+  
+  for (pass = 0, progress = 1; pass <= SNAPSHOT_CNAME_PASSES && progress; pass++)
+    for (progress = 0, i = 0, p = map + sizeof(hdr), end = p + hdr.len;
+	 i < hdr.count && end - p >= (ptrdiff_t)sizeof(rec); i++)
+      {
+	struct crec *crecp, *target = NULL;
+	
+	memcpy(&rec, p, sizeof(rec));
+	p += sizeof(rec);
+	
+	if (rec.namelen >= MAXDNAME || rec.datalen >= 65536 ||
+	    end - p < (ptrdiff_t)(rec.namelen + rec.datalen))
+	  break;
+	
+	memcpy(daemon->namebuff, p, rec.namelen);
+	daemon->namebuff[rec.namelen] = 0;
+	p += rec.namelen + rec.datalen;
+	
+	/* Non-CNAMEs on the first pass, then CNAMEs until no more targets appear. */
+	if ((done[i / 8] & (1 << (i % 8))) || (pass == 0) != !(rec.flags & F_CNAME))
+	  continue;
+	
+	if (difftime(rec.ttd, wall) <= 0 || snapshot_config(daemon->namebuff, &rec))
+	  {
+	    done[i / 8] |= 1 << (i % 8);
+	    continue;
+	  }
+
+	if (rec.flags & F_CNAME)
+	  {
+	    if (rec.datalen >= MAXDNAME)
+	      continue;
+	    memcpy(daemon->workspacename, p - rec.datalen, rec.datalen);
+	    daemon->workspacename[rec.datalen] = 0;
+	    if (!(target = snapshot_target(daemon->workspacename)))
+	      continue;
+	  }
+	
+	done[i / 8] |= 1 << (i % 8);
+	progress = 1;
+	
+	cache_start_insert();
+	
+	if (!target)
+	  crecp = unmarshal_insert(&rec, (char *)p - rec.datalen, now, (unsigned long)difftime(rec.ttd, wall));
+	else if ((crecp = really_insert(daemon->namebuff, NULL, C_IN, now, (unsigned long)difftime(rec.ttd, wall), rec.flags)))
+	  {
+	    crecp->addr.cname.is_name_ptr = 0;
+	    crecp->addr.cname.target.cache = target;
+	    next_uid(target);
+	    crecp->addr.cname.uid = target->uid;
+	  }
+	
+	end_insert(-1);
+	
+	if (crecp)
+	  loaded++;
+      }
+  
+  bulk_load = 0;
+  free(done);
+  munmap(map, statbuf.st_size);
+  
+  my_syslog(LOG_INFO, _("loaded %u of %u cache entries from %s"), loaded, hdr.count, daemon->cache_snapshot);
+}
 	
 int cache_find_non_terminal(char *name, time_t now)
 {
   struct crec *crecp;
+  unsigned int hash = hostname_hash(name);
 
-  for (crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
-    if (!is_outdated_cname_pointer(crecp) &&
+  for (crecp = *hash_bucket(name_shard(hash), hash); crecp; crecp = crecp->hash_next)
+    if (crecp->name_hash == hash &&
+	!is_outdated_cname_pointer(crecp) &&
 	!is_expired(now, crecp) &&
 	(crecp->flags & F_FORWARD) &&
 	!(crecp->flags & F_NXDOMAIN) && 
 	hostname_isequal(name, cache_get_name(crecp)))
       return 1;
 
-  return 0;
+  return 0;
+}
+
+/* cache_find_by_name() for lookups which give only record types, using the
+   type index. Expired entries are left for cache_expire() and round-robin
+   rotates the first match to after the last one. */
+static struct crec *find_by_type(char *name, unsigned int hash, time_t now, unsigned int prot, int no_rr)
+{
+  struct crec *ans, **chainp = &ans, *crecp, *first, *last;
+  unsigned int classes = (prot & TYPE_CLASSES) | F_NXDOMAIN, class;
+  struct cache_shard *sh = name_shard(hash);
+
+  for (; classes != 0; classes &= ~class)
+    {
+      class = classes & -classes;
+      
+      for (first = last = NULL, crecp = *type_bucket(sh, hash, class); crecp; crecp = crecp->type_next)
+	if (crecp->name_hash == hash &&
+	    (crecp->flags & prot) &&
+	    type_class(crecp->flags) == class &&
+	    !is_expired(now, crecp) &&
+	    !is_outdated_cname_pointer(crecp) &&
+	    hostname_isequal(cache_get_name(crecp), name))
+	  {
+	    /* See cache_find_by_name() */
+	    if (answer_recording && !(crecp->flags & F_IMMORTAL))
+	      answer_volatile = 1;
+	    
+	    if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
+	      {
+		*chainp = crecp;
+		chainp = &crecp->next;
+	      }
+	    else
+	      cache_hit(crecp);
+	    
+	    if (!first)
+	      first = crecp;
+	    else if ((crecp->flags & (F_REVERSE | F_IMMORTAL)) == (first->flags & (F_REVERSE | F_IMMORTAL)))
+	      last = crecp;
+	  }
+      
+      if (last && !no_rr)
+	{
+	  if ((*first->type_pprev = first->type_next))
+	    first->type_next->type_pprev = first->type_pprev;
+	  if ((first->type_next = last->type_next))
+	    first->type_next->type_pprev = &first->type_next;
+	  last->type_next = first;
+	  first->type_pprev = &last->type_next;
+	}
+    }
+  
+  *chainp = sh->head;
+
+  if (ans && (ans->flags & prot) && hostname_isequal(cache_get_name(ans), name))
+    return ans;
+  
+  return NULL;
 }
 
 struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsigned int prot)
@@ -1185,9 +2222,21 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
       /* first search, look for relevant entries and push to top of list
 	 also free anything which has expired */
       struct crec *next, **up, **insert = NULL, **chainp = &ans;
-      unsigned int ins_flags = 0;
+      unsigned int ins_flags = 0, hash = hostname_hash(name);
+      struct cache_shard *sh = name_shard(hash);
+      
+      if (answer_recording)
+	{
+	  if (answer_key.names == ANSWER_CACHE_NAMES)
+	    answer_volatile = 1;
+	  else
+	    answer_key.name_hash[answer_key.names++] = answer_name_index(name);
+	}
+
+      if (!(prot & ~(TYPE_CLASSES | F_NXDOMAIN)) && *unindexed_count(sh, hash) == 0)
+	return find_by_type(name, hash, now, prot, no_rr);
       
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = next)
+      for (up = hash_bucket(sh, hash), crecp = *up; crecp; crecp = next)
 	{
 	  next = crecp->hash_next;
 	  
@@ -1195,18 +2244,22 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    {
 	      if ((crecp->flags & F_FORWARD) && 
 		  (crecp->flags & prot) &&
+		  crecp->name_hash == hash &&
 		  hostname_isequal(cache_get_name(crecp), name))
 		{
+		  /* Answers from data which can change with time can't be saved.
+		     Immortal records only change with a reload, which flushes
+		     the answer cache. */
+		  if (answer_recording && !(crecp->flags & F_IMMORTAL))
+		    answer_volatile = 1;
+		  
 		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
 		    {
 		      *chainp = crecp;
 		      chainp = &crecp->next;
 		    }
 		  else
-		    {
-		      cache_unlink(crecp);
-		      cache_link(crecp);
-		    }
+		    cache_hit(crecp);
 	      	      
 		  /* Move all but the first entry up the hash chain
 		     this implements round-robin. 
@@ -1238,6 +2291,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    {
 	      /* expired entry, free it */
 	      *up = crecp->hash_next;
+	      type_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{ 
 		  cache_unlink(crecp);
@@ -1246,7 +2300,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    }
 	}
 	  
-      *chainp = cache_head;
+      *chainp = sh->head;
     }
 
   if (ans && 
@@ -1263,6 +2317,9 @@ struct crec *cache_find_by_addr(struct crec *crecp, union all_addr *addr,
 {
   struct crec *ans;
   int addrlen = (prot == F_IPV6) ? IN6ADDRSZ : INADDRSZ;
+
+  if (answer_recording)
+    answer_volatile = 1;
   
   if (crecp) /* iterating */
     ans = crecp->next;
@@ -1271,43 +2328,43 @@ struct crec *cache_find_by_addr(struct crec *crecp, union all_addr *addr,
       /* first search, look for relevant entries and push to top of list
 	 also free anything which has expired. All the reverse entries are at the
 	 start of the hash chain, so we can give up when we find the first 
-	 non-REVERSE one.  */
-       int i;
+	 non-REVERSE one. Entries from the hosts files and DHCP may be in any
+	 shard, but cached ones are all in the shard for the address. */
+       int i, n;
        struct crec **up, **chainp = &ans;
        
-       for (i=0; i<hash_size; i++)
-	 for (crecp = hash_table[i], up = &hash_table[i]; 
-	      crecp && (crecp->flags & F_REVERSE);
-	      crecp = crecp->hash_next)
-	   if (!is_expired(now, crecp))
-	     {      
-	       if ((crecp->flags & prot) &&
-		   memcmp(&crecp->addr, addr, addrlen) == 0)
-		 {	    
-		   if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
-		     {
-		       *chainp = crecp;
-		       chainp = &crecp->next;
-		     }
-		   else
-		     {
-		       cache_unlink(crecp);
-		       cache_link(crecp);
-		     }
-		 }
-	       up = &crecp->hash_next;
-	     }
-	   else
-	     {
-	       *up = crecp->hash_next;
-	       if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
-		 {
-		   cache_unlink(crecp);
-		   cache_free(crecp);
-		 }
-	     }
+       for (n = 0; n < daemon->cache_shards; n++)
+	 for (i=0; i<shards[n].hash_size; i++)
+	   for (crecp = shards[n].hash_table[i], up = &shards[n].hash_table[i]; 
+		crecp && (crecp->flags & F_REVERSE);
+		crecp = crecp->hash_next)
+	     if (!is_expired(now, crecp))
+	       {      
+		 if ((crecp->flags & prot) &&
+		     memcmp(&crecp->addr, addr, addrlen) == 0)
+		   {	    
+		     if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
+		       {
+			 *chainp = crecp;
+			 chainp = &crecp->next;
+		       }
+		     else
+		       cache_hit(crecp);
+		   }
+		 up = &crecp->hash_next;
+	       }
+	     else
+	       {
+		 *up = crecp->hash_next;
+		 type_unhash(crecp);
+		 if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
+		   {
+		     cache_unlink(crecp);
+		     cache_free(crecp);
+		   }
+	       }
        
-       *chainp = cache_head;
+       *chainp = shards[shard_index(F_REVERSE | prot, 0, addr)].head;
     }
   
   if (ans && 
@@ -1319,6 +2376,392 @@ struct crec *cache_find_by_addr(struct crec *crecp, union all_addr *addr,
   return NULL;
 }
 
+/* The answer cache holds complete replies made by answer_request() which
+   depend only on immortal records and configuration, so that repeated
+   queries for, eg, hosts-file names can be answered by copying
+   the saved reply and patching the ID. Case in the question is preserved,
+   since names in the answer are compressed pointers to the question, which
+   we take from the query. TTLs of immortal records don't change, so
+   need no patching. While a reply is being built, the names
+   looked up are noted, and each saved reply counts its names in
+   answer_name_map until its slot is reused; inserting a record for any
+   name with a count flushes the whole cache. */
+static unsigned int answer_name_index(char *name)
+{
+  unsigned int c, val = 017465;
+
+  while ((c = (unsigned char)*name++))
+    {
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      val = ((val << 7) | (val >> (32 - 7))) + c;
+    }
+  
+  return (val ^ (val >> 16)) % ANSWER_CACHE_MAP;
+}
+
+void answer_cache_flush(void)
+{
+  int i;
+
+  if (answer_cache)
+    {
+      for (i = 0; i < daemon->answer_cache_size; i++)
+	answer_cache[i].len = answer_cache[i].names = 0;
+      
+      memset(answer_name_map, 0, sizeof(answer_name_map));
+    }
+}
+
+static void answer_cache_check(char *name)
+{
+  if (answer_name_map[answer_name_index(name)] != 0)
+    answer_cache_flush();
+}
+
+/* Empty a slot, and take its names out of the map. */
+static void answer_slot_clear(struct answer *a)
+{
+  while (a->names != 0)
+    answer_name_map[a->name_hash[--a->names]]--;
+  
+  a->len = 0;
+}
+
+static int answer_name_equal(unsigned char *a, unsigned char *b, size_t len)
+{
+  unsigned char c1, c2;
+  
+  for (; len != 0; len--)
+    {
+      c1 = *a++;
+      c2 = *b++;
+      
+      if (c1 >= 'A' && c1 <= 'Z')
+	c1 += 'a' - 'A';
+      if (c2 >= 'A' && c2 <= 'Z')
+	c2 += 'a' - 'A';
+      
+      if (c1 != c2)
+	return 0;
+    }
+
+  return 1;
+}
+
+/* Parse the question, which must be simple, and return its end or zero. */
+static size_t answer_question(struct dns_header *header, size_t qlen, int is_reply,
+			      unsigned int *hashp, unsigned short *qtypep)
+{
+  unsigned char *p = (unsigned char *)(header+1), *end = ((unsigned char *)header) + qlen;
+  unsigned int c, hash = 017465;
+  unsigned short qtype;
+  
+  if (ntohs(header->qdcount) != 1 || OPCODE(header) != QUERY ||
+      (!is_reply && (ntohs(header->ancount) != 0 || ntohs(header->nscount) != 0)))
+    return 0;
+
+  while (1)
+    {
+      if (p >= end || (*p & 0xc0))
+	return 0;
+
+      if ((c = *p++) == 0)
+	break;
+
+      if ((size_t)(end - p) < c)
+	return 0;
+
+      for (; c != 0; c--, p++)
+	hash = ((hash << 7) | (hash >> (32 - 7))) + ((*p >= 'A' && *p <= 'Z') ? *p + 'a' - 'A' : *p);
+      
+      hash = ((hash << 7) | (hash >> (32 - 7))) + '.';
+    }
+  
+  if (end - p < 4)
+    return 0;
+
+  GETSHORT(qtype, p);
+  *hashp = hash ^ (qtype << 16) ^ (p[0] << 8) ^ p[1];
+  *qtypep = qtype;
+  
+  return (p + 2) - (unsigned char *)header;
+}
+
+/* Look for a saved answer to the query in header. If found, the reply
+   is assembled in place and its length returned. If not, and the answer
+   could be saved, start noting the data which answer_request() uses, which
+   answer_cache_end() checks. */
+size_t answer_cache_find(struct dns_header *header, size_t qlen, int do_bit, unsigned short udp_size)
+{
+  unsigned int hash;
+  unsigned short flags, qtype;
+  size_t qend;
+  struct answer *a;
+  
+  answer_recording = 0;
+
+  if (!answer_cache ||
+      option_bool(OPT_LOG) || option_bool(OPT_LOCALISE) ||
+      !(qend = answer_question(header, qlen, 0, &hash, &qtype)) ||
+      qtype == T_PTR || qtype == T_SRV || qtype == T_ANY)
+    return 0;
+  
+  flags = (header->hb3 & HB3_RD) | ((header->hb4 & (HB4_AD | HB4_CD)) << 8) | (do_bit ? 0x8000 : 0);
+  a = &answer_cache[hash % daemon->answer_cache_size];
+  
+  if (a->len != 0 && a->hash == hash && a->flags == flags && a->udp_size == udp_size && a->qend == qend &&
+      answer_name_equal(a->reply + sizeof(struct dns_header), (unsigned char *)(header+1), qend - sizeof(struct dns_header) - 4) &&
+      memcmp(a->reply + qend - 4, ((unsigned char *)header) + qend - 4, 4) == 0)
+    {
+      /* Keep the query's ID and question, take the rest from the saved reply. */
+      memcpy(((unsigned char *)header) + 2, a->reply + 2, sizeof(struct dns_header) - 2);
+      memcpy(((unsigned char *)header) + qend, a->reply + qend, a->len - qend);
+      daemon->metrics[METRIC_DNS_ANSWER_CACHE_HITS]++;
+      return a->len;
+    }
+  
+  answer_key.hash = hash;
+  answer_key.flags = flags;
+  answer_key.udp_size = udp_size;
+  answer_key.qend = qend;
+  answer_key.names = 0;
+  answer_recording = 1;
+  answer_volatile = 0;
+  
+  return 0;
+}
+
+/* Used by answer_request() when it uses data which can change. */
+void answer_cache_volatile(void)
+{
+  answer_volatile = 1;
+}
+
+/* Called after answer_request(), save the reply if it's suitable. */
+void answer_cache_end(struct dns_header *header, size_t len)
+{
+  struct answer *a;
+  
+  if (!answer_recording)
+    return;
+
+  answer_recording = 0;
+  
+  if (len == 0 || answer_volatile || len > 0xffff)
+    return;
+  
+  a = &answer_cache[answer_key.hash % daemon->answer_cache_size];
+  answer_slot_clear(a);
+  a->hash = answer_key.hash;
+  a->flags = answer_key.flags;
+  a->udp_size = answer_key.udp_size;
+  a->qend = answer_key.qend;
+
+  if (a->size < len)
+    {
+      unsigned char *new;
+      
+      if (!(new = whine_realloc(a->reply, len)))
+	return;
+
+      a->reply = new;
+      a->size = len;
+    }
+
+  memcpy(a->reply, header, len);
+  a->len = len;
+  
+  for (a->names = 0; a->names < answer_key.names; a->names++)
+    answer_name_map[a->name_hash[a->names] = answer_key.name_hash[a->names]]++;
+}
+
+/* Is the client subnet in *b inside the prefix of length bits in *a? */
+static int subnet_match(struct subnet_opt *a, struct subnet_opt *b, int bits)
+{
+  int bytes = bits >> 3;
+  
+  if (a->family != b->family || memcmp(a->addr, b->addr, bytes) != 0)
+    return 0;
+
+  return (bits & 7) == 0 || ((a->addr[bytes] ^ b->addr[bytes]) & (0xff << (8 - (bits & 7)))) == 0;
+}
+
+static int subnet_question(struct dns_header *header, size_t qlen, int is_reply, unsigned int fwd_flags,
+			   unsigned int *hashp, unsigned short *flagsp)
+{
+  unsigned short qtype;
+  size_t qend;
+  
+  if (!subnet_cache || !(qend = answer_question(header, qlen, is_reply, hashp, &qtype)) || qtype == T_ANY)
+    return 0;
+
+  *flagsp = (header->hb3 & HB3_RD) |
+    (fwd_flags & (FREC_CHECKING_DISABLED | FREC_AD_QUESTION | FREC_DO_QUESTION | FREC_HAS_PHEADER));
+  
+  return (int)qend;
+}
+
+static int subnet_entry_match(struct subnet_answer *a, struct dns_header *header, unsigned int hash,
+			      unsigned short flags, size_t qend)
+{
+  return a->len != 0 && a->hash == hash && a->flags == flags && a->qend == qend &&
+    answer_name_equal(a->reply + sizeof(struct dns_header), (unsigned char *)(header+1), qend - sizeof(struct dns_header) - 4) &&
+    memcmp(a->reply + qend - 4, ((unsigned char *)header) + qend - 4, 4) == 0;
+}
+
+/* Look for a saved reply to the query in header, sent with client subnet *subnet.
+   If found, the reply is assembled in place, with its TTLs reduced by its age,
+   and its length returned. */
+size_t subnet_cache_find(struct dns_header *header, size_t qlen, struct subnet_opt *subnet,
+			 unsigned int fwd_flags, unsigned short udp_size, time_t now)
+{
+  unsigned int hash;
+  unsigned short flags;
+  size_t qend;
+  struct subnet_answer *a;
+  int i;
+  
+  if (!(qend = subnet_question(header, qlen, 0, fwd_flags, &hash, &flags)))
+    return 0;
+
+  a = &subnet_cache[(hash % subnet_sets) * daemon->subnet_cache_scopes];
+  
+  for (i = 0; i < daemon->subnet_cache_scopes; i++, a++)
+    if (subnet_entry_match(a, header, hash, flags, qend) &&
+	a->subnet.source_netmask == subnet->source_netmask &&
+	subnet_match(&a->subnet, subnet, a->subnet.scope_netmask))
+      {
+	if (difftime(now, a->expires) >= 0)
+	  {
+	    a->len = 0;
+	    return 0;
+	  }
+
+	if (a->len > udp_size)
+	  return 0;
+	
+	/* Keep the query's ID and question, take the rest from the saved reply. */
+	memcpy(((unsigned char *)header) + 2, a->reply + 2, sizeof(struct dns_header) - 2);
+	memcpy(((unsigned char *)header) + qend, a->reply + qend, a->len - qend);
+	
+	/* Echo this client's subnet, not that of the client which fetched the answer. */
+	if (a->opt_offset != 0 && subnet->source_netmask != 0)
+	  memcpy(((unsigned char *)header) + a->opt_offset + 4, subnet->addr, ((subnet->source_netmask - 1) >> 3) + 1);
+	
+	age_reply(header, a->len, (unsigned long)difftime(now, a->stored));
+	daemon->metrics[METRIC_DNS_SUBNET_CACHE_HITS]++;
+	daemon->metrics[METRIC_DNS_CACHE_HITS]++;
+
+	/* The saved reply is sent whole, so there are no records to log singly. */
+	if (option_bool(OPT_LOG) && extract_request(header, a->len, daemon->namebuff, NULL, NULL))
+	  log_query(F_RRNAME, daemon->namebuff, NULL, "<subnet>", 0);
+	return a->len;
+      }
+  
+  return 0;
+}
+
+/* Save a reply to a query sent with client subnet *subnet, where
+   subnet->scope_netmask is the scope returned by the upstream server. */
+void subnet_cache_insert(struct dns_header *header, size_t len, struct subnet_opt *subnet,
+			 unsigned int fwd_flags, time_t now)
+{
+  unsigned int hash;
+  unsigned short flags;
+  unsigned long ttl;
+  size_t qend;
+  struct subnet_answer *a, *set, *victim = NULL, *free = NULL, *oldest = NULL;
+  struct subnet_opt scoped, dummy;
+  unsigned char *opt;
+  int i, bits;
+  
+  if (!(qend = subnet_question(header, len, 1, fwd_flags, &hash, &flags)) ||
+      len > 0xffff || (header->hb3 & HB3_TC) ||
+      (RCODE(header) != NOERROR && RCODE(header) != NXDOMAIN) ||
+      (ttl = age_reply(header, len, 0)) == 0)
+    return;
+
+  if (daemon->max_cache_ttl != 0 && ttl > daemon->max_cache_ttl)
+    ttl = daemon->max_cache_ttl;
+  
+  /* An answer is never good for a wider range of clients than the query covered. */
+  if ((bits = subnet->scope_netmask) > subnet->source_netmask)
+    bits = subnet->source_netmask;
+
+  memset(&scoped, 0, sizeof(scoped));
+  scoped.family = subnet->family;
+  scoped.source_netmask = subnet->source_netmask;
+  scoped.scope_netmask = bits;
+  memcpy(scoped.addr, subnet->addr, (bits + 7) >> 3);
+  if (bits & 7)
+    scoped.addr[bits >> 3] &= 0xff << (8 - (bits & 7));
+  
+  set = &subnet_cache[(hash % subnet_sets) * daemon->subnet_cache_scopes];
+  
+  /* Replace the answer for the same scope, or a free or expired slot, or the oldest. */
+  for (a = set, i = 0; i < daemon->subnet_cache_scopes; i++, a++)
+    {
+      if (subnet_entry_match(a, header, hash, flags, qend) &&
+	  a->subnet.source_netmask == scoped.source_netmask &&
+	  a->subnet.scope_netmask == scoped.scope_netmask &&
+	  subnet_match(&a->subnet, &scoped, bits))
+	{
+	  victim = a;
+	  break;
+	}
+      
+      if (a->len == 0 || difftime(now, a->expires) >= 0)
+	{
+	  if (!free)
+	    free = a;
+	}
+      else if (!oldest || difftime(oldest->stored, a->stored) > 0)
+	oldest = a;
+    }
+
+  if (!victim)
+    victim = free ? free : oldest;
+  
+  a = victim;
+  a->len = 0;
+  
+  if (a->size < len)
+    {
+      unsigned char *new;
+      
+      if (!(new = whine_realloc(a->reply, len)))
+	return;
+
+      a->reply = new;
+      a->size = len;
+    }
+
+  memcpy(a->reply, header, len);
+  a->len = len;
+  a->hash = hash;
+  a->flags = flags;
+  a->qend = qend;
+  a->subnet = scoped;
+  a->stored = now;
+  a->expires = now + ttl;
+  a->opt_offset = 0;
+
+  /* Note where the client subnet is, if it's returned to the client. */
+  if ((opt = get_subnet_opt(header, len, &dummy)) &&
+      dummy.family == subnet->family && dummy.source_netmask == subnet->source_netmask)
+    a->opt_offset = opt - (unsigned char *)header;
+}
+
+void subnet_cache_flush(void)
+{
+  int i;
+
+  if (subnet_cache)
+    for (i = 0; i < subnet_sets * daemon->subnet_cache_scopes; i++)
+      subnet_cache[i].len = 0;
+}
+
 static void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrlen, 
 			    unsigned int index, struct crec **rhash, int hashsz)
 {
@@ -1548,7 +2991,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 void cache_reload(void)
 {
   struct crec *cache, **up, *tmp;
-  int revhashsz, i, total_size = daemon->cachesize;
+  int revhashsz, i, n, total_size = daemon->cachesize;
   struct hostsfile *ah;
   struct host_record *hr;
   struct name_list *nl;
@@ -1565,31 +3008,45 @@ void cache_reload(void)
 
   daemon->metrics[METRIC_DNS_CACHE_INSERTED] = 0;
   daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED] = 0;
-  
-  for (i=0; i<hash_size; i++)
-    for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
-      {
-	cache_blockdata_free(cache);
 
-	tmp = cache->hash_next;
-	if (cache->flags & (F_HOSTS | F_CONFIG))
-	  {
-	    *up = cache->hash_next;
-	    free_config_crec(cache);
-	  }
-	else if (!(cache->flags & F_DHCP))
-	  {
-	    *up = cache->hash_next;
-	    if (cache->flags & F_BIGNAME)
-	      {
-		cache->name.bname->next = big_free;
-		big_free = cache->name.bname;
-	      }
-	    cache->flags = 0;
-	  }
-	else
-	  up = &cache->hash_next;
-      }
+  answer_cache_flush();
+  subnet_cache_flush();
+  
+  for (n = 0; n < daemon->cache_shards; n++)
+    for (i=0; i<shards[n].hash_size; i++)
+      for (cache = shards[n].hash_table[i], up = &shards[n].hash_table[i]; cache; cache = tmp)
+	{
+	  cache_blockdata_free(cache);
+	  
+	  tmp = cache->hash_next;
+	  if (cache->flags & (F_HOSTS | F_CONFIG))
+	    {
+	      *up = cache->hash_next;
+	      type_unhash(cache);
+	      free_config_crec(cache);
+	    }
+	  else if (!(cache->flags & F_DHCP))
+	    {
+	      *up = cache->hash_next;
+	      type_unhash(cache);
+	      if (cache->expire_idx != 0)
+		expire_remove(cache);
+	      if (cache->probation)
+		{
+		  cache_unlink(cache);
+		  cache_link_tail(cache);
+		}
+	      if (cache->flags & F_BIGNAME)
+		{
+		  cache->name.bname->next = big_free;
+		  big_free = cache->name.bname;
+		}
+	      cache->flags = 0;
+	      shards[n].live--;
+	    }
+	  else
+	    up = &cache->hash_next;
+	}
 
   free_names(UID_NONE); /* free everything */
   
@@ -1742,17 +3199,21 @@ struct in_addr a_record_from_hosts(char *name, time_t now)
 void cache_unhash_dhcp(void)
 {
   struct crec *cache, **up;
-  int i;
+  int i, n;
 
-  for (i=0; i<hash_size; i++)
-    for (cache = hash_table[i], up = &hash_table[i]; cache; cache = cache->hash_next)
-      if (cache->flags & F_DHCP)
-	{
-	  *up = cache->hash_next;
-	  free_config_crec(cache);
-	}
-      else
-	up = &cache->hash_next;
+  answer_cache_flush();
+
+  for (n = 0; n < daemon->cache_shards; n++)
+    for (i=0; i<shards[n].hash_size; i++)
+      for (cache = shards[n].hash_table[i], up = &shards[n].hash_table[i]; cache; cache = cache->hash_next)
+	if (cache->flags & F_DHCP)
+	  {
+	    *up = cache->hash_next;
+	    type_unhash(cache);
+	    free_config_crec(cache);
+	  }
+	else
+	  up = &cache->hash_next;
 }
 
 void cache_add_dhcp_entry(char *host_name, int prot,
@@ -1845,6 +3306,7 @@ static void make_non_terminals(struct crec *source)
 {
   char *name = cache_get_name(source);
   struct crec *crecp, *tmp, **up;
+  unsigned int hash;
   int type = F_HOSTS | F_CONFIG;
 #ifdef HAVE_DHCP
   if (source->flags & F_DHCP)
@@ -1856,17 +3318,19 @@ static void make_non_terminals(struct crec *source)
      entry and vice-versa for HOSTS and CONFIG. This ensures that 
      non-terminals from DHCP go when we reload DHCP and 
      for HOSTS/CONFIG when we re-read. */
-  for (up = hash_bucket(name), crecp = *up; crecp; crecp = tmp)
+  for (hash = hostname_hash(name), up = hash_bucket(name_shard(hash), hash), crecp = *up; crecp; crecp = tmp)
     {
       tmp = crecp->hash_next;
 
-      if (!is_outdated_cname_pointer(crecp) &&
+      if (crecp->name_hash == hash &&
+	  !is_outdated_cname_pointer(crecp) &&
 	  (crecp->flags & F_FORWARD) &&
 	  (crecp->flags & type) &&
 	  !(crecp->flags & (F_IPV4 | F_IPV6 | F_CNAME | F_DNSKEY | F_DS | F_RR)) && 
 	  hostname_isequal(name, cache_get_name(crecp)))
 	{
 	  *up = crecp->hash_next;
+	  type_unhash(crecp);
 	  free_config_crec(crecp);
 	  break;
 	}
@@ -1879,8 +3343,9 @@ static void make_non_terminals(struct crec *source)
       name++;
 
       /* Look for one existing, don't need another */
-      for (crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
-	if (!is_outdated_cname_pointer(crecp) &&
+      for (hash = hostname_hash(name), crecp = *hash_bucket(name_shard(hash), hash); crecp; crecp = crecp->hash_next)
+	if (crecp->name_hash == hash &&
+	    !is_outdated_cname_pointer(crecp) &&
 	    (crecp->flags & F_FORWARD) &&
 	    (crecp->flags & type) &&
 	    hostname_isequal(name, cache_get_name(crecp)))
@@ -1954,6 +3419,17 @@ int cache_make_stat(struct txt_record *t)
       break;
 #endif
 
+    case TXT_STAT_HITRATIO:
+      {
+	unsigned int hits = daemon->metrics[METRIC_DNS_CACHE_HITS];
+	unsigned int total = hits + daemon->metrics[METRIC_DNS_CACHE_MISSES];
+	unsigned int ratio = total == 0 ? 0 : (unsigned int)((10000ULL * hits) / total);
+	
+	sprintf(buff+1, "%s %u.%02u%%", daemon->cache_policy == CACHE_POLICY_2Q ? "2q" : "lru",
+		ratio / 100, ratio % 100);
+	break;
+      }
+      
     case TXT_STAT_SERVERS:
       /* sum counts from different records for same server */
       for (serv = daemon->servers; serv; serv = serv->next)
@@ -1996,6 +3472,41 @@ int cache_make_stat(struct txt_record *t)
       t->len = p - buff;
 
       return 1;
+
+    case TXT_STAT_SHARDS:
+      /* one string per shard: "size in-use on-probation" */
+      {
+	int i, size, live, probation;
+	
+	for (i = 0; cache_shard_stats(i, &size, &live, &probation); i++)
+	  {
+	    char *new, *lenp;
+	    int newlen, bytes_avail, bytes_needed;
+	    
+	    lenp = p++; /* length */
+	    bytes_avail = bufflen - (p - buff);
+	    bytes_needed = snprintf(p, bytes_avail, "%d %d %d", size, live, probation);
+	    if (bytes_needed >= bytes_avail)
+	      {
+		/* expand buffer if necessary */
+		newlen = bytes_needed + 1 + bufflen - bytes_avail;
+		if (!(new = whine_realloc(buff, newlen)))
+		  return 0;
+		p = new + (p - buff);
+		lenp = p - 1;
+		buff = new;
+		bufflen = newlen;
+		bytes_avail = bufflen - (p - buff);
+		bytes_needed = snprintf(p, bytes_avail, "%d %d %d", size, live, probation);
+	      }
+	    *lenp = bytes_needed;
+	    p += bytes_needed;
+	  }
+	t->txt = (unsigned char *)buff;
+	t->len = p - buff;
+	
+	return 1;
+      }
     }
   
   len = strlen(buff+1);
@@ -2130,6 +3641,19 @@ static void dump_cache_entry(struct crec *cache, time_t now)
   my_syslog(LOG_INFO, "%s", buff);
 }
 
+/* Occupancy of cache shard n, returns zero when there is no such shard. */
+int cache_shard_stats(int n, int *size, int *live, int *probation)
+{
+  if (!shards || n < 0 || n >= daemon->cache_shards)
+    return 0;
+
+  *size = shards[n].size;
+  *live = shards[n].live;
+  *probation = shards[n].probe_count;
+
+  return 1;
+}
+
 void dump_cache(time_t now)
 {
   struct server *serv, *serv1;
@@ -2137,10 +3661,34 @@ void dump_cache(time_t now)
   my_syslog(LOG_INFO, _("time %lu"), (unsigned long)now);
   my_syslog(LOG_INFO, _("cache size %d, %d/%d cache insertions re-used unexpired cache entries."), 
 	    daemon->cachesize, daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED], daemon->metrics[METRIC_DNS_CACHE_INSERTED]);
+  my_syslog(LOG_INFO, _("expired cache entries freed %u, most in one pass %u"),
+	    daemon->metrics[METRIC_DNS_CACHE_REAPED], daemon->metrics[METRIC_DNS_CACHE_REAP_HWM]);
+  if (daemon->cache_policy == CACHE_POLICY_2Q)
+    {
+      int i, probe_count = 0;
+
+      for (i = 0; i < daemon->cache_shards; i++)
+	probe_count += shards[i].probe_count;
+      
+      my_syslog(LOG_INFO, _("cache entries on probation %d, promoted %u"),
+		probe_count, daemon->metrics[METRIC_DNS_CACHE_PROMOTED]);
+    }
+  if (daemon->cache_shards > 1)
+    {
+      int i, size, live, probation;
+      
+      for (i = 0; cache_shard_stats(i, &size, &live, &probation); i++)
+	my_syslog(LOG_INFO, _("cache shard %d: size %d, in use %d, on probation %d"),
+		  i, size, live, probation);
+    }
   my_syslog(LOG_INFO, _("queries forwarded %u, queries answered locally %u"), 
 	    daemon->metrics[METRIC_DNS_QUERIES_FORWARDED], daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]);
   if (daemon->cache_max_expiry != 0)
     my_syslog(LOG_INFO, _("queries answered from stale cache %u"), daemon->metrics[METRIC_DNS_STALE_ANSWERED]);
+  if (daemon->answer_cache_size != 0)
+    my_syslog(LOG_INFO, _("queries answered from answer cache %u"), daemon->metrics[METRIC_DNS_ANSWER_CACHE_HITS]);
+  if (daemon->subnet_cache_size != 0)
+    my_syslog(LOG_INFO, _("queries answered from subnet cache %u"), daemon->metrics[METRIC_DNS_SUBNET_CACHE_HITS]);
 #ifdef HAVE_AUTH
   my_syslog(LOG_INFO, _("queries for authoritative zones %u"), daemon->metrics[METRIC_DNS_AUTH_ANSWERED]);
 #endif
@@ -2148,8 +3696,17 @@ void dump_cache(time_t now)
   my_syslog(LOG_INFO, _("DNSSEC per-query subqueries HWM %u"), daemon->metrics[METRIC_WORK_HWM]);
   my_syslog(LOG_INFO, _("DNSSEC per-query crypto work HWM %u"), daemon->metrics[METRIC_CRYPTO_HWM]);
   my_syslog(LOG_INFO, _("DNSSEC per-RRSet signature fails HWM %u"), daemon->metrics[METRIC_SIG_FAIL_HWM]);
+  my_syslog(LOG_INFO, _("DNSSEC DNSKEY and DS queries coalesced %u"), daemon->metrics[METRIC_DNSSEC_SUBQUERIES_COALESCED]);
+  my_syslog(LOG_INFO, _("DNSSEC verified signature cache hits %u, misses %u, parsed key cache hits %u, misses %u"),
+	    daemon->metrics[METRIC_DNSSEC_SIG_CACHE_HITS], daemon->metrics[METRIC_DNSSEC_SIG_CACHE_MISSES],
+	    daemon->metrics[METRIC_DNSSEC_KEY_CACHE_HITS], daemon->metrics[METRIC_DNSSEC_KEY_CACHE_MISSES]);
 #endif
 
+  warmup_report();
+#ifdef HAVE_HISTOGRAMS
+  latency_report();
+#endif
+  loop_report(now);
   blockdata_report();
   my_syslog(LOG_INFO, _("child processes for TCP requests: in use %zu, highest since last SIGUSR1 %zu, max allowed %zu."),
 	    daemon->metrics[METRIC_TCP_CONNECTIONS],
@@ -2167,6 +3724,11 @@ void dump_cache(time_t now)
 	int port;
 	unsigned int queries = 0, failed_queries = 0, nxdomain_replies = 0, retrys = 0;
 	unsigned int sigma_latency = 0, count_latency = 0;
+#ifdef HAVE_HISTOGRAMS
+	struct histogram rtt;
+
+	memset(&rtt, 0, sizeof(rtt));
+#endif
 
 	for (serv1 = serv; serv1; serv1 = serv1->next)
 	  if (!(serv1->flags & SERV_MARK) && sockaddr_isequal(&serv->addr, &serv1->addr))
@@ -2178,22 +3740,33 @@ void dump_cache(time_t now)
 	      retrys += serv1->retrys;
 	      sigma_latency += serv1->query_latency;
 	      count_latency++;
+#ifdef HAVE_HISTOGRAMS
+	      if (serv1->rtt)
+		hist_merge(&rtt, serv1->rtt);
+#endif
 	    }
 	port = prettyprint_addr(&serv->addr, daemon->addrbuff);
 	my_syslog(LOG_INFO, _("server %s#%d: queries sent %u, retried %u, failed %u, nxdomain replies %u, avg. latency %ums"),
 		  daemon->addrbuff, port, queries, retrys, failed_queries, nxdomain_replies, sigma_latency/count_latency);
+#ifdef HAVE_HISTOGRAMS
+	if (rtt.count != 0)
+	  my_syslog(LOG_INFO, _("server %s#%d: round trip 50%% %uus, 90%% %uus, 99%% %uus, max %uus"),
+		    daemon->addrbuff, port, hist_percentile(&rtt, 50), hist_percentile(&rtt, 90),
+		    hist_percentile(&rtt, 99), rtt.max);
+#endif
       }
 
   if (option_bool(OPT_DEBUG) || option_bool(OPT_LOG))
     {
       struct crec *cache;
-      int i;
+      int i, n;
       my_syslog(LOG_INFO, "Host                           Address                                  Flags      Expires                  Source");
       my_syslog(LOG_INFO, "------------------------------ ---------------------------------------- ---------- ------------------------ ------------");
     
-      for (i=0; i<hash_size; i++)
-	for (cache = hash_table[i]; cache; cache = cache->hash_next)
-	  dump_cache_entry(cache, now);
+      for (n = 0; n < daemon->cache_shards; n++)
+	for (i=0; i<shards[n].hash_size; i++)
+	  for (cache = shards[n].hash_table[i]; cache; cache = cache->hash_next)
+	    dump_cache_entry(cache, now);
     }
 }
 
@@ -2330,6 +3903,12 @@ void log_query(unsigned int flags, char *name, union all_addr *addr, char *arg,
   if (!option_bool(OPT_LOG))
     return;
 
+#ifdef HAVE_DNSSEC
+  /* Don't log provisional validation results, they'll be logged when the validation is re-run. */
+  if (crypto_async_pending())
+    return;
+#endif
+  
   if(option_bool(OPT_LOG_ONLY_FAILED) && !error_occured(flags))
     return;
 
@@ -37,6 +37,15 @@
 #define LOCALS_LOGGED 8 /* Only log this many local addresses when logging state */
 #define LEASE_RETRY 60 /* on error, retry writing leasefile after LEASE_RETRY seconds */
 #define CACHESIZ 150 /* default cache size */
+#define CACHE_EXPIRE_BATCH 1000 /* free at most this many expired cache entries per main-loop pass */
+#define CACHE_PROBATION 10 /* percentage of cache for new entries with --cache-policy=2q */
+#define CACHE_SHARDS 1 /* default number of cache shards */
+#define CACHE_SKETCH_DEPTH 4 /* rows in the name-frequency sketch for --cache-policy=2q */
+#define SUBNET_CACHE_SCOPES 8 /* default limit on client subnets kept for one name by --subnet-cache */
+#define SHARED_CACHE_NAME 128 /* longest name passed to TCP children by --shared-cache */
+#define PIPE_BUFF_KEEP 65536 /* larger cache transaction buffers are freed after use */
+#define CACHE_WARMUP_RATE 50 /* default queries per second sent by --cache-warmup */
+#define CACHE_WARMUP_INFLIGHT 32 /* max --cache-warmup queries awaiting answers at once */
 #define TTL_FLOOR_LIMIT 3600 /* don't allow --min-cache-ttl to raise TTL above this under any circumstances */
 #define MAXLEASES 1000 /* maximum number of DHCP leases */
 #define PING_WAIT 3 /* wait for ping address-in-use test */
@@ -46,6 +55,10 @@
 #define SMALLDNAME 75 /* most domain names are smaller than this */
 #define CNAME_CHAIN 10 /* chains longer than this atr dropped for loop protection */
 #define DNSSEC_MIN_TTL 60 /* DNSKEY and DS records in cache last at least this long */
+#define DNSSEC_SIG_CACHE 256 /* number of successfully verified signatures remembered */
+#define DNSSEC_KEY_CACHE 16 /* number of DNSKEYs kept in parsed form */
+#define ANSWER_CACHE_NAMES 8 /* replies using more names than this aren't kept in the answer cache */
+#define ANSWER_CACHE_MAP 1024 /* slots in the count of names used by the answer cache */
 #define HOSTSFILE "/etc/hosts"
 #define ETHERSFILE "/etc/ethers"
 #define DEFLEASE 3600 /* default DHCPv4 lease time, one hour */
@@ -56,6 +69,21 @@
 #define TFTP_MAX_WINDOW 32 /* max window size to negotiate */
 #define TFTP_TRANSFER_TIME 120 /* Abandon TFTP transfers after this long. Two mins. */
 #define LOG_MAX 5 /* log-queue length */
+#define LOG_BATCH 16 /* log lines gathered into one write */
+#define DNSTAP_BUFSIZE 262144 /* dnstap frames buffered awaiting the reader */
+#define DNSTAP_FRAME_MAX (65536 + 1024) /* largest dnstap frame, a TCP message plus fields */
+#define DNSTAP_RETRY 5 /* seconds between attempts to connect to the dnstap reader */
+#define OPENMETRICS_MAX_CONNS 4 /* concurrent connections to --metrics-listen */
+#define OPENMETRICS_BUFSIZE 4096 /* output rendered at a time for each connection */
+#define OPENMETRICS_REQUEST_MAX 1024 /* longest HTTP request accepted */
+#define OPENMETRICS_TIMEOUT 10 /* seconds a metrics connection may stall */
+#define HIST_BUCKETS 96 /* buckets in latency histograms, log-linear from 1us to about 30s */
+#define DUMP_BUFSIZE 65536 /* --dumpfile records buffered before writing */
+#define DUMP_FLUSH_TIME 1000 /* ms a buffered --dumpfile record may wait to be written */
+#define DUMP_FD_CACHE 64 /* socket addresses remembered for --dumpfile */
+#define DUMP_RING_INTERVAL 10 /* min seconds between writes of the --dumpring capture caused by failures */
+#define STALL_BUDGET 100 /* default --stall-budget, ms */
+#define STALL_RECORDS 8 /* worst main loop stalls kept for reporting */
 #define RANDFILE "/dev/urandom"
 #define DNSMASQ_SERVICE "uk.org.thekelleys.dnsmasq" /* Default - may be overridden by config */
 #define DNSMASQ_PATH "/uk/org/thekelleys/dnsmasq"
@@ -136,9 +164,22 @@ HAVE_AUTH
 HAVE_DNSSEC
    include DNSSEC validator.
 
+HAVE_DNSSEC_THREADS
+   allow DNSSEC signature verification to be done by a pool of threads,
+   see --dnssec-threads. Implies HAVE_DNSSEC, links against libpthread.
+
 HAVE_DUMPFILE
    include code to dump packets to a libpcap-format file for debugging.
 
+HAVE_DNSTAP
+   include code to log DNS messages in dnstap format, see --dnstap.
+
+HAVE_OPENMETRICS
+   include an HTTP server for metrics in OpenMetrics format, see --metrics-listen.
+
+HAVE_HISTOGRAMS
+   keep histograms of query latency and upstream server round-trip time.
+
 HAVE_LOOP
    include functionality to probe for and remove DNS forwarding loops.
 
@@ -155,6 +196,9 @@ NO_SCRIPT
 NO_LARGEFILE
 NO_AUTH
 NO_DUMPFILE
+NO_DNSTAP
+NO_OPENMETRICS
+NO_HISTOGRAMS
 NO_LOOP
 NO_INOTIFY
 NO_IPSET
@@ -190,6 +234,9 @@ RESOLVFILE
 #define HAVE_IPSET 
 #define HAVE_LOOP
 #define HAVE_DUMPFILE
+#define HAVE_DNSTAP
+#define HAVE_OPENMETRICS
+#define HAVE_HISTOGRAMS
 
 /* Build options which require external libraries.
    
@@ -204,6 +251,7 @@ RESOLVFILE
 /* #define HAVE_LIBIDN2 */
 /* #define HAVE_CONNTRACK */
 /* #define HAVE_DNSSEC */
+/* #define HAVE_DNSSEC_THREADS */
 /* #define HAVE_NFTSET */
 
 /* Default locations for important system files. */
@@ -351,6 +399,11 @@ HAVE_SOCKADDR_SA_LEN
 #undef HAVE_AUTH
 #endif
 
+/* Must HAVE_DNSSEC to HAVE_DNSSEC_THREADS */
+#ifdef HAVE_DNSSEC_THREADS
+#define HAVE_DNSSEC
+#endif
+
 #if !defined(HAVE_LINUX_NETWORK)
 #undef HAVE_NFTSET
 #endif
@@ -377,6 +430,18 @@ HAVE_SOCKADDR_SA_LEN
 #undef HAVE_DUMPFILE
 #endif
 
+#ifdef NO_DNSTAP
+#undef HAVE_DNSTAP
+#endif
+
+#ifdef NO_OPENMETRICS
+#undef HAVE_OPENMETRICS
+#endif
+
+#ifdef NO_HISTOGRAMS
+#undef HAVE_HISTOGRAMS
+#endif
+
 #if !defined(NO_INOTIFY)
 #  if defined (HAVE_LINUX_NETWORK)
 #    define HAVE_INOTIFY
@@ -469,6 +534,9 @@ static char *compile_opts =
 "no-"
 #endif
 "DNSSEC "
+#ifdef HAVE_DNSSEC_THREADS
+"DNSSEC-threads "
+#endif
 #ifdef NO_ID
 "no-ID "
 #endif
@@ -483,6 +551,18 @@ static char *compile_opts =
 #ifndef HAVE_DUMPFILE
 "no-"
 #endif
-"dumpfile";
+"dumpfile "
+#ifndef HAVE_DNSTAP
+"no-"
+#endif
+"dnstap "
+#ifndef HAVE_OPENMETRICS
+"no-"
+#endif
+"openmetrics "
+#ifndef HAVE_HISTOGRAMS
+"no-"
+#endif
+"histograms";
 
 #endif /* defined(DNSMASQ_COMPILE_OPTS) */
@@ -28,6 +28,7 @@ int get_incoming_mark(union mysockaddr *peer_addr, union all_addr *local_addr, i
 {
   struct nf_conntrack *ct;
   struct nfct_handle *h;
+  u32 started = dnsmasq_microseconds();
   
   gotit = 0;
   
@@ -69,6 +70,8 @@ int get_incoming_mark(union mysockaddr *peer_addr, union all_addr *local_addr, i
       nfct_destroy(ct);
     }
 
+  stall_site("conntrack", started);
+  
   return gotit;
 }
 
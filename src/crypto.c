@@ -33,12 +33,16 @@
 #include <nettle/rsa.h>
 #include <nettle/ecdsa.h>
 #include <nettle/ecc-curve.h>
+#include <nettle/sha2.h>
 #if MIN_VERSION(3, 1)
 #include <nettle/eddsa.h>
 #endif
 #if MIN_VERSION(3, 6)
 #  include <nettle/gostdsa.h>
 #endif
+#ifdef HAVE_DNSSEC_THREADS
+#  include <pthread.h>
+#endif
 
 #if MIN_VERSION(3, 1)
 /* Implement a "hash-function" to the nettle API, which simply returns
@@ -159,27 +163,41 @@ int hash_init(const struct nettle_hash *hash, void **ctxp, unsigned char **diges
   return 1;
 }
 
-static int dnsmasq_rsa_verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
-			      unsigned char *digest, size_t digest_len, int algo)
+#if !MIN_VERSION(3, 4)
+#define nettle_get_secp_256r1() (&nettle_secp_256r1)
+#define nettle_get_secp_384r1() (&nettle_secp_384r1)
+#endif
+
+/* Public keys in the form used by nettle. EdDSA keys are used as-is. */
+union dnskey {
+  struct rsa_public_key rsa;
+  struct ecc_point ecc;
+};
+
+static int key_needs_import(int algo)
 {
-  unsigned char *p;
-  size_t exp_len;
-  
-  static struct rsa_public_key *key = NULL;
-  static mpz_t sig_mpz;
+  return algo != 15 && algo != 16;
+}
 
-  (void)digest_len;
-  
-  if (key == NULL)
+static void key_clear(union dnskey *key, int algo)
+{
+  switch (algo)
     {
-      if (!(key = whine_malloc(sizeof(struct rsa_public_key))))
-	return 0;
-      
-      nettle_rsa_public_key_init(key);
-      mpz_init(sig_mpz);
+    case 5: case 7: case 8: case 10:
+      nettle_rsa_public_key_clear(&key->rsa);
+      break;
+
+    case 12: case 13: case 14:
+      nettle_ecc_point_clear(&key->ecc);
+      break;
     }
-  
-  if ((key_len < 3) || !(p = blockdata_retrieve(key_data, key_len, NULL)))
+}
+
+static int rsa_key_import(struct rsa_public_key *key, unsigned char *p, unsigned int key_len)
+{
+  size_t exp_len;
+
+  if (key_len < 3)
     return 0;
   
   key_len--;
@@ -196,72 +214,367 @@ static int dnsmasq_rsa_verify(struct blockdata *key_data, unsigned int key_len,
   mpz_import(key->e, exp_len, 1, 1, 0, 0, p);
   mpz_import(key->n, key->size, 1, 1, 0, 0, p + exp_len);
 
+  return 1;
+}
+
+/* Coordinates are big-endian for ECDSA, little-endian for GOST. */
+static int ecc_key_import(struct ecc_point *key, unsigned char *p, unsigned int key_len, int order)
+{
+  mpz_t x, y;
+  unsigned int t = key_len/2;
+  int ret;
+  
+  mpz_init(x);
+  mpz_init(y);
+  
+  mpz_import(x, t, order, 1, 0, 0, p);
+  mpz_import(y, t, order, 1, 0, 0, p + t);
+  
+  ret = ecc_point_set(key, x, y);
+
+  mpz_clear(x);
+  mpz_clear(y);
+
+  return ret;
+}
+
+/* Import the raw DNSKEY data into key. Returns zero, with nothing
+   to clear, if the key is malformed or the algorithm unknown. */
+static int key_import(union dnskey *key, unsigned char *p, unsigned int key_len, int algo)
+{
+  int ok = 0;
+  
+  switch (algo)
+    {
+    case 5: case 7: case 8: case 10:
+      nettle_rsa_public_key_init(&key->rsa);
+      ok = rsa_key_import(&key->rsa, p, key_len);
+      break;
+
+#if MIN_VERSION(3, 6)
+    case 12:
+      if (key_len != 64)
+	return 0;
+      nettle_ecc_point_init(&key->ecc, nettle_get_gost_gc256b());
+      ok = ecc_key_import(&key->ecc, p, key_len, -1);
+      break;
+#endif
+      
+    case 13:
+      if (key_len != 64)
+	return 0;
+      nettle_ecc_point_init(&key->ecc, nettle_get_secp_256r1());
+      ok = ecc_key_import(&key->ecc, p, key_len, 1);
+      break;
+
+    case 14:
+      if (key_len != 96)
+	return 0;
+      nettle_ecc_point_init(&key->ecc, nettle_get_secp_384r1());
+      ok = ecc_key_import(&key->ecc, p, key_len, 1);
+      break;
+
+    default:
+      return 0;
+    }
+
+  if (!ok)
+    key_clear(key, algo);
+
+  return ok;
+}
+
+/* Keys which have been imported into nettle/GMP form, ready for
+   use. They're found by comparing the raw key data, so a cached
+   key can never be used in place of a different key with the same
+   tag, and entries never need to be invalidated. Eviction is LRU. */
+struct key_cache {
+  int algo; /* zero -> unused */
+  unsigned int keylen, lastused;
+  unsigned char *raw;
+  union dnskey key;
+};
+
+static struct key_cache *key_cache = NULL;
+static unsigned int key_cache_tick = 0;
+
+static void key_cache_clear(struct key_cache *kc)
+{
+  if (kc->algo != 0)
+    key_clear(&kc->key, kc->algo);
+  
+  free(kc->raw);
+  kc->raw = NULL;
+  kc->algo = 0;
+}
+
+/* Return the imported form of the key in p, importing it if it's not already cached. */
+static union dnskey *key_cache_find(unsigned char *p, unsigned int key_len, int algo)
+{
+  struct key_cache *kc, *victim;
+  int i;
+
+  if (!key_cache &&
+      !(key_cache = whine_malloc(DNSSEC_KEY_CACHE * sizeof(struct key_cache))))
+    return NULL;
+  
+  key_cache_tick++;
+  
+  for (victim = kc = key_cache, i = 0; i < DNSSEC_KEY_CACHE; i++, kc++)
+    {
+      if (kc->algo == algo && kc->keylen == key_len && memcmp(kc->raw, p, key_len) == 0)
+	{
+	  kc->lastused = key_cache_tick;
+	  daemon->metrics[METRIC_DNSSEC_KEY_CACHE_HITS]++;
+	  return &kc->key;
+	}
+
+      if (victim->algo != 0 && (kc->algo == 0 || kc->lastused < victim->lastused))
+	victim = kc;
+    }
+
+  daemon->metrics[METRIC_DNSSEC_KEY_CACHE_MISSES]++;
+  
+  key_cache_clear(victim);
+  
+  if (!(victim->raw = whine_malloc(key_len)))
+    return NULL;
+
+  if (!key_import(&victim->key, p, key_len, algo))
+    {
+      key_cache_clear(victim);
+      return NULL;
+    }
+  
+  memcpy(victim->raw, p, key_len);
+  victim->algo = algo;
+  victim->keylen = key_len;
+  victim->lastused = key_cache_tick;
+  
+  return &victim->key;
+}
+
+/* Results of signatures which have already been verified, remembered
+   as a SHA-256 over the algorithm, key, signature and digest, so that
+   a hit means exactly the same computation has been done before.
+   LRU list plus hash chains. fresh marks a result from the worker threads
+   which hasn't been looked at yet: its miss was counted when it was queued. */
+struct sig_cache {
+  unsigned char fp[SHA256_DIGEST_SIZE];
+  int used, result, fresh;
+  struct sig_cache *prev, *next, *hash_next;
+};
+
+static struct sig_cache *sig_head = NULL, *sig_tail = NULL, **sig_hash = NULL;
+static unsigned int sig_hash_size;
+
+#ifdef HAVE_DNSSEC_THREADS
+/* The validation in progress between crypto_async_start() and crypto_async_end(),
+   and the signature cache hits it has made, which count only if it queues nothing. */
+static struct frec *async_owner = NULL;
+static int async_uid, async_jobs, async_hits;
+#endif
+
+static struct sig_cache **sig_cache_bucket(unsigned char *fp)
+{
+  u32 h;
+
+  /* fingerprint is a crypto hash, any four bytes will do. */
+  memcpy(&h, fp, sizeof(h));
+  return &sig_hash[h & (sig_hash_size - 1)];
+}
+
+static void sig_cache_promote(struct sig_cache *sc)
+{
+  if (sc == sig_head)
+    return;
+
+  sc->prev->next = sc->next;
+  if (sc->next)
+    sc->next->prev = sc->prev;
+  else
+    sig_tail = sc->prev;
+
+  sc->prev = NULL;
+  sc->next = sig_head;
+  sig_head->prev = sc;
+  sig_head = sc;
+}
+
+static int sig_cache_init(void)
+{
+  struct sig_cache *new;
+  int i;
+
+  for (sig_hash_size = 16; sig_hash_size < DNSSEC_SIG_CACHE; sig_hash_size <<= 1);
+
+  if (!(new = whine_malloc(DNSSEC_SIG_CACHE * sizeof(struct sig_cache))) ||
+      !(sig_hash = whine_malloc(sig_hash_size * sizeof(struct sig_cache *))))
+    {
+      free(new);
+      return 0;
+    }
+
+  for (i = 0; i < DNSSEC_SIG_CACHE; i++, new++)
+    {
+      new->next = sig_head;
+      if (sig_head)
+	sig_head->prev = new;
+      else
+	sig_tail = new;
+      sig_head = new;
+    }
+
+  return 1;
+}
+
+static int sig_fingerprint(unsigned char *fp, int algo, unsigned char *key, unsigned int key_len,
+			   unsigned char *sig, size_t sig_len, unsigned char *digest, size_t digest_len)
+{
+  static const struct nettle_hash *hash = NULL;
+  static void *ctx = NULL;
+  unsigned char lens[7], *p = lens;
+
+  if (!hash)
+    {
+      if (!(hash = hash_find("sha256")) || !(ctx = whine_malloc(hash->context_size)))
+	{
+	  hash = NULL;
+	  return 0;
+	}
+    }
+  
+#if MIN_VERSION(3, 1)
+  /* The EdDSA "digest" is the whole message. */
+  if (algo == 15 || algo == 16)
+    {
+      digest_len = ((struct null_hash_digest *)digest)->len;
+      digest = ((struct null_hash_digest *)digest)->buff;
+    }
+#endif
+
+  /* lengths included so that the boundaries between fields are unambiguous. */
+  *p++ = algo;
+  PUTSHORT(key_len, p);
+  PUTSHORT(sig_len, p);
+  PUTSHORT(digest_len, p);
+  
+  hash->init(ctx);
+  hash->update(ctx, sizeof(lens), lens);
+  hash->update(ctx, key_len, key);
+  hash->update(ctx, sig_len, sig);
+  hash->update(ctx, digest_len, digest);
+  nettle_digest_wrapper(hash, ctx, SHA256_DIGEST_SIZE, fp);
+
+  return 1;
+}
+
+static int sig_cache_find(unsigned char *fp, int *result)
+{
+  struct sig_cache *sc;
+
+  if (!sig_hash && !sig_cache_init())
+    return 0;
+  
+  for (sc = *sig_cache_bucket(fp); sc; sc = sc->hash_next)
+    if (memcmp(sc->fp, fp, SHA256_DIGEST_SIZE) == 0)
+      {
+	sig_cache_promote(sc);
+	*result = sc->result;
+	
+	if (sc->fresh)
+	  sc->fresh = 0;
+#ifdef HAVE_DNSSEC_THREADS
+	else if (async_owner)
+	  async_hits++;
+#endif
+	else
+	  daemon->metrics[METRIC_DNSSEC_SIG_CACHE_HITS]++;
+	
+	return 1;
+      }
+
+  daemon->metrics[METRIC_DNSSEC_SIG_CACHE_MISSES]++;
+  return 0;
+}
+
+static void sig_cache_add(unsigned char *fp, int result, int fresh)
+{
+  struct sig_cache *sc = sig_tail, **up;
+
+  if (!sig_hash)
+    return;
+  
+  /* Recycle the least-recently used entry. */
+  if (sc->used)
+    for (up = sig_cache_bucket(sc->fp); *up; up = &(*up)->hash_next)
+      if (*up == sc)
+	{
+	  *up = sc->hash_next;
+	  break;
+	}
+  
+  memcpy(sc->fp, fp, SHA256_DIGEST_SIZE);
+  sc->used = 1;
+  sc->result = result;
+  sc->fresh = fresh;
+  up = sig_cache_bucket(fp);
+  sc->hash_next = *up;
+  *up = sc;
+  sig_cache_promote(sc);
+}
+
+/* The verify functions below keep no state of their own, so
+   they're safe to call from the worker threads. */
+static int dnsmasq_rsa_verify(union dnskey *key, unsigned char *key_data, unsigned int key_len,
+			      unsigned char *sig, size_t sig_len,
+			      unsigned char *digest, size_t digest_len, int algo)
+{
+  mpz_t sig_mpz;
+  int ret = 0;
+  
+  (void)key_data;
+  (void)key_len;
+  (void)digest_len;
+  
+  mpz_init(sig_mpz);
   mpz_import(sig_mpz, sig_len, 1, 1, 0, 0, sig);
   
   switch (algo)
     {
     case 5: case 7:
-      return nettle_rsa_sha1_verify_digest(key, digest, sig_mpz);
+      ret = nettle_rsa_sha1_verify_digest(&key->rsa, digest, sig_mpz);
+      break;
     case 8:
-      return nettle_rsa_sha256_verify_digest(key, digest, sig_mpz);
+      ret = nettle_rsa_sha256_verify_digest(&key->rsa, digest, sig_mpz);
+      break;
     case 10:
-      return nettle_rsa_sha512_verify_digest(key, digest, sig_mpz);
+      ret = nettle_rsa_sha512_verify_digest(&key->rsa, digest, sig_mpz);
+      break;
     }
 
-  return 0;
+  mpz_clear(sig_mpz);
+  
+  return ret;
 }  
 
-static int dnsmasq_ecdsa_verify(struct blockdata *key_data, unsigned int key_len, 
+static int dnsmasq_ecdsa_verify(union dnskey *key, unsigned char *key_data, unsigned int key_len,
 				unsigned char *sig, size_t sig_len,
 				unsigned char *digest, size_t digest_len, int algo)
 {
-  unsigned char *p;
   unsigned int t;
-  struct ecc_point *key;
-
-  static struct ecc_point *key_256 = NULL, *key_384 = NULL;
-  static mpz_t x, y;
-  static struct dsa_signature *sig_struct;
-#if !MIN_VERSION(3, 4)
-#define nettle_get_secp_256r1() (&nettle_secp_256r1)
-#define nettle_get_secp_384r1() (&nettle_secp_384r1)
-#endif
+  struct dsa_signature sig_struct;
+  int ret;
   
-  if (!sig_struct)
-    {
-      if (!(sig_struct = whine_malloc(sizeof(struct dsa_signature))))
-	return 0;
-      
-      nettle_dsa_signature_init(sig_struct);
-      mpz_init(x);
-      mpz_init(y);
-    }
+  (void)key_data;
   
   switch (algo)
     {
     case 13:
-      if (!key_256)
-	{
-	  if (!(key_256 = whine_malloc(sizeof(struct ecc_point))))
-	    return 0;
-	  
-	  nettle_ecc_point_init(key_256, nettle_get_secp_256r1());
-	}
-      
-      key = key_256;
       t = 32;
       break;
       
     case 14:
-      if (!key_384)
-	{
-	  if (!(key_384 = whine_malloc(sizeof(struct ecc_point))))
-	    return 0;
-	  
-	  nettle_ecc_point_init(key_384, nettle_get_secp_384r1());
-	}
-      
-      key = key_384;
       t = 48;
       break;
         
@@ -269,72 +582,54 @@ static int dnsmasq_ecdsa_verify(struct blockdata *key_data, unsigned int key_len
       return 0;
     }
   
-  if (sig_len != 2*t || key_len != 2*t ||
-      !(p = blockdata_retrieve(key_data, key_len, NULL)))
+  if (sig_len != 2*t || key_len != 2*t)
     return 0;
-  
-  mpz_import(x, t , 1, 1, 0, 0, p);
-  mpz_import(y, t , 1, 1, 0, 0, p + t);
 
-  if (!ecc_point_set(key, x, y))
-    return 0;
-  
-  mpz_import(sig_struct->r, t, 1, 1, 0, 0, sig);
-  mpz_import(sig_struct->s, t, 1, 1, 0, 0, sig + t);
+  nettle_dsa_signature_init(&sig_struct);
+  mpz_import(sig_struct.r, t, 1, 1, 0, 0, sig);
+  mpz_import(sig_struct.s, t, 1, 1, 0, 0, sig + t);
   
-  return nettle_ecdsa_verify(key, digest_len, digest, sig_struct);
+  ret = nettle_ecdsa_verify(&key->ecc, digest_len, digest, &sig_struct);
+
+  nettle_dsa_signature_clear(&sig_struct);
+
+  return ret;
 }
 
 #if MIN_VERSION(3, 6)
-static int dnsmasq_gostdsa_verify(struct blockdata *key_data, unsigned int key_len, 
+static int dnsmasq_gostdsa_verify(union dnskey *key, unsigned char *key_data, unsigned int key_len,
 				  unsigned char *sig, size_t sig_len,
 				  unsigned char *digest, size_t digest_len, int algo)
 {
-  unsigned char *p;
-  
-  static struct ecc_point *gost_key = NULL;
-  static mpz_t x, y;
-  static struct dsa_signature *sig_struct;
+  struct dsa_signature sig_struct;
+  int ret;
 
+  (void)key_data;
+  
   if (algo != 12 ||
-      sig_len != 64 || key_len != 64 ||
-      !(p = blockdata_retrieve(key_data, key_len, NULL)))
+      sig_len != 64 || key_len != 64)
     return 0;
   
-  if (!sig_struct)
-    {
-      if (!(sig_struct = whine_malloc(sizeof(struct dsa_signature))) ||
-	  !(gost_key = whine_malloc(sizeof(struct ecc_point))))
-	return 0;
-      
-      nettle_dsa_signature_init(sig_struct);
-      nettle_ecc_point_init(gost_key, nettle_get_gost_gc256b());
-      mpz_init(x);
-      mpz_init(y);
-    }
-    
-  mpz_import(x, 32, -1, 1, 0, 0, p);
-  mpz_import(y, 32, -1, 1, 0, 0, p + 32);
-
-  if (!ecc_point_set(gost_key, x, y))
-    return 0; 
-  
-  mpz_import(sig_struct->s, 32, 1, 1, 0, 0, sig);
-  mpz_import(sig_struct->r, 32, 1, 1, 0, 0, sig + 32);
+  nettle_dsa_signature_init(&sig_struct);
+  mpz_import(sig_struct.s, 32, 1, 1, 0, 0, sig);
+  mpz_import(sig_struct.r, 32, 1, 1, 0, 0, sig + 32);
   
-  return nettle_gostdsa_verify(gost_key, digest_len, digest, sig_struct);
+  ret = nettle_gostdsa_verify(&key->ecc, digest_len, digest, &sig_struct);
+
+  nettle_dsa_signature_clear(&sig_struct);
+
+  return ret;
 }
 #endif
 
 #if MIN_VERSION(3, 1)
-static int dnsmasq_eddsa_verify(struct blockdata *key_data, unsigned int key_len, 
+static int dnsmasq_eddsa_verify(union dnskey *key, unsigned char *key_data, unsigned int key_len,
 				unsigned char *sig, size_t sig_len,
 				unsigned char *digest, size_t digest_len, int algo)
 {
-  unsigned char *p;
-   
-  if (digest_len != sizeof(struct null_hash_digest) ||
-      !(p = blockdata_retrieve(key_data, key_len, NULL)))
+  (void)key;
+  
+  if (digest_len != sizeof(struct null_hash_digest))
     return 0;
   
   /* The "digest" returned by the null_hash function is simply a struct null_hash_digest
@@ -348,7 +643,7 @@ static int dnsmasq_eddsa_verify(struct blockdata *key_data, unsigned int key_len
 	  sig_len != ED25519_SIGNATURE_SIZE)
 	return 0;
 
-      return ed25519_sha512_verify(p,
+      return ed25519_sha512_verify(key_data,
 				   ((struct null_hash_digest *)digest)->len,
 				   ((struct null_hash_digest *)digest)->buff,
 				   sig);
@@ -359,7 +654,7 @@ static int dnsmasq_eddsa_verify(struct blockdata *key_data, unsigned int key_len
 	  sig_len != ED448_SIGNATURE_SIZE)
 	return 0;
 
-      return ed448_shake256_verify(p,
+      return ed448_shake256_verify(key_data,
 				   ((struct null_hash_digest *)digest)->len,
 				   ((struct null_hash_digest *)digest)->buff,
 				   sig);
@@ -371,8 +666,11 @@ static int dnsmasq_eddsa_verify(struct blockdata *key_data, unsigned int key_len
 }
 #endif
 
-static int (*verify_func(int algo))(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
-			     unsigned char *digest, size_t digest_len, int algo)
+typedef int verify_func_t(union dnskey *key, unsigned char *key_data, unsigned int key_len,
+			  unsigned char *sig, size_t sig_len,
+			  unsigned char *digest, size_t digest_len, int algo);
+
+static verify_func_t *verify_func(int algo)
 {
     
   /* Ensure at runtime that we have support for this digest */
@@ -407,19 +705,269 @@ static int (*verify_func(int algo))(struct blockdata *key_data, unsigned int key
   return NULL;
 }
 
+#ifdef HAVE_DNSSEC_THREADS
+/* Optional pool of threads which do the public-key operations.
+   
+   During a call to dnssec_validate_*() which has been bracketed by
+   crypto_async_start() and crypto_async_end(), verifications which
+   aren't in the signature cache are queued for the workers and
+   provisionally succeed. The caller sets aside the reply and
+   discards the provisional result. Finished jobs come back through
+   a pipe to the main loop, crypto_async_reply() puts each result in the
+   signature cache and, when the last job for a query is done, the
+   validation is run again: this time everything is in the cache.
+   
+   Only the verify functions run in the workers, everything else,
+   including the key and signature caches, is single-threaded. */
+struct crypto_job {
+  struct crypto_job *next;
+  verify_func_t *func;
+  struct frec *owner;
+  int uid, algo, result;
+  unsigned int key_len;
+  size_t sig_len, digest_len;
+  unsigned char *key, *sig, *digest;
+  unsigned char fp[SHA256_DIGEST_SIZE];
+#if MIN_VERSION(3, 1)
+  struct null_hash_digest nhd;
+#endif
+  unsigned char data[];
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct crypto_job *job_head = NULL, *job_tail = NULL;
+static int job_pipe[2] = { -1, -1 };
+
+static void *crypto_worker(void *arg)
+{
+  struct crypto_job *job;
+  union dnskey key;
+  
+  (void)arg;
+  
+  while (1)
+    {
+      pthread_mutex_lock(&job_lock);
+      while (!job_head)
+	pthread_cond_wait(&job_cond, &job_lock);
+      job = job_head;
+      if (!(job_head = job->next))
+	job_tail = NULL;
+      pthread_mutex_unlock(&job_lock);
+
+      if (!key_needs_import(job->algo))
+	job->result = job->func(NULL, job->key, job->key_len, job->sig, job->sig_len,
+				job->digest, job->digest_len, job->algo);
+      else if (key_import(&key, job->key, job->key_len, job->algo))
+	{
+	  job->result = job->func(&key, job->key, job->key_len, job->sig, job->sig_len,
+				  job->digest, job->digest_len, job->algo);
+	  key_clear(&key, job->algo);
+	}
+      else
+	job->result = 0;
+      
+      /* pointer-sized writes to a pipe are atomic. */
+      while (write(job_pipe[1], &job, sizeof(job)) == -1 && errno == EINTR);
+    }
+
+  return NULL;
+}
+
+int crypto_threads_init(void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  sigset_t sigs, old;
+  int i, started = 0;
+
+  if (pipe(job_pipe) == -1 || !fix_fd(job_pipe[0]))
+    return 0;
+
+  /* Signals are handled only by the main thread. */
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_SETMASK, &sigs, &old);
+  
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (i = 0; i < daemon->dnssec_threads; i++)
+    if (pthread_create(&thread, &attr, crypto_worker, NULL) == 0)
+      started++;
+
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  
+  if ((daemon->dnssec_threads = started) == 0)
+    {
+      close(job_pipe[0]);
+      close(job_pipe[1]);
+      job_pipe[0] = job_pipe[1] = -1;
+      return 0;
+    }
+  
+  return 1;
+}
+
+static int crypto_queue(verify_func_t *func, unsigned char *fp, unsigned char *key, unsigned int key_len,
+			unsigned char *sig, size_t sig_len, unsigned char *digest, size_t digest_len, int algo)
+{
+  struct crypto_job *job;
+
+#if MIN_VERSION(3, 1)
+  /* The EdDSA "digest" refers to a buffer which is reused, so take a copy
+     of the message and make a new struct null_hash_digest to point to it. */
+  if (algo == 15 || algo == 16)
+    {
+      struct null_hash_digest *nhd = (struct null_hash_digest *)digest;
+      
+      if (!(job = whine_malloc(sizeof(struct crypto_job) + key_len + sig_len + nhd->len)))
+	return 0;
+      
+      job->nhd.buff = job->data + key_len + sig_len;
+      job->nhd.len = nhd->len;
+      memcpy(job->nhd.buff, nhd->buff, nhd->len);
+      job->digest = (unsigned char *)&job->nhd;
+    }
+  else
+#endif
+    {
+      if (!(job = whine_malloc(sizeof(struct crypto_job) + key_len + sig_len + digest_len)))
+	return 0;
+
+      job->digest = job->data + key_len + sig_len;
+      memcpy(job->digest, digest, digest_len);
+    }
+
+  job->key = job->data;
+  job->sig = job->data + key_len;
+  memcpy(job->key, key, key_len);
+  memcpy(job->sig, sig, sig_len);
+  memcpy(job->fp, fp, SHA256_DIGEST_SIZE);
+  job->func = func;
+  job->owner = async_owner;
+  job->uid = async_uid;
+  job->algo = algo;
+  job->key_len = key_len;
+  job->sig_len = sig_len;
+  job->digest_len = digest_len;
+  job->next = NULL;
+  
+  pthread_mutex_lock(&job_lock);
+  if (job_tail)
+    job_tail->next = job;
+  else
+    job_head = job;
+  job_tail = job;
+  pthread_cond_signal(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+
+  async_jobs++;
+  daemon->metrics[METRIC_DNSSEC_CRYPTO_QUEUED]++;
+  
+  return 1;
+}
+
+void crypto_async_reply(time_t now)
+{
+  struct crypto_job *job;
+  
+  while (read(job_pipe[0], &job, sizeof(job)) == sizeof(job))
+    {
+      sig_cache_add(job->fp, job->result, 1);
+      dnssec_crypto_done(job->owner, job->uid, now);
+      free(job);
+    }
+}
+#endif
+
+void crypto_async_start(struct frec *owner, int uid)
+{
+#ifdef HAVE_DNSSEC_THREADS
+  /* Never in child processes, the worker threads exist only in the main process. */
+  if (job_pipe[0] != -1 && daemon->pipe_to_parent == -1)
+    {
+      async_owner = owner;
+      async_uid = uid;
+      async_jobs = 0;
+      async_hits = 0;
+    }
+#else
+  (void)owner;
+  (void)uid;
+#endif
+}
+
+/* Returns number of verifications queued since crypto_async_start().
+   While this is non-zero, results from dnssec_validate_*() are provisional. */
+int crypto_async_pending(void)
+{
+#ifdef HAVE_DNSSEC_THREADS
+  if (async_owner)
+    return async_jobs;
+#endif
+
+  return 0;
+}
+
+int crypto_async_end(void)
+{
+  int jobs = crypto_async_pending();
+  
+#ifdef HAVE_DNSSEC_THREADS
+  /* A provisional result is thrown away and the validation run again,
+     which counts the hits then. */
+  if (async_owner && jobs == 0)
+    daemon->metrics[METRIC_DNSSEC_SIG_CACHE_HITS] += async_hits;
+  async_owner = NULL;
+#endif
+  
+  return jobs;
+}
+
+int crypto_async_fd(void)
+{
+#ifdef HAVE_DNSSEC_THREADS
+  return job_pipe[0];
+#else
+  return -1;
+#endif
+}
+
 int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
 	   unsigned char *digest, size_t digest_len, int algo)
 {
-
-  int (*func)(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
-	      unsigned char *digest, size_t digest_len, int algo);
+  verify_func_t *func;
+  union dnskey *parsed = NULL;
+  unsigned char *key, fp[SHA256_DIGEST_SIZE];
+  int have_fp, result;
   
   func = verify_func(algo);
   
-  if (!func)
+  if (!func || key_len == 0 || !(key = blockdata_retrieve(key_data, key_len, NULL)))
     return 0;
 
-  return (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+  /* Same key, signature and data as something already verified? */
+  have_fp = sig_fingerprint(fp, algo, key, key_len, sig, sig_len, digest, digest_len);
+  if (have_fp && sig_cache_find(fp, &result))
+    return result;
+
+#ifdef HAVE_DNSSEC_THREADS
+  if (have_fp && async_owner &&
+      crypto_queue(func, fp, key, key_len, sig, sig_len, digest, digest_len, algo))
+    return 1;
+#endif
+  
+  if (key_needs_import(algo) && !(parsed = key_cache_find(key, key_len, algo)))
+    result = 0;
+  else
+    result = func(parsed, key, key_len, sig, sig_len, digest, digest_len, algo);
+
+  if (have_fp)
+    sig_cache_add(fp, result, 0);
+  
+  return result;
 }
 
 /* Note the ds_digest_name(), algo_digest_name() and nsec3_digest_name()
@@ -32,6 +32,8 @@ const char* introspection_xml_template =
 "  <interface name=\"%s\">\n"
 "    <method name=\"ClearCache\">\n"
 "    </method>\n"
+"    <method name=\"SaveCache\">\n"
+"    </method>\n"
 "    <method name=\"GetVersion\">\n"
 "      <arg name=\"version\" direction=\"out\" type=\"s\"/>\n"
 "    </method>\n"
@@ -100,8 +102,27 @@ const char* introspection_xml_template =
 "    <method name=\"GetServerMetrics\">\n"
 "      <arg name=\"metrics\" direction=\"out\" type=\"a{ss}\"/>\n"
 "    </method>\n"
+"    <method name=\"GetCacheShardMetrics\">\n"
+"      <arg name=\"metrics\" direction=\"out\" type=\"aa{ss}\"/>\n"
+"    </method>\n"
+#ifdef HAVE_HISTOGRAMS
+"    <method name=\"GetLatencyHistograms\">\n"
+"      <arg name=\"histograms\" direction=\"out\" type=\"aa{ss}\"/>\n"
+"    </method>\n"
+#endif
+"    <method name=\"GetLoopMetrics\">\n"
+"      <arg name=\"metrics\" direction=\"out\" type=\"aa{ss}\"/>\n"
+"    </method>\n"
+"    <method name=\"GetStalls\">\n"
+"      <arg name=\"stalls\" direction=\"out\" type=\"aa{ss}\"/>\n"
+"    </method>\n"
 "    <method name=\"ClearMetrics\">\n"
 "    </method>\n"
+#ifdef HAVE_DUMPFILE
+"    <method name=\"WriteCaptureRing\">\n"
+"      <arg name=\"packets\" direction=\"out\" type=\"u\"/>\n"
+"    </method>\n"
+#endif
 "  </interface>\n"
 "</node>\n";
 
@@ -700,6 +721,23 @@ static DBusMessage *dbus_del_lease(DBusMessage* message)
 }
 #endif
 
+#ifdef HAVE_DUMPFILE
+static DBusMessage *dbus_write_capture_ring(DBusMessage* message)
+{
+  DBusMessage *reply;
+  dbus_uint32_t count;
+  
+  if (daemon->dump_ring == 0 || daemon->dumpfd == -1)
+    return dbus_message_new_error(message, DBUS_ERROR_FAILED, "No capture ring, see --dumpring");
+  
+  count = dump_ring_write("DBus");
+  reply = dbus_message_new_method_return(message);
+  dbus_message_append_args(reply, DBUS_TYPE_UINT32, &count, DBUS_TYPE_INVALID);
+  
+  return reply;
+}
+#endif
+
 static DBusMessage *dbus_get_metrics(DBusMessage* message)
 {
   DBusMessage *reply = dbus_message_new_method_return(message);
@@ -795,6 +833,174 @@ static DBusMessage *dbus_get_server_metrics(DBusMessage* message)
   return reply;
 }
 
+static DBusMessage *dbus_get_cache_shard_metrics(DBusMessage* message)
+{
+  DBusMessage *reply = dbus_message_new_method_return(message);
+  DBusMessageIter shard_array, dict_array, shard_iter;
+  int i, size, live, probation;
+  
+  dbus_message_iter_init_append(reply, &shard_iter);
+  dbus_message_iter_open_container(&shard_iter, DBUS_TYPE_ARRAY, "a{ss}", &shard_array);
+
+  for (i = 0; cache_shard_stats(i, &size, &live, &probation); i++)
+    {
+      dbus_message_iter_open_container(&shard_array, DBUS_TYPE_ARRAY, "{ss}", &dict_array);
+      
+      add_dict_int(&dict_array, "shard", i);
+      add_dict_int(&dict_array, "size", size);
+      add_dict_int(&dict_array, "live", live);
+      add_dict_int(&dict_array, "probation", probation);
+      
+      dbus_message_iter_close_container(&shard_array, &dict_array);
+    }
+  
+  dbus_message_iter_close_container(&shard_iter, &shard_array);
+  
+  return reply;
+}
+
+static DBusMessage *dbus_get_loop_metrics(DBusMessage* message)
+{
+  DBusMessage *reply = dbus_message_new_method_return(message);
+  DBusMessageIter loop_array, dict_array, loop_iter;
+  char total[24];
+  int i;
+  
+  dbus_message_iter_init_append(reply, &loop_iter);
+  dbus_message_iter_open_container(&loop_iter, DBUS_TYPE_ARRAY, "a{ss}", &loop_array);
+
+  for (i = 0; i < __LOOP_MAX; i++)
+    {
+      struct loop_time *t = &daemon->loop_time[i];
+
+      dbus_message_iter_open_container(&loop_array, DBUS_TYPE_ARRAY, "{ss}", &dict_array);
+      
+      add_dict_entry(&dict_array, "subsystem", get_loop_name(i));
+      add_dict_int(&dict_array, "calls", t->count);
+      sprintf(total, "%llu", t->sum);
+      add_dict_entry(&dict_array, "total", total);
+      add_dict_int(&dict_array, "max", t->max);
+      
+      dbus_message_iter_close_container(&loop_array, &dict_array);
+    }
+  
+  dbus_message_iter_close_container(&loop_iter, &loop_array);
+  
+  return reply;
+}
+
+static DBusMessage *dbus_get_stalls(DBusMessage* message)
+{
+  DBusMessage *reply = dbus_message_new_method_return(message);
+  DBusMessageIter stall_array, dict_array, stall_iter;
+  struct stall *s;
+  
+  dbus_message_iter_init_append(reply, &stall_iter);
+  dbus_message_iter_open_container(&stall_iter, DBUS_TYPE_ARRAY, "a{ss}", &stall_array);
+
+  for (s = daemon->stalls; s < daemon->stalls + STALL_RECORDS; s++)
+    if (s->usec != 0)
+      {
+	dbus_message_iter_open_container(&stall_array, DBUS_TYPE_ARRAY, "{ss}", &dict_array);
+	
+	add_dict_int(&dict_array, "time", (unsigned int)s->when);
+	add_dict_int(&dict_array, "duration", s->usec);
+	add_dict_entry(&dict_array, "subsystem", s->subsystem == -1 ? "other" : get_loop_name(s->subsystem));
+	add_dict_int(&dict_array, "subsystem_time", s->subsystem_usec);
+	if (s->site)
+	  {
+	    add_dict_entry(&dict_array, "site", s->site);
+	    add_dict_int(&dict_array, "site_time", s->site_usec);
+	  }
+	
+	dbus_message_iter_close_container(&stall_array, &dict_array);
+      }
+  
+  dbus_message_iter_close_container(&stall_iter, &stall_array);
+  
+  return reply;
+}
+
+#ifdef HAVE_HISTOGRAMS
+static void add_dict_histogram(DBusMessageIter *container, struct histogram *h)
+{
+  char buckets[HIST_BUCKETS * 24], *p = buckets;
+  int i;
+  
+  add_dict_int(container, "count", h->count);
+  add_dict_int(container, "mean", h->count ? (unsigned int)(h->sum / h->count) : 0);
+  add_dict_int(container, "p50", hist_percentile(h, 50));
+  add_dict_int(container, "p90", hist_percentile(h, 90));
+  add_dict_int(container, "p99", hist_percentile(h, 99));
+  add_dict_int(container, "max", h->max);
+
+  /* Non-empty buckets as "limit:count", limit is the smallest time too
+     big for the bucket. The last bucket has no limit. */
+  *p = 0;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if (h->bucket[i] != 0)
+      {
+	if (i == HIST_BUCKETS - 1)
+	  p += sprintf(p, "%sinf:%u", p == buckets ? "" : " ", h->bucket[i]);
+	else
+	  p += sprintf(p, "%s%u:%u", p == buckets ? "" : " ", hist_bucket_limit(i), h->bucket[i]);
+      }
+  
+  add_dict_entry(container, "buckets", buckets);
+}
+
+static DBusMessage *dbus_get_latency_histograms(DBusMessage* message)
+{
+  DBusMessage *reply = dbus_message_new_method_return(message);
+  DBusMessageIter hist_array, dict_array, hist_iter;
+  struct server *serv, *serv1;
+  int i;
+  
+  dbus_message_iter_init_append(reply, &hist_iter);
+  dbus_message_iter_open_container(&hist_iter, DBUS_TYPE_ARRAY, "a{ss}", &hist_array);
+
+  for (i = 0; i < __HIST_MAX; i++)
+    {
+      dbus_message_iter_open_container(&hist_array, DBUS_TYPE_ARRAY, "{ss}", &dict_array);
+      add_dict_entry(&dict_array, "answers", get_histogram_name(i));
+      add_dict_histogram(&dict_array, &daemon->latency[i]);
+      dbus_message_iter_close_container(&hist_array, &dict_array);
+    }
+
+  /* Round trip times, summed over records for the same server. */
+  for (serv = daemon->servers; serv; serv = serv->next)
+    serv->flags &= ~SERV_MARK;
+  
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (!(serv->flags & SERV_MARK))
+      {
+	struct histogram rtt;
+	unsigned int port;
+
+	memset(&rtt, 0, sizeof(rtt));
+	
+	for (serv1 = serv; serv1; serv1 = serv1->next)
+	  if (!(serv1->flags & SERV_MARK) && sockaddr_isequal(&serv->addr, &serv1->addr))
+	    {
+	      serv1->flags |= SERV_MARK;
+	      if (serv1->rtt)
+		hist_merge(&rtt, serv1->rtt);
+	    }
+
+	dbus_message_iter_open_container(&hist_array, DBUS_TYPE_ARRAY, "{ss}", &dict_array);
+	port = prettyprint_addr(&serv->addr, daemon->namebuff);
+	add_dict_entry(&dict_array, "server", daemon->namebuff);
+	add_dict_int(&dict_array, "port", port);
+	add_dict_histogram(&dict_array, &rtt);
+	dbus_message_iter_close_container(&hist_array, &dict_array);
+      }
+  
+  dbus_message_iter_close_container(&hist_iter, &hist_array);
+  
+  return reply;
+}
+#endif
+
 DBusHandlerResult message_handler(DBusConnection *connection, 
 				  DBusMessage *message, 
 				  void *user_data)
@@ -910,12 +1116,38 @@ DBusHandlerResult message_handler(DBusConnection *connection,
     {
       reply = dbus_get_server_metrics(message);
     }
+  else if (strcmp(method, "GetCacheShardMetrics") == 0)
+    {
+      reply = dbus_get_cache_shard_metrics(message);
+    }
+#ifdef HAVE_HISTOGRAMS
+  else if (strcmp(method, "GetLatencyHistograms") == 0)
+    {
+      reply = dbus_get_latency_histograms(message);
+    }
+#endif
+  else if (strcmp(method, "GetLoopMetrics") == 0)
+    {
+      reply = dbus_get_loop_metrics(message);
+    }
+  else if (strcmp(method, "GetStalls") == 0)
+    {
+      reply = dbus_get_stalls(message);
+    }
   else if (strcmp(method, "ClearMetrics") == 0)
     {
       clear_metrics();
     }
+#ifdef HAVE_DUMPFILE
+  else if (strcmp(method, "WriteCaptureRing") == 0)
+    {
+      reply = dbus_write_capture_ring(message);
+    }
+#endif
   else if (strcmp(method, "ClearCache") == 0)
     clear_cache = 1;
+  else if (strcmp(method, "SaveCache") == 0)
+    cache_snapshot_save(dnsmasq_time());
   else
     return (DBUS_HANDLER_RESULT_NOT_YET_HANDLED);
    
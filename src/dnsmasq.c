@@ -432,6 +432,9 @@ int main (int argc, char **argv)
 	daemon->tcp_pipes[i] = -1;
     }
 
+  if (daemon->dump_ring != 0 && !daemon->dump_file)
+    die(_("--dumpring needs --dumpfile"), NULL, EC_BADCONF);
+  
   if (daemon->dump_file)
 #ifdef HAVE_DUMPFILE
     dump_init();
@@ -440,6 +443,20 @@ int main (int argc, char **argv)
 #else
   die(_("Packet dumps not available: set HAVE_DUMP in src/config.h"), NULL, EC_BADCONF);
 #endif
+
+  if (daemon->dnstap)
+#ifdef HAVE_DNSTAP
+    dnstap_init();
+#else
+  die(_("dnstap not available: set HAVE_DNSTAP in src/config.h"), NULL, EC_BADCONF);
+#endif
+
+  if (daemon->metrics_path || daemon->metrics_addr.sa.sa_family != 0)
+#ifdef HAVE_OPENMETRICS
+    openmetrics_init();
+#else
+  die(_("metrics server not available: set HAVE_OPENMETRICS in src/config.h"), NULL, EC_BADCONF);
+#endif
   
   if (option_bool(OPT_DBUS))
 #ifdef HAVE_DBUS
@@ -940,6 +957,16 @@ int main (int argc, char **argv)
       if (rc == 1)
 	my_syslog(LOG_INFO, _("DNSSEC signature timestamps not checked until system time valid"));
 
+#ifdef HAVE_DNSSEC_THREADS
+      if (daemon->dnssec_threads != 0)
+	{
+	  if (crypto_threads_init())
+	    my_syslog(LOG_INFO, _("DNSSEC signature verification using %d threads"), daemon->dnssec_threads);
+	  else
+	    my_syslog(LOG_WARNING, _("failed to start DNSSEC signature verification threads"));
+	}
+#endif
+
       for (ds = daemon->ds; ds; ds = ds->next)
 	{
 	  struct ds_config *ds1;
@@ -1105,6 +1132,17 @@ int main (int argc, char **argv)
   while (1)
     {
       int timeout = fast_retry(now);
+      int warmup = warmup_run(now);
+      u32 mark;
+#ifdef HAVE_DUMPFILE
+      int dump = dump_flush_timer();
+
+      if (dump != -1 && (timeout == -1 || timeout > dump))
+	timeout = dump;
+#endif
+      
+      if (warmup != -1 && (timeout == -1 || timeout > warmup))
+	timeout = warmup;
       
       poll_reset();
       
@@ -1211,6 +1249,20 @@ int main (int argc, char **argv)
 #endif
 
    
+#ifdef HAVE_DNSTAP
+      set_dnstap_listeners(now);
+#endif
+
+#ifdef HAVE_OPENMETRICS
+      /* Wake every second whilst serving metrics, to time out stalled connections. */
+      if (set_openmetrics_listeners() && (timeout == -1 || timeout > 1000))
+	timeout = 1000;
+#endif
+
+      /* Everything since poll() returned, including the timers
+	 and listener setup above. It may log, so before set_log_writer(). */
+      loop_end(now);
+
       /* must do this just before do_poll(), when we know no
 	 more calls to my_syslog() can occur */
       set_log_writer();
@@ -1219,9 +1271,22 @@ int main (int argc, char **argv)
 	continue;
       
       now = dnsmasq_time();
+      loop_start();
 
+      mark = dnsmasq_microseconds();
       check_log_writer(0);
+      loop_account(LOOP_LOG, mark);
+
+#ifdef HAVE_DNSTAP
+      check_dnstap_listeners();
+#endif
 
+#ifdef HAVE_OPENMETRICS
+      check_openmetrics_listeners(now);
+#endif
+
+      cache_expire(now);
+      
       /* prime. */
       enumerate_interfaces(1);
 
@@ -1244,10 +1309,12 @@ int main (int argc, char **argv)
 #endif
 
 #ifdef HAVE_INOTIFY
-      if  (daemon->inotifyfd != -1 && poll_check(daemon->inotifyfd, POLLIN) && inotify_check(now))
+      if  (daemon->inotifyfd != -1 && poll_check(daemon->inotifyfd, POLLIN))
 	{
-	  if (daemon->port != 0 && !option_bool(OPT_NO_POLL))
+	  mark = dnsmasq_microseconds();
+	  if (inotify_check(now) && daemon->port != 0 && !option_bool(OPT_NO_POLL))
 	    poll_resolv(1, 1, now);
+	  loop_account(LOOP_INOTIFY, mark);
 	} 	  
 #else
       /* Check for changes to resolv files once per second max. */
@@ -1265,7 +1332,11 @@ int main (int argc, char **argv)
 #endif
 
       if (poll_check(piperead, POLLIN))
-	async_event(piperead, now);
+	{
+	  mark = dnsmasq_microseconds();
+	  async_event(piperead, now);
+	  loop_account(LOOP_EVENT, mark);
+	}
       
 #ifdef HAVE_DBUS
       /* if we didn't create a DBus connection, retry now. */ 
@@ -1310,32 +1381,58 @@ int main (int argc, char **argv)
 #endif
       
       if (daemon->port != 0)
-	check_dns_listeners(now);
+	{
+	  mark = dnsmasq_microseconds();
+	  check_dns_listeners(now);
+	  loop_account(LOOP_DNS, mark);
+	}
 
 #ifdef HAVE_TFTP
+      mark = dnsmasq_microseconds();
       check_tftp_listeners(now);
+      loop_account(LOOP_TFTP, mark);
 #endif      
 
 #ifdef HAVE_DHCP
       if (daemon->dhcp || daemon->relay4)
 	{
 	  if (poll_check(daemon->dhcpfd, POLLIN))
-	    dhcp_packet(now, 0);
+	    {
+	      mark = dnsmasq_microseconds();
+	      dhcp_packet(now, 0);
+	      loop_account(LOOP_DHCP, mark);
+	    }
 	  if (daemon->pxefd != -1 && poll_check(daemon->pxefd, POLLIN))
-	    dhcp_packet(now, 1);
+	    {
+	      mark = dnsmasq_microseconds();
+	      dhcp_packet(now, 1);
+	      loop_account(LOOP_DHCP, mark);
+	    }
 	}
 
 #ifdef HAVE_DHCP6
       if ((daemon->doing_dhcp6 || daemon->relay6) && poll_check(daemon->dhcp6fd, POLLIN))
-	dhcp6_packet(now);
+	{
+	  mark = dnsmasq_microseconds();
+	  dhcp6_packet(now);
+	  loop_account(LOOP_DHCP6, mark);
+	}
 
       if (daemon->doing_ra && poll_check(daemon->icmp6fd, POLLIN))
-	icmp6_packet(now);
+	{
+	  mark = dnsmasq_microseconds();
+	  icmp6_packet(now);
+	  loop_account(LOOP_RA, mark);
+	}
 #endif
 
 #  ifdef HAVE_SCRIPT
       if (daemon->helperfd != -1 && poll_check(daemon->helperfd, POLLOUT))
-	helper_write();
+	{
+	  mark = dnsmasq_microseconds();
+	  helper_write();
+	  loop_account(LOOP_HELPER, mark);
+	}
 #  endif
 #endif
 
@@ -1578,6 +1675,12 @@ static void async_event(int pipe, time_t now)
 	
       case EVENT_INIT:
 	clear_cache_and_reload(now);
+
+	if (ev.event == EVENT_INIT && daemon->port != 0)
+	  {
+	    cache_snapshot_load(now);
+	    warmup_init();
+	  }
 	
 	if (daemon->port != 0)
 	  {
@@ -1605,6 +1708,9 @@ static void async_event(int pipe, time_t now)
       case EVENT_DUMP:
 	if (daemon->port != 0)
 	  dump_cache(now);
+#ifdef HAVE_DUMPFILE
+	dump_ring_write("SIGUSR1");
+#endif
 	break;
 	
       case EVENT_ALARM:
@@ -1736,6 +1842,9 @@ static void async_event(int pipe, time_t now)
 	if (daemon->lease_stream)
 	  fclose(daemon->lease_stream);
 
+	if (daemon->port != 0)
+	  cache_snapshot_save(now);
+	
 #ifdef HAVE_DNSSEC
 	/* update timestamp file on TERM if time is considered valid */
 	if (daemon->back_to_the_future)
@@ -1750,7 +1859,14 @@ static void async_event(int pipe, time_t now)
 
 #ifdef HAVE_DUMPFILE
 	if (daemon->dumpfd != -1)
-	  close(daemon->dumpfd);
+	  {
+	    dump_flush();
+	    close(daemon->dumpfd);
+	  }
+#endif
+
+#ifdef HAVE_DNSTAP
+	dnstap_close();
 #endif
 	
 	my_syslog(LOG_INFO, _("exiting on receipt of SIGTERM"));
@@ -1837,6 +1953,8 @@ static void poll_resolv(int force, int do_reload, time_t now)
 
 void clear_cache_and_reload(time_t now)
 {
+  u32 started = dnsmasq_microseconds();
+
   (void)now;
 
   if (daemon->port != 0)
@@ -1860,6 +1978,8 @@ void clear_cache_and_reload(time_t now)
     send_alarm(periodic_ra(now), now);
 #endif
 #endif
+
+  stall_site("reload", started);
 }
 
 #ifdef HAVE_TFTP
@@ -1923,6 +2043,11 @@ static void set_dns_listeners(void)
     for (i = 0; i < daemon->max_procs; i++)
       if (daemon->tcp_pipes[i] != -1)
 	poll_listen(daemon->tcp_pipes[i], POLLIN);
+
+#ifdef HAVE_DNSSEC_THREADS
+  if (crypto_async_fd() != -1)
+    poll_listen(crypto_async_fd(), POLLIN);
+#endif
 }
 
 static void check_dns_listeners(time_t now)
@@ -1960,6 +2085,15 @@ static void check_dns_listeners(time_t now)
 	  return;
 	}
 
+#ifdef HAVE_DNSSEC_THREADS
+  /* Results from DNSSEC crypto worker threads. */
+  if (crypto_async_fd() != -1 && poll_check(crypto_async_fd(), POLLIN))
+    {
+      crypto_async_reply(now);
+      return;
+    }
+#endif
+
   for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
     if (poll_check(serverfdp->fd, POLLIN))
       {
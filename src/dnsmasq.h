@@ -105,6 +105,7 @@ typedef unsigned long long u64;
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 #include <limits.h>
 #include <net/if.h>
 #if defined(HAVE_SOLARIS_NETWORK) && !defined(ifr_mtu)
@@ -296,7 +297,8 @@ struct event_desc {
 #define OPT_LEASEQUERY     77
 #define OPT_LOG_ONLY_FAILED  78
 #define OPT_LOG_MALLOC     79
-#define OPT_LAST           80
+#define OPT_DUMP_PCAPNG    80
+#define OPT_LAST           81
 
 #define OPTION_BITS (sizeof(unsigned int)*8)
 #define OPTION_SIZE ( (OPT_LAST/OPTION_BITS)+((OPT_LAST%OPTION_BITS)!=0) )
@@ -395,6 +397,12 @@ struct naptr {
 #define TXT_STAT_HITS          5
 #define TXT_STAT_AUTH          6
 #define TXT_STAT_SERVERS       7
+#define TXT_STAT_HITRATIO      8
+#define TXT_STAT_SHARDS        9
+
+/* --cache-policy */
+#define CACHE_POLICY_LRU       0
+#define CACHE_POLICY_2Q        1
 #endif
 
 struct txt_record {
@@ -497,11 +505,16 @@ struct blockdata {
 
 struct crec { 
   struct crec *next, *prev, *hash_next;
+  struct crec *type_next, **type_pprev; /* per-type index, NULL type_pprev if not in it. */
   union all_addr addr;
   time_t ttd; /* time to die */
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid; 
   unsigned int flags;
+  unsigned int expire_idx; /* position in expiry heap plus one, zero if not there. */
+  unsigned int name_hash; /* hostname_hash() of name, valid whilst in the hash table. */
+  unsigned char probation; /* for --cache-policy=2q */
+  unsigned short shard; /* cache shard which owns this entry */
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -557,6 +570,10 @@ struct crec {
 #define PIPE_OP_IPSET   4  /* Update IPset */
 #define PIPE_OP_NFTSET  5  /* Update NFTset */
 #define PIPE_OP_KILLED  6  /* child killed by SIGALARM */
+#define PIPE_OP_DNSTAP  7  /* dnstap frame for the main process to write */
+#define PIPE_OP_LATENCY 8  /* Answer time for the parent's histograms */
+
+#define PIPE_INSERT_VERSION 1 /* format of PIPE_OP_INSERT messages */
 
 /* struct sockaddr is not large enough to hold any address,
    and specifically not big enough to hold an IPv6 address.
@@ -611,6 +628,36 @@ struct randfd_list {
   struct randfd_list *next;
 };
 
+#ifdef HAVE_HISTOGRAMS
+/* Times in microseconds, counted in log-linear buckets: HIST_SUB buckets
+   for each power of two, so a bucket is never wider than a quarter of
+   the values in it. */
+#define HIST_SUB_BITS 2
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+
+struct histogram {
+  u32 count, max;
+  u64 sum;
+  u32 bucket[HIST_BUCKETS];
+};
+#endif
+
+/* Time spent in one subsystem called from the main loop. */
+struct loop_time {
+  u32 count, max;
+  u64 sum;
+};
+
+/* A main loop iteration which took longer than --stall-budget. Times
+   are in microseconds. subsystem is the LOOP_* which took most of it,
+   or -1, and site the slowest known operation in it, or NULL. */
+struct stall {
+  time_t when;
+  u32 usec, subsystem_usec, site_usec;
+  int subsystem;
+  const char *site;
+};
+
 
 struct server {
   u16 flags, domain_len;
@@ -627,6 +674,9 @@ struct server {
   unsigned int query_latency, mma_latency;
   time_t forwardtime;
   int forwardcount;
+#ifdef HAVE_HISTOGRAMS
+  struct histogram *rtt; /* allocated on first reply */
+#endif
 #ifdef HAVE_LOOP
   u32 uid;
 #endif
@@ -761,6 +811,10 @@ struct dyndir {
 #define DUMP_RA            0x4000
 #define DUMP_TFTP          0x8000
 
+/* dnstap_packet() flags */
+#define TAP_TCP            1
+#define TAP_CACHED         2 /* answered without forwarding */
+
 /* DNSSEC status values. */
 #define STAT_SECURE             0x10000
 #define STAT_INSECURE           0x20000
@@ -798,6 +852,16 @@ struct dyndir {
 #define FREC_HAS_PHEADER      128
 #define FREC_GONE_TO_TCP      256
 #define FREC_ANSWER           512
+#define FREC_CRYPTO_WAIT     1024
+#define FREC_CRYPTO_RERUN    2048
+#define FREC_INTERNAL        4096
+
+/* EDNS0 client subnet option, RFC 7871 */
+struct subnet_opt {
+  u16 family;
+  u8 source_netmask, scope_netmask; 
+  u8 addr[IN6ADDRSZ];
+};
 
 struct frec {
   struct frec_src {
@@ -806,6 +870,12 @@ struct frec {
     unsigned int iface, log_id, encode_bitmap, *encode_bigmap;
     int fd;
     unsigned short orig_id, udp_pkt_size;
+#ifdef HAVE_HISTOGRAMS
+    u32 arrived; /* dnsmasq_microseconds() when the query came in */
+#endif
+#ifdef HAVE_DNSTAP
+    u32 tap_arrived; /* dnsmasq_milliseconds() when the query came in */
+#endif
     struct frec_src *next;
   } frec_src;
   struct server *sentto; /* NULL means free */
@@ -814,11 +884,16 @@ struct frec {
   int forwardall, flags;
   time_t time;
   u32 forward_timestamp;
+#ifdef HAVE_HISTOGRAMS
+  u32 forward_sent; /* as forward_timestamp, in microseconds */
+#endif
   int forward_delay;
   struct blockdata *stash; /* saved query or saved reply, whilst we validate */
   size_t stash_len;
+  struct subnet_opt subnet; /* client subnet sent, for --subnet-cache. family zero if none */
 #ifdef HAVE_DNSSEC 
-  int uid, class, work_counter, validate_counter;
+  int uid, class, work_counter, validate_counter, crypto_pending;
+  unsigned int key_hash; /* hash of name, type and class for DNSKEY and DS queries. */
   struct frec *dependent; /* Query awaiting internally-generated DNSKEY or DS query */
   struct frec *next_dependent; /* list of above. */
   struct frec *blocking_query; /* Query which is blocking us. */
@@ -1215,7 +1290,8 @@ extern struct daemon {
   int max_logs;  /* queue limit */
   int log_malloc; /* log malloc/realloc/free */
   int randport_limit; /* Maximum number of source ports for query. */
-  int cachesize, ftabsize;
+  int cachesize, ftabsize, answer_cache_size, cache_policy, subnet_cache_size, subnet_cache_scopes;
+  int shared_cache_size, cache_shards;
   int port, query_port, min_port, max_port;
   unsigned long local_ttl, neg_ttl, max_ttl, min_cache_ttl, max_cache_ttl, auth_ttl, dhcp_ttl, use_dhcp_ttl;
   char *dns_client_id;
@@ -1258,11 +1334,23 @@ extern struct daemon {
   char *dbus_name;
   char *ubus_name;
   char *dump_file;
-  int dump_mask;
+  int dump_mask, dump_ring;
+  char *dnstap;
+  char *metrics_path;
+  union mysockaddr metrics_addr;
   unsigned long soa_sn, soa_refresh, soa_retry, soa_expiry;
   u32 metrics[__METRIC_MAX];
+#ifdef HAVE_HISTOGRAMS
+  struct histogram latency[__HIST_MAX];
+#endif
+  struct loop_time loop_time[__LOOP_MAX];
+  struct stall stalls[STALL_RECORDS];
+  int stall_budget;
   int fast_retry_time, fast_retry_timeout;
   int cache_max_expiry;
+  char *cache_snapshot;
+  char *cache_warmup;
+  int cache_warmup_rate;
 #ifdef HAVE_DNSSEC
   struct ds_config *ds;
   char *timestamp_file;
@@ -1280,6 +1368,7 @@ extern struct daemon {
   int dnssec_no_time_check;
   int back_to_the_future;
   int limit[LIMIT_MAX];
+  int dnssec_threads;
   struct frec *forward_to_tcp;
   struct dns_header *header_to_tcp;
   ssize_t plen_to_tcp;
@@ -1395,6 +1484,20 @@ void cache_reload(void);
 void cache_add_dhcp_entry(char *host_name, int prot, union all_addr *host_address, time_t ttd);
 struct in_addr a_record_from_hosts(char *name, time_t now);
 void cache_unhash_dhcp(void);
+void cache_expire(time_t now);
+size_t answer_cache_find(struct dns_header *header, size_t qlen, int do_bit, unsigned short udp_size);
+void answer_cache_end(struct dns_header *header, size_t len);
+void answer_cache_volatile(void);
+void answer_cache_flush(void);
+size_t subnet_cache_find(struct dns_header *header, size_t qlen, struct subnet_opt *subnet,
+			 unsigned int fwd_flags, unsigned short udp_size, time_t now);
+void subnet_cache_insert(struct dns_header *header, size_t len, struct subnet_opt *subnet,
+			 unsigned int fwd_flags, time_t now);
+void subnet_cache_flush(void);
+void cache_shared_import(time_t now);
+int cache_shard_stats(int n, int *size, int *live, int *probation);
+void cache_snapshot_save(time_t now);
+void cache_snapshot_load(time_t now);
 void dump_cache(time_t now);
 #ifndef NO_ID
 int cache_make_stat(struct txt_record *t);
@@ -1412,8 +1515,6 @@ struct blockdata *blockdata_alloc(char *data, size_t len);
 int blockdata_expand(struct blockdata *block, size_t oldlen,
 		     char *data, size_t newlen);
 void *blockdata_retrieve(struct blockdata *block, size_t len, void *data);
-struct blockdata *blockdata_read(int fd, size_t len);
-void blockdata_write(struct blockdata *block, size_t len, int fd);
 void blockdata_free(struct blockdata *blocks);
 
 /* domain.c */
@@ -1424,6 +1525,7 @@ int is_rev_synth(int flag, union all_addr *addr, char *name);
 
 /* rfc1035.c */
 int do_doctor(struct dns_header *header, size_t qlen, char *namebuff);
+unsigned long age_reply(struct dns_header *header, size_t qlen, unsigned long age);
 int extract_name(struct dns_header *header, size_t plen, unsigned char **pp, 
                  char *name, int func, unsigned int parm);
 unsigned char *skip_name(unsigned char *ansp, struct dns_header *header, size_t plen, int extrabytes);
@@ -1480,6 +1582,8 @@ int dnskey_keytag(int alg, int flags, unsigned char *key, int keylen);
 size_t filter_rrsigs(struct dns_header *header, size_t plen);
 int setup_timestamp(void);
 int errflags_to_ede(int status);
+int sort_rrset(struct dns_header *header, size_t plen, short *rr_desc, int rrsetidx, 
+	       unsigned char **rrset, char *buff);
 #endif
 
 /* crypto.c */
@@ -1491,6 +1595,14 @@ char *ds_digest_name(int digest);
 char *algo_digest_name(int algo);
 char *nsec3_digest_name(int digest);
 void nettle_digest_wrapper(const struct nettle_hash *hash, void *ctx, size_t length, uint8_t *dst);
+void crypto_async_start(struct frec *owner, int uid);
+int crypto_async_pending(void);
+int crypto_async_end(void);
+int crypto_async_fd(void);
+#ifdef HAVE_DNSSEC_THREADS
+int crypto_threads_init(void);
+void crypto_async_reply(time_t now);
+#endif
 
 /* util.c */
 void rand_init(void);
@@ -1522,9 +1634,11 @@ int sockaddr_isequal(const union mysockaddr *s1, const union mysockaddr *s2);
 int sockaddr_isnull(const union mysockaddr *s);
 int hostname_order(const char *a, const char *b);
 int hostname_isequal(const char *a, const char *b);
+unsigned int hostname_hash(const char *name);
 int hostname_issubdomain(char *a, char *b);
 time_t dnsmasq_time(void);
 u32 dnsmasq_milliseconds(void);
+u32 dnsmasq_microseconds(void);
 int netmask_length(struct in_addr mask);
 int is_same_net(struct in_addr a, struct in_addr b, struct in_addr mask);
 int is_same_net_prefix(struct in_addr a, struct in_addr b, int prefix);
@@ -1579,6 +1693,7 @@ void receive_query(struct listener *listen, time_t now);
 void return_reply(time_t now, struct frec *forward, struct dns_header *header, ssize_t n, int status);
 #ifdef HAVE_DNSSEC
 void pop_and_retry_query(struct frec *forward, int status, time_t now);
+void dnssec_crypto_done(struct frec *forward, int uid, time_t now);
 int tcp_from_udp(time_t now, int status, struct dns_header *header, ssize_t *n, 
 		 int class, char *name, struct server *server, 
 		 int *keycount, int *validatecount);
@@ -1593,6 +1708,7 @@ void resend_query(void);
 int allocate_rfd(struct randfd_list **fdlp, struct server *serv);
 void free_rfds(struct randfd_list **fdlp);
 int fast_retry(time_t now);
+int forward_internal_query(struct dns_header *header, size_t plen, time_t now, int limit, char *source);
 
 /* network.c */
 int indextoname(int fd, int index, char *name);
@@ -1913,6 +2029,11 @@ void loop_send_probes(void);
 int detect_loop(char *query, int type);
 #endif
 
+/* warmup.c */
+void warmup_init(void);
+int warmup_run(time_t now);
+void warmup_report(void);
+
 /* inotify.c */
 #ifdef HAVE_INOTIFY
 void inotify_dnsmasq_init(int errfd);
@@ -1944,8 +2065,9 @@ size_t add_pseudoheader(struct dns_header *header, size_t plen, size_t out_size,
 size_t add_do_bit(struct dns_header *header, size_t plen, size_t outlen);
 void edns0_needs_mac(union mysockaddr *addr, time_t now);
 size_t add_edns0_config(struct dns_header *header, size_t plen, size_t outlen, 
-			union mysockaddr *source, time_t now, int *cacheable);
+			union mysockaddr *source, time_t now, int *cacheable, struct subnet_opt *subnet);
 int check_source(struct dns_header *header, size_t plen, unsigned char *pseudoheader, union mysockaddr *peer);
+unsigned char *get_subnet_opt(struct dns_header *header, size_t plen, struct subnet_opt *opt);
 
 /* arp.c */
 int find_mac(union mysockaddr *addr, unsigned char *mac, int lazy, time_t now);
@@ -1954,12 +2076,54 @@ int do_arp_script_run(void);
 /* dump.c */
 #ifdef HAVE_DUMPFILE
 void dump_init(void);
+int dump_flush(void);
+int dump_flush_timer(void);
+void dump_forget_fd(int fd);
+unsigned int dump_ring_write(char *reason);
 void dump_packet_udp(int mask, void *packet, size_t len, union mysockaddr *src,
 		     union mysockaddr *dst, int fd);
 void dump_packet_icmp(int mask, void *packet, size_t len, union mysockaddr *src,
 		      union mysockaddr *dst);
 #endif
 
+/* dnstap.c */
+#ifdef HAVE_DNSTAP
+void dnstap_init(void);
+void dnstap_packet(int mask, void *packet, size_t len, union mysockaddr *src,
+		   union mysockaddr *dst, int flags, u32 started, int ede);
+void dnstap_frame(unsigned char *frame, size_t len);
+int dnstap_recv_frame(int fd);
+void set_dnstap_listeners(time_t now);
+void check_dnstap_listeners(void);
+void dnstap_close(void);
+#endif
+
+/* openmetrics.c */
+#ifdef HAVE_OPENMETRICS
+void openmetrics_init(void);
+int set_openmetrics_listeners(void);
+void check_openmetrics_listeners(time_t now);
+#endif
+
+/* metrics.c */
+#ifdef HAVE_HISTOGRAMS
+const char *get_histogram_name(int i);
+void hist_add(struct histogram *h, u32 usec);
+void hist_merge(struct histogram *dst, struct histogram *src);
+u32 hist_bucket_limit(int bucket);
+u32 hist_percentile(struct histogram *h, unsigned int percent);
+void record_latency(int which, u32 started);
+void record_server_rtt(struct server *serv, u32 started);
+int latency_recv(int fd);
+void latency_report(void);
+#endif
+const char *get_loop_name(int i);
+void loop_start(void);
+void loop_account(int which, u32 started);
+void stall_site(const char *site, u32 started);
+void loop_end(time_t now);
+void loop_report(time_t now);
+
 /* domain-match.c */
 void build_server_array(void);
 int lookup_domain(char *qdomain, int flags, int *lowout, int *highout);
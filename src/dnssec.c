@@ -221,102 +221,154 @@ static int get_rdata(struct dns_header *header, size_t plen, struct rdata_state
     }
 }
 
-/* Bubble sort the RRset into the canonical order. */
+/* Canonical form of the RDATA of each member of the RRset, in the
+   same order as rrset[] once sort_rrset() has run.
+   For RR types with no names in the RDATA, canonicalisation is the
+   identity, so rdata points into the packet, otherwise into canon_buff. */
+struct rr_canon {
+  unsigned char *rr, *rdata;
+  size_t offset;
+  int rdlen;
+};
+
+static struct rr_canon *canon = NULL, *canon_tmp = NULL;
+static unsigned char *canon_buff = NULL;
+static int canon_sz = 0;
+static size_t canon_buff_sz = 0;
+
+static int canon_cmp(struct rr_canon *a, struct rr_canon *b)
+{
+  int rdmin = a->rdlen > b->rdlen ? b->rdlen : a->rdlen;
+  int cmp = memcmp(a->rdata, b->rdata, rdmin);
+
+  if (cmp != 0)
+    return cmp;
+
+  /* A prefix of another RR sorts first. */
+  return a->rdlen - b->rdlen;
+}
 
-static int sort_rrset(struct dns_header *header, size_t plen, short *rr_desc, int rrsetidx, 
-		      unsigned char **rrset, char *buff1, char *buff2)
+static void canon_merge_sort(struct rr_canon *a, struct rr_canon *tmp, int n)
 {
-  int swap, i, j;
+  int i, j, k, mid = n/2;
+
+  if (n < 2)
+    return;
+
+  canon_merge_sort(a, tmp, mid);
+  canon_merge_sort(a + mid, tmp, n - mid);
+
+  /* Already in order, very common since most servers send canonical order anyway. */
+  if (canon_cmp(&a[mid-1], &a[mid]) <= 0)
+    return;
   
-  do
+  for (i = 0, j = mid, k = 0; i < mid && j < n; k++)
+    tmp[k] = canon_cmp(&a[j], &a[i]) < 0 ? a[j++] : a[i++];
+  
+  while (i < mid)
+    tmp[k++] = a[i++];
+
+  /* Any remaining a[j..n) are already in place. */
+  memcpy(a, tmp, k * sizeof(struct rr_canon));
+}
+
+/* Extract the canonical RDATA of each RR once, then merge sort the RRset
+   into the canonical order and remove duplicates. Returns the new
+   number of RRs in the set, or -1 on a bad packet or memory failure. */
+int sort_rrset(struct dns_header *header, size_t plen, short *rr_desc, int rrsetidx, 
+	       unsigned char **rrset, char *buff)
+{
+  int i, j, rdlen;
+  size_t used = 0;
+
+  if (rrsetidx > canon_sz)
+    {
+      struct rr_canon *new, *new_tmp;
+      int new_sz = rrsetidx + 5;
+
+      if (!(new = whine_realloc(canon, new_sz * sizeof(struct rr_canon))))
+	return -1;
+      canon = new;
+      
+      if (!(new_tmp = whine_realloc(canon_tmp, new_sz * sizeof(struct rr_canon))))
+	return -1;
+      canon_tmp = new_tmp;
+
+      canon_sz = new_sz;
+    }
+  
+  for (i = 0; i < rrsetidx; i++)
     {
-      for (swap = 0, i = 0; i < rrsetidx-1; i++)
+      struct rdata_state state;
+      unsigned char *p;
+      
+      /* Note that these have been determined to be OK previously,
+	 so we don't need to check for NULL return here. */
+      p = skip_name(rrset[i], header, plen, 10);
+      p += 8; /* skip class, type, ttl */
+      GETSHORT(rdlen, p);
+      if (!CHECK_LEN(header, p, plen, rdlen))
+	return -1; /* short packet */
+
+      canon[i].rr = rrset[i];
+      
+      if (*rr_desc == -1)
 	{
-	  int rdlen1, rdlen2;
-	  struct rdata_state state1, state2;
-	  
-	  /* Note that these have been determined to be OK previously,
-	     so we don't need to check for NULL return here. */
-	  state1.ip = skip_name(rrset[i], header, plen, 10);
-	  state2.ip = skip_name(rrset[i+1], header, plen, 10);
-	  state1.op = state2.op = NULL;
-	  state1.buff = buff1;
-	  state2.buff = buff2;
-	  state1.desc = state2.desc = rr_desc;
-	  
-	  state1.ip += 8; /* skip class, type, ttl */
-	  GETSHORT(rdlen1, state1.ip);
-	  if (!CHECK_LEN(header, state1.ip, plen, rdlen1))
-	    return rrsetidx; /* short packet */
-	  state1.end = state1.ip + rdlen1;
-	  
-	  state2.ip += 8; /* skip class, type, ttl */
-	  GETSHORT(rdlen2, state2.ip);
-	  if (!CHECK_LEN(header, state2.ip, plen, rdlen2))
-	    return rrsetidx; /* short packet */
-	  state2.end = state2.ip + rdlen2; 
-
-	  /* If the RR has no names in it then canonicalisation
-	     is the identity function and we can compare
-	     the RRs directly. If not we compare the 
-	     canonicalised RRs one byte at a time. */
-	  if (*rr_desc == -1)	  
+	  canon[i].rdata = p;
+	  canon[i].rdlen = rdlen;
+	  continue;
+	}
+      
+      canon[i].rdata = NULL;
+      canon[i].offset = used;
+      
+      state.ip = p;
+      state.op = NULL;
+      state.desc = rr_desc;
+      state.buff = buff;
+      state.end = p + rdlen;
+      
+      /* get_rdata() returns a chunk at a time in state->op and state->c,
+	 copy the whole chunk and then skip to the next one. */
+      while (get_rdata(header, plen, &state))
+	{
+	  if (used + state.c > canon_buff_sz)
 	    {
-	      int rdmin = rdlen1 > rdlen2 ? rdlen2 : rdlen1;
-	      int cmp = memcmp(state1.ip, state2.ip, rdmin);
+	      unsigned char *new;
+	      size_t new_sz = used + state.c + MAXDNAME + 1;
+
+	      if (!(new = whine_realloc(canon_buff, new_sz)))
+		return -1;
 	      
-	      if (cmp > 0 || (cmp == 0 && rdlen1 > rdmin))
-		{
-		  unsigned char *tmp = rrset[i+1];
-		  rrset[i+1] = rrset[i];
-		  rrset[i] = tmp;
-		  swap = 1;
-		}
-	      else if (cmp == 0 && (rdlen1 == rdlen2))
-		{
-		  /* Two RRs are equal, remove one copy. RFC 4034, para 6.3 */
-		  for (j = i+1; j < rrsetidx-1; j++)
-		    rrset[j] = rrset[j+1];
-		  rrsetidx--;
-		  i--;
-		}
+	      canon_buff = new;
+	      canon_buff_sz = new_sz;
 	    }
-	  else
-	    /* Comparing canonicalised RRs, byte-at-a-time. */
-	    while (1)
-	      {
-		int ok1, ok2;
-		
-		ok1 = get_rdata(header, plen, &state1);
-		ok2 = get_rdata(header, plen, &state2);
-		
-		if (!ok1 && !ok2)
-		  {
-		    /* Two RRs are equal, remove one copy. RFC 4034, para 6.3 */
-		    for (j = i+1; j < rrsetidx-1; j++)
-		      rrset[j] = rrset[j+1];
-		    rrsetidx--;
-		    i--;
-		    break;
-		  }
-		else if (ok1 && (!ok2 || *state1.op > *state2.op)) 
-		  {
-		    unsigned char *tmp = rrset[i+1];
-		    rrset[i+1] = rrset[i];
-		    rrset[i] = tmp;
-		    swap = 1;
-		    break;
-		  }
-		else if (ok2 && (!ok1 || *state2.op > *state1.op))
-		  break;
-		
-		/* arrive here when bytes are equal, go round the loop again
-		   and compare the next ones. */
-	      }
+	  
+	  memcpy(canon_buff + used, state.op, state.c);
+	  used += state.c;
+	  state.op += state.c - 1;
+	  state.c = 1;
 	}
-    } while (swap);
 
-  return rrsetidx;
+      canon[i].rdlen = used - canon[i].offset;
+    }
+
+  /* canon_buff may have moved during extraction, so fill in pointers now. */
+  if (*rr_desc != -1)
+    for (i = 0; i < rrsetidx; i++)
+      canon[i].rdata = canon_buff + canon[i].offset;
+
+  canon_merge_sort(canon, canon_tmp, rrsetidx);
+
+  /* Two RRs are equal, remove one copy. RFC 4034, para 6.3 */
+  for (i = 0, j = 0; i < rrsetidx; i++)
+    if (j == 0 || canon_cmp(&canon[j-1], &canon[i]) != 0)
+      canon[j++] = canon[i];
+  
+  for (i = 0; i < j; i++)
+    rrset[i] = canon[i].rr;
+  
+  return j;
 }
 
 static unsigned char **rrset = NULL, **sigs = NULL;
@@ -465,6 +517,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
     unsigned long curtime = time(0);
   int time_check = is_check_date(curtime);
   int failflags = DNSSEC_FAIL_NOSIG;
+  int provisional = 0, jobs;
   
   if (sigidx != 0)
     failflags |= DNSSEC_FAIL_NYV | DNSSEC_FAIL_EXP | DNSSEC_FAIL_NOKEYSUP;
@@ -475,9 +528,10 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
   name_labels = count_labels(name); /* For 4035 5.3.2 check */
 
   /* Sort RRset records into canonical order. 
-     Note that at this point keyname and daemon->workspacename buffs are
+     Note that at this point the daemon->workspacename buff is
      unused, and used as workspace by the sort. */
-  rrsetidx = sort_rrset(header, plen, rr_desc, rrsetidx, rrset, daemon->workspacename, keyname);
+  if ((rrsetidx = sort_rrset(header, plen, rr_desc, rrsetidx, rrset, daemon->workspacename)) == -1)
+    return STAT_BOGUS;
          
   /* Now try all the sigs to try and find one which validates */
   for (sig_fail_cnt = daemon->limit[LIMIT_SIG_FAIL], j = 0; j <sigidx; j++)
@@ -534,7 +588,11 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       
       /* OK, we have the signature record, see if the relevant DNSKEY is in the cache. */
       if (!key && !(crecp = cache_find_by_name(NULL, keyname, now, F_DNSKEY)))
-	return STAT_NEED_KEY;
+	{
+	  if (provisional)
+	    continue;
+	  return STAT_NEED_KEY;
+	}
 
        if (ttl_out)
 	 {
@@ -562,14 +620,10 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       hash->update(ctx, (unsigned int)wire_len, (unsigned char*)keyname);
       from_wire(keyname);
 
-#define RRBUFLEN 128 /* Most RRs are smaller than this. */
-      
       for (i = 0; i < rrsetidx; ++i)
 	{
 	  int j;
-	  struct rdata_state state;
 	  u16 len;
-	  unsigned char rrbuf[RRBUFLEN];
 	  
 	  p = rrset[i];
 	  
@@ -603,65 +657,10 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	  hash->update(ctx, 4, p); /* class and type */
 	  hash->update(ctx, 4, (unsigned char *)&nsigttl);
 
-	  p += 8; /* skip type, class, ttl */
-	  GETSHORT(rdlen, p);
-	  if (!CHECK_LEN(header, p, plen, rdlen))
-	    return STAT_BOGUS; 
-
-	  /* Optimisation for RR types which need no cannonicalisation.
-	     This includes DNSKEY DS NSEC and NSEC3, which are also long, so
-	     it saves lots of calls to get_rdata, and avoids the pessimal
-	     segmented insertion, even with a small rrbuf[].
-	     
-	     If canonicalisation is not needed, a simple insertion into the hash works.
-	  */
-	  if (*rr_desc == -1)
-	    {
-	      len = htons(rdlen);
-	      hash->update(ctx, 2, (unsigned char *)&len);
-	      hash->update(ctx, rdlen, p);
-	    }
-	  else
-	    {
-	      /* canonicalise rdata and calculate length of same, use 
-		 name buffer as workspace for get_rdata. */
-	      state.ip = p;
-	      state.op = NULL;
-	      state.desc = rr_desc;
-	      state.buff = name;
-	      state.end = p + rdlen;
-	      
-	      for (j = 0; get_rdata(header, plen, &state); j++)
-		if (j < RRBUFLEN)
-		  rrbuf[j] = *state.op;
-	      
-	      len = htons((u16)j);
-	      hash->update(ctx, 2, (unsigned char *)&len); 
-	      
-	      /* If the RR is shorter than RRBUFLEN (most of them, in practice)
-		 then we can just digest it now. If it exceeds RRBUFLEN we have to
-		 go back to the start and do it in chunks. */
-	      if (j >= RRBUFLEN)
-		{
-		  state.ip = p;
-		  state.op = NULL;
-		  state.desc = rr_desc;
-		  
-		  for (j = 0; get_rdata(header, plen, &state); j++)
-		    {
-		      rrbuf[j] = *state.op;
-		      
-		      if (j == RRBUFLEN - 1)
-			{
-			  hash->update(ctx, RRBUFLEN, rrbuf);
-			  j = -1;
-			}
-		    }
-		}
-	      
-	      if (j != 0)
-		hash->update(ctx, j, rrbuf);
-	    }
+	  /* Canonical RDATA was extracted by sort_rrset(), in the same order as rrset[]. */
+	  len = htons((u16)canon[i].rdlen);
+	  hash->update(ctx, 2, (unsigned char *)&len);
+	  hash->update(ctx, canon[i].rdlen, canon[i].rdata);
 	}
      
       nettle_digest_wrapper(hash, ctx, hash->digest_size, digest);
@@ -678,8 +677,13 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	      if (dec_counter(validate_counter, NULL))
 		return STAT_ABANDONED;
 	     	      
+	      jobs = crypto_async_pending();
 	      if (verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo))
-		return STAT_SECURE;
+		{
+		  if (crypto_async_pending() == jobs)
+		    return STAT_SECURE;
+		  provisional = 1;
+		}
 	    }
 	}
       else
@@ -693,8 +697,14 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 		if (dec_counter(validate_counter, NULL))
 		  return STAT_ABANDONED;
 		
+		jobs = crypto_async_pending();
 		if (verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo))
-		  return STAT_SECURE;
+		  {
+		    if (crypto_async_pending() == jobs)
+		      return STAT_SECURE;
+		    provisional = 1;
+		    continue;
+		  }
 		
 		/* An attacker can waste a lot of our CPU by setting up a giant DNSKEY RRSET full of failing
 		   keys, all of which we have to try. Since many failing keys is not likely for
@@ -707,6 +717,12 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	}
     }
 
+  /* Verifications were queued for the worker threads, which only provisionally
+     succeed. Every candidate is queued, rather than just the first, so that the
+     validation run again when they're done finds all of them in the signature cache. */
+  if (provisional)
+    return STAT_SECURE;
+  
   /* If we reach this point, no verifying key was found */
   return STAT_BOGUS | failflags | DNSSEC_FAIL_NOKEY;
 }
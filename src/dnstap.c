@@ -0,0 +1,525 @@
+/* dnsmasq is Copyright (c) 2000-2026 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_DNSTAP
+
+/* --dnstap: write a dnstap record (see dnstap.info) for each DNS message
+   we receive or send, in Frame Streams framing, to a file or to a reader
+   listening on a unix socket. Records are encoded straight into a buffer
+   which is written from the main loop. When the reader can't keep up,
+   records are dropped and counted; we never wait for it. TCP children
+   send their records to the main process through the usual pipe. */
+
+/* Frame Streams control frames */
+#define FSTRM_CONTROL_ACCEPT        1
+#define FSTRM_CONTROL_START         2
+#define FSTRM_CONTROL_STOP          3
+#define FSTRM_CONTROL_READY         4
+#define FSTRM_CONTROL_FIELD_CONTENT 1
+#define DNSTAP_CONTENT_TYPE "protobuf:dnstap.Dnstap"
+
+/* From dnstap.proto */
+#define DNSTAP_FIELD_VERSION        2
+#define DNSTAP_FIELD_EXTRA          3
+#define DNSTAP_FIELD_MESSAGE        14
+#define DNSTAP_FIELD_TYPE           15
+#define DNSTAP_TYPE_MESSAGE         1
+
+#define MESSAGE_FIELD_TYPE          1
+#define MESSAGE_FIELD_FAMILY        2
+#define MESSAGE_FIELD_PROTOCOL      3
+#define MESSAGE_FIELD_QUERY_ADDR    4
+#define MESSAGE_FIELD_RESPONSE_ADDR 5
+#define MESSAGE_FIELD_QUERY_PORT    6
+#define MESSAGE_FIELD_RESPONSE_PORT 7
+#define MESSAGE_FIELD_QUERY_SEC     8
+#define MESSAGE_FIELD_QUERY_NSEC    9
+#define MESSAGE_FIELD_QUERY         10
+#define MESSAGE_FIELD_RESPONSE_SEC  12
+#define MESSAGE_FIELD_RESPONSE_NSEC 13
+#define MESSAGE_FIELD_RESPONSE      14
+
+#define MESSAGE_RESOLVER_QUERY      3
+#define MESSAGE_RESOLVER_RESPONSE   4
+#define MESSAGE_CLIENT_QUERY        5
+#define MESSAGE_CLIENT_RESPONSE     6
+#define MESSAGE_FORWARDER_QUERY     7
+#define MESSAGE_FORWARDER_RESPONSE  8
+
+#define WIRE_VARINT  0
+#define WIRE_BYTES   2
+#define WIRE_FIXED32 5
+
+/* Connection state with a socket reader. */
+#define TAP_CLOSED   0
+#define TAP_ACCEPT   1 /* sent READY, waiting for ACCEPT */
+#define TAP_OPEN     2
+
+static int tap_fd = -1;
+static int tap_state = TAP_CLOSED;
+static char *tap_path = NULL; /* unix socket, or NULL for a file */
+static time_t tap_retry = 0;
+static unsigned char *tap_buf, *tap_frame, *tap_message;
+static size_t tap_start, tap_used;
+static unsigned char ctl_buf[64];
+static size_t ctl_used;
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long val)
+{
+  while (val >= 0x80)
+    {
+      *p++ = (val & 0x7f) | 0x80;
+      val >>= 7;
+    }
+  *p++ = val;
+  return p;
+}
+
+static unsigned char *put_tag(unsigned char *p, int field, int wire)
+{
+  return put_varint(p, (field << 3) | wire);
+}
+
+static unsigned char *put_uint(unsigned char *p, int field, unsigned long long val)
+{
+  return put_varint(put_tag(p, field, WIRE_VARINT), val);
+}
+
+static unsigned char *put_fixed32(unsigned char *p, int field, u32 val)
+{
+  p = put_tag(p, field, WIRE_FIXED32);
+  *p++ = val;
+  *p++ = val >> 8;
+  *p++ = val >> 16;
+  *p++ = val >> 24;
+  return p;
+}
+
+static unsigned char *put_bytes(unsigned char *p, int field, void *data, size_t len)
+{
+  p = put_varint(put_tag(p, field, WIRE_BYTES), len);
+  memcpy(p, data, len);
+  return p + len;
+}
+
+static unsigned char *put_be32(unsigned char *p, u32 val)
+{
+  *p++ = val >> 24;
+  *p++ = val >> 16;
+  *p++ = val >> 8;
+  *p++ = val;
+  return p;
+}
+
+/* A control frame, with the content type if it takes one. */
+static size_t make_control(unsigned char *buf, int type)
+{
+  unsigned char *p = put_be32(buf + 8, type);
+
+  if (type != FSTRM_CONTROL_STOP)
+    {
+      p = put_be32(p, FSTRM_CONTROL_FIELD_CONTENT);
+      p = put_be32(p, strlen(DNSTAP_CONTENT_TYPE));
+      memcpy(p, DNSTAP_CONTENT_TYPE, strlen(DNSTAP_CONTENT_TYPE));
+      p += strlen(DNSTAP_CONTENT_TYPE);
+    }
+
+  /* escape, then length */
+  put_be32(buf, 0);
+  put_be32(buf + 4, p - buf - 8);
+
+  return p - buf;
+}
+
+static unsigned char *put_addr(unsigned char *p, int addr_field, int port_field, union mysockaddr *addr)
+{
+  if (addr->sa.sa_family == AF_INET6)
+    {
+      p = put_bytes(p, addr_field, &addr->in6.sin6_addr, IN6ADDRSZ);
+      return put_uint(p, port_field, ntohs(addr->in6.sin6_port));
+    }
+
+  p = put_bytes(p, addr_field, &addr->in.sin_addr, INADDRSZ);
+  return put_uint(p, port_field, ntohs(addr->in.sin_port));
+}
+
+void dnstap_init(void)
+{
+  unsigned char *p;
+
+  tap_buf = safe_malloc(DNSTAP_BUFSIZE);
+  tap_frame = safe_malloc(DNSTAP_FRAME_MAX);
+  tap_message = safe_malloc(DNSTAP_FRAME_MAX);
+
+  if (strncmp(daemon->dnstap, "unix:", 5) == 0)
+    {
+      tap_path = daemon->dnstap + 5;
+      return;
+    }
+
+  /* A file is a single unidirectional stream, opened whilst we still have
+     the privileges to do so. */
+  if ((tap_fd = open(daemon->dnstap, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP)) == -1)
+    die(_("cannot create %s: %s"), daemon->dnstap, EC_FILE);
+
+  p = tap_frame;
+  if (!read_write(tap_fd, p, make_control(p, FSTRM_CONTROL_START), RW_WRITE))
+    die(_("cannot write %s: %s"), daemon->dnstap, EC_FILE);
+
+  tap_state = TAP_OPEN;
+}
+
+/* Start a connection to the reader: open the socket and send READY. The
+   reader answers with ACCEPT, after which we can send START and the data. */
+static int tap_connect(void)
+{
+  struct sockaddr_un addr;
+  size_t len;
+  int flags;
+
+  memset(&addr, 0, sizeof(addr));
+#ifdef HAVE_SOCKADDR_SA_LEN
+  addr.sun_len = sizeof(addr);
+#endif
+  addr.sun_family = AF_UNIX;
+  safe_strncpy(addr.sun_path, tap_path, sizeof(addr.sun_path));
+
+  if ((tap_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return 0;
+
+  /* The socket is local, so don't bother with a non-blocking connect. */
+  if (connect(tap_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      (flags = fcntl(tap_fd, F_GETFL)) == -1 ||
+      fcntl(tap_fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+      (len = make_control(ctl_buf, FSTRM_CONTROL_READY),
+       write(tap_fd, ctl_buf, len) != (ssize_t)len))
+    {
+      close(tap_fd);
+      tap_fd = -1;
+      return 0;
+    }
+
+  ctl_used = 0;
+  tap_state = TAP_ACCEPT;
+  my_syslog(LOG_INFO, _("connected to dnstap reader at %s"), tap_path);
+  return 1;
+}
+
+static void tap_close(void)
+{
+  close(tap_fd);
+  tap_fd = -1;
+  tap_state = TAP_CLOSED;
+
+  /* We don't know how much of the first frame went, so start afresh. */
+  if (tap_used != tap_start)
+    {
+      daemon->metrics[METRIC_DNSTAP_DROPPED]++;
+      tap_start = tap_used = 0;
+    }
+
+  my_syslog(LOG_WARNING, _("lost connection to dnstap reader at %s"), tap_path);
+}
+
+/* Read the reader's ACCEPT. Anything else means it doesn't want dnstap. */
+static void tap_read_control(void)
+{
+  ssize_t rc;
+  u32 len;
+
+  if ((rc = read(tap_fd, ctl_buf + ctl_used, sizeof(ctl_buf) - ctl_used)) <= 0)
+    {
+      if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+	tap_close();
+      return;
+    }
+
+  ctl_used += rc;
+
+  if (ctl_used < 12)
+    return;
+
+  len = (ctl_buf[4] << 24) | (ctl_buf[5] << 16) | (ctl_buf[6] << 8) | ctl_buf[7];
+
+  if (len + 8 > sizeof(ctl_buf))
+    {
+      tap_close();
+      return;
+    }
+
+  if (ctl_used < len + 8)
+    return;
+
+  if (ctl_buf[0] != 0 || ctl_buf[1] != 0 || ctl_buf[2] != 0 || ctl_buf[3] != 0 ||
+      ctl_buf[8] != 0 || ctl_buf[9] != 0 || ctl_buf[10] != 0 || ctl_buf[11] != FSTRM_CONTROL_ACCEPT)
+    {
+      tap_close();
+      return;
+    }
+
+  /* START goes in front of anything already queued. */
+  len = make_control(ctl_buf, FSTRM_CONTROL_START);
+  if (tap_start < len)
+    {
+      if (tap_used + len - tap_start > DNSTAP_BUFSIZE)
+	{
+	  daemon->metrics[METRIC_DNSTAP_DROPPED]++;
+	  tap_start = tap_used = 0;
+	}
+      memmove(tap_buf + len, tap_buf + tap_start, tap_used - tap_start);
+      tap_used += len - tap_start;
+      tap_start = len;
+    }
+  tap_start -= len;
+  memcpy(tap_buf + tap_start, ctl_buf, len);
+
+  tap_state = TAP_OPEN;
+}
+
+static void tap_write(void)
+{
+  ssize_t rc;
+
+  while (tap_start != tap_used)
+    {
+      if ((rc = write(tap_fd, tap_buf + tap_start, tap_used - tap_start)) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+	      if (tap_path)
+		tap_close();
+	      else
+		{
+		  my_syslog(LOG_ERR, _("cannot write %s: %s"), daemon->dnstap, strerror(errno));
+		  daemon->metrics[METRIC_DNSTAP_DROPPED]++;
+		  tap_start = tap_used = 0;
+		}
+	    }
+	  return;
+	}
+
+      tap_start += rc;
+    }
+
+  tap_start = tap_used = 0;
+}
+
+static int tap_append(unsigned char *frame, size_t len)
+{
+  if (tap_used + len > DNSTAP_BUFSIZE && tap_start != 0)
+    {
+      memmove(tap_buf, tap_buf + tap_start, tap_used - tap_start);
+      tap_used -= tap_start;
+      tap_start = 0;
+    }
+
+  if (tap_used + len > DNSTAP_BUFSIZE)
+    return 0;
+
+  memcpy(tap_buf + tap_used, frame, len);
+  tap_used += len;
+  return 1;
+}
+
+/* Add a frame to the buffer, or drop it if there's no room or no reader. */
+void dnstap_frame(unsigned char *frame, size_t len)
+{
+  if ((tap_path && tap_state == TAP_CLOSED) || !tap_append(frame, len))
+    daemon->metrics[METRIC_DNSTAP_DROPPED]++;
+  else
+    daemon->metrics[METRIC_DNSTAP_FRAMES]++;
+}
+
+/* Record a DNS message. The message type comes from the DUMP_* mask: src is
+   the client for queries from clients, dst the client for replies to them,
+   and similarly for the server with messages to and from upstream. started
+   is when the query arrived or was sent upstream, from dnsmasq_milliseconds(),
+   or zero. TAP_CACHED marks an answer made without forwarding the query. */
+void dnstap_packet(int mask, void *packet, size_t len, union mysockaddr *src,
+		   union mysockaddr *dst, int flags, u32 started, int ede)
+{
+  unsigned char *p, *m = tap_message;
+  struct timespec ts;
+  union mysockaddr *peer;
+  int type, response;
+  char extra[40];
+
+  if (!daemon->dnstap || len > DNSTAP_FRAME_MAX - 512)
+    return;
+
+  switch (mask)
+    {
+    case DUMP_QUERY:     type = MESSAGE_CLIENT_QUERY; break;
+    case DUMP_REPLY:     type = MESSAGE_CLIENT_RESPONSE; break;
+    case DUMP_UP_QUERY:  type = MESSAGE_FORWARDER_QUERY; break;
+    case DUMP_UP_REPLY:  type = MESSAGE_FORWARDER_RESPONSE; break;
+    case DUMP_SEC_QUERY: type = MESSAGE_RESOLVER_QUERY; break;
+    case DUMP_SEC_REPLY: type = MESSAGE_RESOLVER_RESPONSE; break;
+    default: return;
+    }
+
+  response = (type == MESSAGE_CLIENT_RESPONSE || type == MESSAGE_FORWARDER_RESPONSE || type == MESSAGE_RESOLVER_RESPONSE);
+  peer = src ? src : dst;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  m = put_uint(m, MESSAGE_FIELD_TYPE, type);
+  if (peer)
+    {
+      m = put_uint(m, MESSAGE_FIELD_FAMILY, peer->sa.sa_family == AF_INET6 ? 2 : 1);
+      m = put_uint(m, MESSAGE_FIELD_PROTOCOL, (flags & TAP_TCP) ? 2 : 1);
+
+      /* The client asks us, we ask the server. */
+      if (type == MESSAGE_CLIENT_QUERY || type == MESSAGE_CLIENT_RESPONSE)
+	m = put_addr(m, MESSAGE_FIELD_QUERY_ADDR, MESSAGE_FIELD_QUERY_PORT, peer);
+      else
+	m = put_addr(m, MESSAGE_FIELD_RESPONSE_ADDR, MESSAGE_FIELD_RESPONSE_PORT, peer);
+    }
+
+  if (response)
+    {
+      /* Time of the query, so that the reader can work out the latency. */
+      if (started != 0)
+	{
+	  u32 elapsed = dnsmasq_milliseconds() - started;
+	  struct timespec qs = ts;
+
+	  qs.tv_sec -= elapsed / 1000;
+	  if ((qs.tv_nsec -= (elapsed % 1000) * 1000000) < 0)
+	    {
+	      qs.tv_nsec += 1000000000;
+	      qs.tv_sec--;
+	    }
+	  m = put_uint(m, MESSAGE_FIELD_QUERY_SEC, qs.tv_sec);
+	  m = put_fixed32(m, MESSAGE_FIELD_QUERY_NSEC, qs.tv_nsec);
+	}
+      m = put_uint(m, MESSAGE_FIELD_RESPONSE_SEC, ts.tv_sec);
+      m = put_fixed32(m, MESSAGE_FIELD_RESPONSE_NSEC, ts.tv_nsec);
+      m = put_bytes(m, MESSAGE_FIELD_RESPONSE, packet, len);
+    }
+  else
+    {
+      m = put_uint(m, MESSAGE_FIELD_QUERY_SEC, ts.tv_sec);
+      m = put_fixed32(m, MESSAGE_FIELD_QUERY_NSEC, ts.tv_nsec);
+      m = put_bytes(m, MESSAGE_FIELD_QUERY, packet, len);
+    }
+
+  /* Things which aren't in the message itself go in the free-form extra field. */
+  extra[0] = 0;
+  if (type == MESSAGE_CLIENT_RESPONSE)
+    {
+      if (ede != EDE_UNSET)
+	sprintf(extra, "%s ede=%d", (flags & TAP_CACHED) ? "cached" : "forwarded", ede);
+      else
+	strcpy(extra, (flags & TAP_CACHED) ? "cached" : "forwarded");
+    }
+
+  /* Frame length, then the Dnstap message wrapping the Message. */
+  p = put_be32(tap_frame, 0);
+  p = put_bytes(p, DNSTAP_FIELD_VERSION, "dnsmasq-" VERSION, strlen("dnsmasq-" VERSION));
+  if (extra[0] != 0)
+    p = put_bytes(p, DNSTAP_FIELD_EXTRA, extra, strlen(extra));
+  p = put_bytes(p, DNSTAP_FIELD_MESSAGE, tap_message, m - tap_message);
+  p = put_uint(p, DNSTAP_FIELD_TYPE, DNSTAP_TYPE_MESSAGE);
+  put_be32(tap_frame, p - tap_frame - 4);
+
+  if (daemon->pipe_to_parent != -1)
+    {
+      /* TCP child: the main process owns the stream. */
+      unsigned char op = PIPE_OP_DNSTAP;
+      size_t flen = p - tap_frame;
+
+      read_write(daemon->pipe_to_parent, &op, sizeof(op), RW_WRITE);
+      read_write(daemon->pipe_to_parent, (unsigned char *)&flen, sizeof(flen), RW_WRITE);
+      read_write(daemon->pipe_to_parent, tap_frame, flen, RW_WRITE);
+    }
+  else
+    dnstap_frame(tap_frame, p - tap_frame);
+}
+
+/* Read a frame sent by a TCP child. */
+int dnstap_recv_frame(int fd)
+{
+  size_t len;
+
+  if (!read_write(fd, (unsigned char *)&len, sizeof(len), RW_READ) ||
+      len > DNSTAP_FRAME_MAX ||
+      !read_write(fd, tap_frame, len, RW_READ))
+    return 0;
+
+  dnstap_frame(tap_frame, len);
+  return 1;
+}
+
+void set_dnstap_listeners(time_t now)
+{
+  if (!daemon->dnstap)
+    return;
+
+  if (tap_state == TAP_CLOSED && difftime(now, tap_retry) >= DNSTAP_RETRY)
+    {
+      tap_retry = now;
+      tap_connect();
+    }
+
+  if (tap_state == TAP_ACCEPT)
+    poll_listen(tap_fd, POLLIN);
+  else if (tap_state == TAP_OPEN && tap_start != tap_used)
+    poll_listen(tap_fd, POLLOUT);
+}
+
+void check_dnstap_listeners(void)
+{
+  if (!daemon->dnstap || tap_fd == -1)
+    return;
+
+  if (tap_state == TAP_ACCEPT)
+    {
+      if (poll_check(tap_fd, POLLIN | POLLHUP))
+	tap_read_control();
+    }
+  else if (poll_check(tap_fd, POLLOUT | POLLHUP | POLLERR))
+    tap_write();
+}
+
+/* On exit, send what's queued and STOP. Blocks, but only briefly for a socket. */
+void dnstap_close(void)
+{
+  int flags;
+
+  if (!daemon->dnstap || tap_state != TAP_OPEN)
+    return;
+
+  if (tap_path && (flags = fcntl(tap_fd, F_GETFL)) != -1)
+    {
+      struct timeval tv = { 1, 0 };
+
+      fcntl(tap_fd, F_SETFL, flags & ~O_NONBLOCK);
+      setsockopt(tap_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+  tap_append(ctl_buf, make_control(ctl_buf, FSTRM_CONTROL_STOP));
+  tap_write();
+  close(tap_fd);
+  tap_fd = -1;
+}
+
+#endif
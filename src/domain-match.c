@@ -638,6 +638,9 @@ void cleanup_servers(void)
          server_gone(serv);
          *up = serv->next;
 	 free(serv->domain);
+#ifdef HAVE_HISTOGRAMS
+	 free(serv->rtt);
+#endif
 	 free(serv);
        }
       else 
@@ -21,8 +21,46 @@
 #include <netinet/icmp6.h>
 
 static u32 packet_count;
+static int pcapng;
+static unsigned char *dump_buf;
+static size_t dump_used;
+static u32 dump_started; /* dnsmasq_milliseconds() when the oldest record in dump_buf was added */
+
+/* getsockname() results, direct-mapped on fd. Entries are removed by
+   dump_forget_fd() when a socket is created, since fd numbers get reused. */
+static struct fd_addr {
+  int fd;
+  union mysockaddr addr;
+} fd_cache[DUMP_FD_CACHE];
+
+/* --dumpring: the last daemon->dump_ring packets of each group are kept
+   in memory, and only written to the dumpfile when asked for. */
+struct ring_pkt {
+  int mask;
+  struct timespec time;
+  size_t len, size;
+  unsigned char *data;
+};
+
+static struct dump_ring {
+  int mask, next, count;
+  struct ring_pkt *pkts;
+} dump_rings[] = {
+  { DUMP_QUERY | DUMP_REPLY | DUMP_BOGUS, 0, 0, NULL },
+  { DUMP_UP_QUERY | DUMP_UP_REPLY, 0, 0, NULL },
+  { DUMP_SEC_QUERY | DUMP_SEC_REPLY | DUMP_SEC_BOGUS, 0, 0, NULL },
+  { DUMP_DHCP | DUMP_DHCPV6 | DUMP_RA, 0, 0, NULL },
+  { DUMP_TFTP, 0, 0, NULL },
+};
+
+#define DUMP_RINGS (sizeof(dump_rings)/sizeof(dump_rings[0]))
+
+static char *ring_reason; /* set when the ring is to be written from the main loop */
+static time_t ring_written;
+
 static void do_dump_packet(int mask, void *packet, size_t len,
 			   union mysockaddr *src, union mysockaddr *dst, int port, int proto);
+static void ring_store(int mask, struct timespec *time, struct iovec *iov, int n);
 
 /* https://wiki.wireshark.org/Development/LibpcapFileFormat */
 struct pcap_hdr_s {
@@ -42,14 +80,371 @@ struct pcaprec_hdr_s {
         u32 orig_len;       /* actual length of packet */
 };
 
+/* https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-03.html */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BOM 0x1A2B3C4D
+
+struct pcapng_shb {
+        u32 type;
+        u32 len;
+        u32 byte_order;
+        u16 version_major;
+        u16 version_minor;
+        u32 section_len[2]; /* unknown, -1 */
+        u32 len_again;
+};
+
+struct pcapng_idb {
+        u32 type;
+        u32 len;
+        u16 link_type;
+        u16 reserved;
+        u32 snaplen;
+};
+
+struct pcapng_epb {
+        u32 type;
+        u32 len;
+        u32 interface;
+        u32 ts_high;        /* nanoseconds since the epoch, see if_tsresol */
+        u32 ts_low;
+        u32 incl_len;
+        u32 orig_len;
+};
+
+/* In pcapng files each kind of packet gets an "interface" of its own,
+   so wireshark can filter and colour on frame.interface_name. */
+static const struct {
+  int mask;
+  char *name;
+} dump_ifaces[] = {
+  { DUMP_QUERY,     "query" },
+  { DUMP_REPLY,     "reply" },
+  { DUMP_UP_QUERY,  "upstream-query" },
+  { DUMP_UP_REPLY,  "upstream-reply" },
+  { DUMP_SEC_QUERY, "dnssec-query" },
+  { DUMP_SEC_REPLY, "dnssec-reply" },
+  { DUMP_BOGUS,     "bogus" },
+  { DUMP_SEC_BOGUS, "dnssec-bogus" },
+  { DUMP_DHCP,      "dhcp" },
+  { DUMP_DHCPV6,    "dhcpv6" },
+  { DUMP_RA,        "ra" },
+  { DUMP_TFTP,      "tftp" },
+};
+
+#define DUMP_IFACES (sizeof(dump_ifaces)/sizeof(dump_ifaces[0]))
+
+/* Write out everything in the buffer. */
+int dump_flush(void)
+{
+  int ret = 1;
+  
+  if (dump_used != 0)
+    {
+      u32 started = dnsmasq_microseconds();
+      
+      if (!read_write(daemon->dumpfd, dump_buf, dump_used, RW_WRITE))
+	{
+	  my_syslog(LOG_ERR, _("failed to write packet dump: %s"), strerror(errno));
+	  ret = 0;
+	}
+      
+      dump_used = 0;
+      stall_site("dumpfile", started);
+    }
+  
+  return ret;
+}
+
+/* Called from the main loop: write out the capture ring if it's been
+   asked for, and records which have waited DUMP_FLUSH_TIME. Returns the
+   number of milliseconds until the next write is due, or -1 if the 
+   buffer is empty. */
+int dump_flush_timer(void)
+{
+  u32 age;
+
+  if (ring_reason)
+    {
+      dump_ring_write(ring_reason);
+      ring_reason = NULL;
+    }
+  
+  if (daemon->dumpfd == -1 || dump_used == 0)
+    return -1;
+  
+  if ((age = dnsmasq_milliseconds() - dump_started) >= DUMP_FLUSH_TIME)
+    {
+      dump_flush();
+      return -1;
+    }
+  
+  return DUMP_FLUSH_TIME - age;
+}
+
+/* Append to the record buffer. Anything too large for it goes straight to the file. */
+static int dump_put(void *data, size_t len)
+{
+  if (dump_used + len > DUMP_BUFSIZE)
+    {
+      if (!dump_flush())
+	return 0;
+
+      if (len > DUMP_BUFSIZE)
+	return read_write(daemon->dumpfd, data, len, RW_WRITE);
+    }
+
+  if (dump_used == 0)
+    dump_started = dnsmasq_milliseconds();
+  
+  memcpy(dump_buf + dump_used, data, len);
+  dump_used += len;
+
+  return 1;
+}
+
+/* Add one packet, given in pieces, to the dumpfile in the current format. */
+static int dump_record(int mask, struct timespec *time, struct iovec *iov, int n)
+{
+  u32 caplen, trailer = 0, padlen = 0;
+  int i;
+
+  for (caplen = 0, i = 0; i < n; i++)
+    caplen += iov[i].iov_len;
+  
+  if (pcapng)
+    {
+      struct pcapng_epb epb;
+      u64 ns = (u64)time->tv_sec * 1000000000 + time->tv_nsec;
+      
+      for (i = 0; i < (int)DUMP_IFACES - 1 && !(dump_ifaces[i].mask & mask); i++);
+
+      padlen = (4 - (caplen & 3)) & 3;
+      epb.type = PCAPNG_EPB;
+      epb.len = sizeof(epb) + caplen + padlen + sizeof(u32);
+      epb.interface = i;
+      epb.ts_high = ns >> 32;
+      epb.ts_low = ns & 0xffffffff;
+      epb.incl_len = epb.orig_len = caplen;
+
+      /* Keep records whole in the buffer where we can. */
+      if (dump_used + epb.len > DUMP_BUFSIZE)
+	dump_flush();
+
+      if (!dump_put(&epb, sizeof(epb)))
+	return 0;
+      
+      trailer = epb.len;
+    }
+  else
+    {
+      struct pcaprec_hdr_s pcap_header;
+
+      pcap_header.ts_sec = time->tv_sec;
+      pcap_header.ts_usec = time->tv_nsec / 1000;
+      pcap_header.incl_len = pcap_header.orig_len = caplen;
+
+      if (dump_used + sizeof(pcap_header) + caplen > DUMP_BUFSIZE)
+	dump_flush();
+      
+      if (!dump_put(&pcap_header, sizeof(pcap_header)))
+	return 0;
+    }
+  
+  for (i = 0; i < n; i++)
+    if (!dump_put(iov[i].iov_base, iov[i].iov_len))
+      return 0;
+
+  if (pcapng)
+    {
+      u32 zero = 0;
+
+      if (!dump_put(&zero, padlen) || !dump_put(&trailer, sizeof(u32)))
+	return 0;
+    }
+  
+  packet_count++;
+  
+  return 1;
+}
+
+/* Keep a copy of a packet in the capture ring for its group, overwriting the oldest. */
+static void ring_store(int mask, struct timespec *time, struct iovec *iov, int n)
+{
+  struct dump_ring *ring;
+  struct ring_pkt *pkt;
+  size_t len;
+  int i;
+  
+  for (ring = dump_rings; ring < &dump_rings[DUMP_RINGS - 1] && !(ring->mask & mask); ring++);
+  pkt = &ring->pkts[ring->next];
+  
+  for (len = 0, i = 0; i < n; i++)
+    len += iov[i].iov_len;
+
+  if (len > pkt->size)
+    {
+      unsigned char *new;
+      
+      if (!(new = whine_malloc(len)))
+	return;
+      
+      free(pkt->data);
+      pkt->data = new;
+      pkt->size = len;
+    }
+
+  for (pkt->len = 0, i = 0; i < n; i++)
+    {
+      memcpy(pkt->data + pkt->len, iov[i].iov_base, iov[i].iov_len);
+      pkt->len += iov[i].iov_len;
+    }
+
+  pkt->mask = mask;
+  pkt->time = *time;
+  
+  ring->next = (ring->next + 1) % daemon->dump_ring;
+  if (ring->count < daemon->dump_ring)
+    ring->count++;
+}
+
+/* Write the contents of the capture rings to the dumpfile, oldest first,
+   and empty them. Returns the number of packets written. */
+unsigned int dump_ring_write(char *reason)
+{
+  unsigned int count = 0;
+  int ok = 1;
+  
+  if (daemon->dumpfd == -1 || daemon->dump_ring == 0)
+    return 0;
+  
+  while (1)
+    {
+      struct dump_ring *ring, *oldest = NULL;
+      struct ring_pkt *pkt = NULL;
+      struct iovec iov;
+      
+      for (ring = dump_rings; ring < &dump_rings[DUMP_RINGS]; ring++)
+	if (ring->count != 0)
+	  {
+	    struct ring_pkt *first = &ring->pkts[(ring->next + daemon->dump_ring - ring->count) % daemon->dump_ring];
+	    
+	    if (!pkt || first->time.tv_sec < pkt->time.tv_sec ||
+		(first->time.tv_sec == pkt->time.tv_sec && first->time.tv_nsec < pkt->time.tv_nsec))
+	      {
+		pkt = first;
+		oldest = ring;
+	      }
+	  }
+
+      if (!oldest)
+	break;
+
+      oldest->count--;
+      
+      iov.iov_base = pkt->data;
+      iov.iov_len = pkt->len;
+
+      if (ok && (ok = dump_record(pkt->mask, &pkt->time, &iov, 1)))
+	count++;
+    }
+  
+  if (!dump_flush() || !ok)
+    my_syslog(LOG_ERR, _("failed to write packet dump"));
+
+  my_syslog(LOG_INFO, _("%s: wrote %u packets from the capture ring to %s"), reason, count, daemon->dump_file);
+  
+  return count;
+}
+
+/* Ask for the capture ring to be written from the main loop, 
+   at most once every DUMP_RING_INTERVAL seconds. */
+static void ring_trigger(char *reason)
+{
+  time_t now = dnsmasq_time();
+
+  if (!ring_reason && (ring_written == 0 || difftime(now, ring_written) >= DUMP_RING_INTERVAL))
+    {
+      ring_reason = reason;
+      ring_written = now;
+    }
+}
+
+static void pcapng_option(unsigned char **p, u16 code, void *data, u16 len)
+{
+  u16 hdr[2];
+
+  hdr[0] = code;
+  hdr[1] = len;
+  memcpy(*p, hdr, sizeof(hdr));
+  if (len != 0)
+    memcpy(*p + sizeof(hdr), data, len);
+  memset(*p + sizeof(hdr) + len, 0, (4 - (len & 3)) & 3);
+  *p += sizeof(hdr) + ((len + 3) & ~3);
+}
+
+/* Start a new section: header block and the interface descriptions. */
+static int pcapng_section(void)
+{
+  struct pcapng_shb shb;
+  unsigned int i;
+
+  shb.type = PCAPNG_SHB;
+  shb.len = shb.len_again = sizeof(shb);
+  shb.byte_order = PCAPNG_BOM;
+  shb.version_major = 1;
+  shb.version_minor = 0;
+  shb.section_len[0] = shb.section_len[1] = 0xffffffff;
+
+  if (!dump_put(&shb, sizeof(shb)))
+    return 0;
+  
+  for (i = 0; i < DUMP_IFACES; i++)
+    {
+      struct pcapng_idb idb;
+      unsigned char block[128], *p = block + sizeof(idb);
+      unsigned char tsresol = 9; /* timestamps in nanoseconds */
+      
+      pcapng_option(&p, 2, dump_ifaces[i].name, strlen(dump_ifaces[i].name)); /* if_name */
+      pcapng_option(&p, 9, &tsresol, 1); /* if_tsresol */
+      pcapng_option(&p, 0, NULL, 0); /* opt_endofopt */
+
+      idb.type = PCAPNG_IDB;
+      idb.len = p - block + sizeof(u32);
+      idb.link_type = 101; /* LINKTYPE_RAW */
+      idb.reserved = 0;
+      idb.snaplen = daemon->edns_pktsz + 200;
+      memcpy(block, &idb, sizeof(idb));
+      memcpy(p, &idb.len, sizeof(u32));
+      
+      if (!dump_put(block, idb.len))
+	return 0;
+    }
+  
+  return dump_flush();
+}
 
 void dump_init(void)
 {
   struct stat buf;
   struct pcap_hdr_s header;
   struct pcaprec_hdr_s pcap_header;
-
+  u32 block[3];
+  int i;
+  
   packet_count = 0;
+  dump_used = 0;
+  dump_buf = safe_malloc(DUMP_BUFSIZE);
+  pcapng = option_bool(OPT_DUMP_PCAPNG);
+
+  for (i = 0; i < DUMP_FD_CACHE; i++)
+    fd_cache[i].fd = -1;
+
+  if (daemon->dump_ring != 0)
+    for (i = 0; i < (int)DUMP_RINGS; i++)
+      dump_rings[i].pkts = safe_malloc(daemon->dump_ring * sizeof(struct ring_pkt));
   
   header.magic_number = 0xa1b2c3d4;
   header.version_major = 2;
@@ -64,7 +459,7 @@ void dump_init(void)
       /* doesn't exist, create and add header */
       if (errno != ENOENT ||
 	  (daemon->dumpfd = creat(daemon->dump_file, S_IRUSR | S_IWUSR)) == -1 ||
-	  !read_write(daemon->dumpfd, (void *)&header, sizeof(header), RW_WRITE))
+	  !(pcapng ? pcapng_section() : read_write(daemon->dumpfd, (void *)&header, sizeof(header), RW_WRITE)))
 	die(_("cannot create %s: %s"), daemon->dump_file, EC_FILE);
     }
   else if (S_ISFIFO(buf.st_mode))
@@ -72,32 +467,76 @@ void dump_init(void)
       /* File is named pipe (with wireshark on the other end, probably.)
 	 Send header. */
       if  ((daemon->dumpfd = open(daemon->dump_file, O_APPEND | O_RDWR)) == -1 ||
-	   !read_write(daemon->dumpfd, (void *)&header, sizeof(header), RW_WRITE))
+	   !(pcapng ? pcapng_section() : read_write(daemon->dumpfd, (void *)&header, sizeof(header), RW_WRITE)))
 	die(_("cannot open pipe %s: %s"), daemon->dump_file, EC_FILE);
     }
   else if ((daemon->dumpfd = open(daemon->dump_file, O_APPEND | O_RDWR)) == -1 ||
-	   !read_write(daemon->dumpfd, (void *)&header, sizeof(header), RW_READ))
+	   !read_write(daemon->dumpfd, (void *)block, sizeof(block), RW_READ))
     die(_("cannot access %s: %s"), daemon->dump_file, EC_FILE);
-  else if (header.magic_number != 0xa1b2c3d4)
-    die(_("bad header in %s"), daemon->dump_file, EC_FILE);
-  else
+  else if (block[0] == 0xa1b2c3d4)
     {
+      /* Existing files keep their format, whatever --dumpformat says. */
+      pcapng = 0;
+      
       /* count existing records */
-      while (read_write(daemon->dumpfd, (void *)&pcap_header, sizeof(pcap_header), RW_READ))
-	{
-	  if (lseek(daemon->dumpfd, pcap_header.incl_len, SEEK_CUR) == (off_t)-1)
-	    break;
-	  packet_count++;
-	}
+      if (lseek(daemon->dumpfd, sizeof(header), SEEK_SET) != (off_t)-1)
+	while (read_write(daemon->dumpfd, (void *)&pcap_header, sizeof(pcap_header), RW_READ))
+	  {
+	    if (lseek(daemon->dumpfd, pcap_header.incl_len, SEEK_CUR) == (off_t)-1)
+	      break;
+	    packet_count++;
+	  }
+    }
+  else if (block[0] == PCAPNG_SHB && block[2] == PCAPNG_BOM)
+    {
+      pcapng = 1;
+
+      /* count existing records, then start a section of our own
+	 so that the interface numbers are ours. */
+      if (lseek(daemon->dumpfd, 0, SEEK_SET) != (off_t)-1)
+	while (read_write(daemon->dumpfd, (void *)block, 2 * sizeof(u32), RW_READ) && block[1] >= 12)
+	  {
+	    if (lseek(daemon->dumpfd, block[1] - 2 * sizeof(u32), SEEK_CUR) == (off_t)-1)
+	      break;
+	    if (block[0] == PCAPNG_EPB)
+	      packet_count++;
+	  }
+      
+      if (!pcapng_section())
+	die(_("cannot access %s: %s"), daemon->dump_file, EC_FILE);
     }
+  else
+    die(_("bad header in %s"), daemon->dump_file, EC_FILE);
+}
+
+/* A new socket may have the number of one we've seen before. */
+void dump_forget_fd(int fd)
+{
+  if (fd >= 0 && fd_cache[fd % DUMP_FD_CACHE].fd == fd)
+    fd_cache[fd % DUMP_FD_CACHE].fd = -1;
+}
+
+static union mysockaddr *fd_address(int fd)
+{
+  struct fd_addr *entry = &fd_cache[fd % DUMP_FD_CACHE];
+  socklen_t addr_len = sizeof(entry->addr);
+  
+  if (entry->fd != fd)
+    {
+      if (getsockname(fd, (struct sockaddr *)&entry->addr, &addr_len) == -1)
+	return NULL;
+
+      entry->fd = fd;
+    }
+
+  return &entry->addr;
 }
 
 void dump_packet_udp(int mask, void *packet, size_t len,
 		     union mysockaddr *src, union mysockaddr *dst, int fd)
 {
-  union mysockaddr fd_addr;
-  socklen_t addr_len = sizeof(fd_addr);
-
+  union mysockaddr *fd_addr;
+  
   if (daemon->dumpfd != -1 && (mask & daemon->dump_mask))
      {
        /* if fd is negative it carries a port number (negated) 
@@ -109,16 +548,26 @@ void dump_packet_udp(int mask, void *packet, size_t len,
        
        /* fd >= 0 is a file descriptor and the address of that file descriptor is used
 	  in place of a NULL src or dst. */
-       if (fd >= 0 && getsockname(fd, (struct sockaddr *)&fd_addr, &addr_len) != -1)
+       if (fd >= 0 && (!src || !dst) && (fd_addr = fd_address(fd)))
 	 {
 	   if (!src)
-	     src = &fd_addr;
+	     src = fd_addr;
 	   
 	   if (!dst)
-	     dst = &fd_addr;
+	     dst = fd_addr;
 	 }
        
        do_dump_packet(mask, packet, len, src, dst, port, IPPROTO_UDP);
+
+       /* Something went wrong: save the evidence. */
+       if (daemon->dump_ring != 0)
+	 {
+	   if (mask & (DUMP_BOGUS | DUMP_SEC_BOGUS))
+	     ring_trigger("DNSSEC validation failure");
+	   else if ((mask & DUMP_REPLY) && len >= sizeof(struct dns_header) &&
+		    RCODE((struct dns_header *)packet) == SERVFAIL)
+	     ring_trigger("SERVFAIL reply");
+	 }
      }
 }
 
@@ -141,12 +590,12 @@ static void do_dump_packet(int mask, void *packet, size_t len,
     u16 uh_ulen;                /* udp length */
     u16 uh_sum;                 /* udp checksum */
   } udp;
-  struct pcaprec_hdr_s pcap_header;
-  struct timeval time;
+  struct timespec time;
+  struct iovec iov[3];
   u32 i, sum;
   void *iphdr;
   size_t ipsz;
-  int rc;
+  int n = 0;
      
   /* if port != -1 it carries a port number 
      which we use as a source or destination when not otherwise
@@ -263,7 +712,6 @@ static void do_dump_packet(int mask, void *packet, size_t len,
 	sum = (sum & 0xffff) + (sum >> 16);
       udp.uh_sum = (sum == 0xffff) ? sum : ~sum;
 
-      pcap_header.incl_len = pcap_header.orig_len = ipsz + sizeof(udp) + len;
     }
   else
     {
@@ -281,23 +729,30 @@ static void do_dump_packet(int mask, void *packet, size_t len,
 	sum = (sum & 0xffff) + (sum >> 16);
       icmp->icmp6_cksum = (sum == 0xffff) ? sum : ~sum;
 
-      pcap_header.incl_len = pcap_header.orig_len = ipsz + len;
     }
     
-  rc = gettimeofday(&time, NULL);
-  pcap_header.ts_sec = time.tv_sec;
-  pcap_header.ts_usec = time.tv_usec;
+  iov[n].iov_base = iphdr;
+  iov[n++].iov_len = ipsz;
+  
+  if (proto == IPPROTO_UDP)
+    {
+      iov[n].iov_base = &udp;
+      iov[n++].iov_len = sizeof(udp);
+    }
   
-  if (rc == -1 ||
-      !read_write(daemon->dumpfd, (void *)&pcap_header, sizeof(pcap_header), RW_WRITE) ||
-      !read_write(daemon->dumpfd, iphdr, ipsz, RW_WRITE) ||
-      (proto == IPPROTO_UDP && !read_write(daemon->dumpfd, (void *)&udp, sizeof(udp), RW_WRITE)) ||
-      !read_write(daemon->dumpfd, (void *)packet, len, RW_WRITE))
+  iov[n].iov_base = packet;
+  iov[n++].iov_len = len;
+  
+  if (clock_gettime(CLOCK_REALTIME, &time) == -1)
+    my_syslog(LOG_ERR, _("failed to write packet dump"));
+  else if (daemon->dump_ring != 0)
+    ring_store(mask, &time, iov, n);
+  else if (!dump_record(mask, &time, iov, n))
     my_syslog(LOG_ERR, _("failed to write packet dump"));
   else if (option_bool(OPT_EXTRALOG) && (mask & 0x00ff))
-    my_syslog(LOG_INFO, _("%u dumping packet %u mask 0x%04x"),  daemon->log_display_id, ++packet_count, mask);
+    my_syslog(LOG_INFO, _("%u dumping packet %u mask 0x%04x"),  daemon->log_display_id, packet_count, mask);
   else
-    my_syslog(LOG_INFO, _("dumping packet %u mask 0x%04x"), ++packet_count, mask);
+    my_syslog(LOG_INFO, _("dumping packet %u mask 0x%04x"), packet_count, mask);
 
 }
 
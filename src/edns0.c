@@ -336,12 +336,6 @@ static size_t add_mac(struct dns_header *header, size_t plen, size_t outlen,
   return plen; 
 }
 
-struct subnet_opt {
-  u16 family;
-  u8 source_netmask, scope_netmask; 
-  u8 addr[IN6ADDRSZ];
-};
-
 static void *get_addrp(union mysockaddr *addr, const short family) 
 {
   if (family == AF_INET6)
@@ -413,11 +407,11 @@ static size_t calc_subnet_opt(struct subnet_opt *opt, union mysockaddr *source,
    OPT_CLIENT_SUBNET + OPT_STRIP_ECS = client subnet is replaced
    OPT_STRIP_ECS = client subnet is removed */
 static size_t add_source_addr(struct dns_header *header, size_t plen, size_t outlen,
-			      union mysockaddr *source, int *cacheable)
+			      union mysockaddr *source, int *cacheable, struct subnet_opt *subnet)
 {
   /* http://tools.ietf.org/html/draft-vandergaast-edns-client-subnet-02 */
   
-  int replace = 0, len = 0;
+  int replace = 0, len = 0, was_cacheable = *cacheable;
   struct subnet_opt opt;
   
   if (option_bool(OPT_CLIENT_SUBNET))
@@ -425,6 +419,10 @@ static size_t add_source_addr(struct dns_header *header, size_t plen, size_t out
       if (option_bool(OPT_STRIP_ECS))
 	replace = 1;
       len = calc_subnet_opt(&opt, source, cacheable);
+
+      /* Answer depends only on the subnet we send. */
+      if (subnet && was_cacheable && !*cacheable)
+	*subnet = opt;
     }
   else if (option_bool(OPT_STRIP_ECS))
     replace = 2;
@@ -437,7 +435,12 @@ static size_t add_source_addr(struct dns_header *header, size_t plen, size_t out
       if (*cacheable &&
 	  (pheader = find_pseudoheader(header, plen, NULL, NULL, NULL, NULL)) &&
 	  !check_source(header, plen, pheader, NULL))
-	*cacheable = 0;
+	{
+	  *cacheable = 0;
+	  
+	  if (subnet && !get_subnet_opt(header, plen, subnet))
+	    subnet->family = 0;
+	}
       
       return plen;
     }
@@ -492,6 +495,52 @@ int check_source(struct dns_header *header, size_t plen, unsigned char *pseudohe
   return 1;
 }
 
+/* Find the client subnet option in a query or reply and copy it to *opt.
+   Returns a pointer to the option in the packet, or NULL if there isn't a
+   well-formed one. */
+unsigned char *get_subnet_opt(struct dns_header *header, size_t plen, struct subnet_opt *opt)
+{
+  unsigned char *p, *pheader;
+  int code, i, len, rdlen, addrlen;
+  
+  if (!(pheader = find_pseudoheader(header, plen, NULL, NULL, NULL, NULL)) ||
+      !(p = skip_name(pheader, header, plen, 10)))
+    return NULL;
+  
+  p += 8; /* skip type, UDP length and RCODE */
+  
+  GETSHORT(rdlen, p);
+  if (!CHECK_LEN(header, p, plen, rdlen))
+    return NULL;
+  
+  for (i = 0; i + 4 <= rdlen; i += len + 4)
+    {
+      GETSHORT(code, p);
+      GETSHORT(len, p);
+      if (i + 4 + len > rdlen)
+	break;
+      if (code == EDNS0_OPTION_CLIENT_SUBNET)
+	{
+	  if (len < 4 || len > (int)sizeof(struct subnet_opt))
+	    return NULL;
+	  
+	  memset(opt, 0, sizeof(struct subnet_opt));
+	  memcpy(opt, p, len);
+	  addrlen = opt->source_netmask == 0 ? 0 : ((opt->source_netmask - 1) >> 3) + 1;
+	  
+	  if ((opt->family != htons(1) && opt->family != htons(2)) ||
+	      opt->source_netmask > (opt->family == htons(1) ? 32 : 128) ||
+	      len != addrlen + 4)
+	    return NULL;
+	  
+	  return p;
+	}
+      p += len;
+    }
+  
+  return NULL;
+}
+
 /* See https://docs.umbrella.com/umbrella-api/docs/identifying-dns-traffic for
  * detailed information on packet formating.
  */
@@ -556,11 +605,15 @@ static size_t add_umbrella_opt(struct dns_header *header, size_t plen, size_t ou
 
 /* Set *check_subnet if we add a client subnet option, which needs to checked 
    in the reply. Set *cacheable to zero if we add an option which the answer
-   may depend on. */
+   may depend on. If subnet is non-NULL and the only such option is a client
+   subnet, copy that to *subnet, otherwise set subnet->family to zero. */
 size_t add_edns0_config(struct dns_header *header, size_t plen, size_t outlen, 
-			union mysockaddr *source, time_t now, int *cacheable)    
+			union mysockaddr *source, time_t now, int *cacheable, struct subnet_opt *subnet)    
 {
   *cacheable = 1;
+
+  if (subnet)
+    subnet->family = 0;
   
   plen  = add_mac(header, plen, outlen, source, now, cacheable);
   plen = add_dns_client(header, plen, outlen, source, now, cacheable);
@@ -572,7 +625,7 @@ size_t add_edns0_config(struct dns_header *header, size_t plen, size_t outlen,
   if (option_bool(OPT_UMBRELLA))
     plen = add_umbrella_opt(header, plen, outlen, source, cacheable);
   
-  plen = add_source_addr(header, plen, outlen, source, cacheable);
+  plen = add_source_addr(header, plen, outlen, source, cacheable, subnet);
 
   return plen;
 }
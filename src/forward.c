@@ -19,6 +19,8 @@
 static struct frec *get_new_frec(time_t now, struct server *serv, int force);
 static struct frec *lookup_frec(time_t now, char *target, int class, int rrtype, int id, int flags, int flagmask);
 #ifdef HAVE_DNSSEC
+static unsigned int key_query_hash(char *name, int class, int flags);
+static struct frec *lookup_key_frec(time_t now, char *name, int class, int flags);
 static int tcp_key_recurse(time_t now, int status, struct dns_header *header, size_t n, 
 			   int class, char *name, char *keyname, struct server *server, 
 			   int have_mark, unsigned int mark, int *keycount, int *validatecount);
@@ -27,6 +29,16 @@ static unsigned short get_id(void);
 static void free_frec(struct frec *f);
 static void query_full(time_t now, char *domain);
 
+#ifdef HAVE_HISTOGRAMS
+/* When the UDP query being processed arrived. */
+static u32 query_arrived;
+#endif
+
+#ifdef HAVE_DNSTAP
+/* The same, in milliseconds, for the query time of dnstap CLIENT_RESPONSEs. */
+static u32 query_tap_arrived;
+#endif
+
 /* Send a UDP packet with its source address set as "source" 
    unless nowild is true, when we just send it with the kernel default */
 int send_from(int fd, int nowild, char *packet, size_t len, 
@@ -166,7 +178,8 @@ static int domain_no_rebind(char *domain)
 static void forward_query(int udpfd, union mysockaddr *udpaddr,
 			  union all_addr *dst_addr, unsigned int dst_iface,
 			  struct dns_header *header, size_t plen,  size_t replylimit, time_t now, 
-			  struct frec *forward, unsigned int fwd_flags, int fast_retry)
+			  struct frec *forward, unsigned int fwd_flags, int fast_retry,
+			  struct subnet_opt *subnet)
 {
   unsigned int flags = 0;
   int is_dnssec = forward && (forward->flags & (FREC_DNSKEY_QUERY | FREC_DS_QUERY));
@@ -312,9 +325,18 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
 	  src->fd = udpfd;
 	  src->encode_bitmap = casediff;
 	  src->encode_bigmap = bitvector;
+#ifdef HAVE_HISTOGRAMS
+	  src->arrived = query_arrived;
+#endif
+#ifdef HAVE_DNSTAP
+	  src->tap_arrived = query_tap_arrived;
+#endif
 	  
 	  src->udp_pkt_size = (unsigned short)replylimit;
 
+	  if (udpfd != -1)
+	    daemon->metrics[METRIC_DNS_CACHE_MISSES]++;
+
 	  /* closely spaced identical queries cannot be a try and a retry, so
 	     it's safe to wait for the reply from the first without
 	     forwarding the second. */
@@ -364,6 +386,11 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
       if (flags || ede == EDE_NOT_READY)
 	goto reply;
 
+      /* A miss for hitratio.bind. Internal queries, and those refreshing
+	 stale answers already sent, have no client to reply to. */
+      if (udpfd != -1)
+	daemon->metrics[METRIC_DNS_CACHE_MISSES]++;
+
       master = daemon->serverarray[first];
 
       if (!(forward = get_new_frec(now, master, 0)))
@@ -372,6 +399,11 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
 
       forward->flags = fwd_flags;
 
+      if (subnet)
+	forward->subnet = *subnet;
+      else
+	forward->subnet.family = 0;
+
 #ifdef HAVE_DNSSEC
       if (option_bool(OPT_DNSSEC_VALID))
 	{
@@ -409,6 +441,12 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
       forward->frec_src.next = NULL;
       forward->frec_src.fd = udpfd;
       forward->frec_src.udp_pkt_size = (unsigned short)replylimit;
+#ifdef HAVE_HISTOGRAMS
+      forward->frec_src.arrived = query_arrived;
+#endif
+#ifdef HAVE_DNSTAP
+      forward->frec_src.tap_arrived = query_tap_arrived;
+#endif
       forward->forwardall = 0;
       if (domain_no_rebind(daemon->namebuff))
 	forward->flags |= FREC_NOREBIND;
@@ -444,8 +482,8 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
       while (forward->blocking_query)
 	forward = forward->blocking_query;
 
-      /* Don't retry if we've already sent it via TCP. */
-      if (forward->flags & FREC_GONE_TO_TCP)
+      /* Don't retry if we've already sent it via TCP, or have the answer and are checking signatures. */
+      if (forward->flags & (FREC_GONE_TO_TCP | FREC_CRYPTO_WAIT))
 	return;
       
       if (forward->flags & (FREC_DNSKEY_QUERY | FREC_DS_QUERY))
@@ -543,6 +581,9 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
 #ifdef HAVE_DUMPFILE
 	      dump_packet_udp(DUMP_UP_QUERY, (void *)header, plen, NULL, &srv->addr, fd);
 #endif
+#ifdef HAVE_DNSTAP
+	      dnstap_packet(DUMP_UP_QUERY, (void *)header, plen, NULL, &srv->addr, 0, 0, EDE_UNSET);
+#endif
 	      
 	      /* Keep info in case we want to re-send this packet */
 	      daemon->srv_save = srv;
@@ -578,6 +619,9 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
     {
       daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]++;
       forward->forward_timestamp = dnsmasq_milliseconds();
+#ifdef HAVE_HISTOGRAMS
+      forward->forward_sent = dnsmasq_microseconds();
+#endif
       return;
     }
   
@@ -614,14 +658,57 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
 
 #ifdef HAVE_DUMPFILE
       dump_packet_udp(DUMP_REPLY, (void *)header, plen, NULL, udpaddr, udpfd);
+#endif
+#ifdef HAVE_DNSTAP
+      dnstap_packet(DUMP_REPLY, (void *)header, plen, NULL, udpaddr, TAP_CACHED, query_tap_arrived, ede);
 #endif
       send_from(udpfd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)header, plen, udpaddr, dst_addr, dst_iface);
+#ifdef HAVE_HISTOGRAMS
+      record_latency(HIST_CACHED, query_arrived);
+#endif
     }
   
   daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
   return;
 }
 
+/* Forward a query which we made ourselves, rather than one from a client.
+   The answer is cached, but not sent anywhere. Returns zero, and does nothing,
+   if limit or more such queries are already waiting for answers. */
+int forward_internal_query(struct dns_header *header, size_t plen, time_t now, int limit, char *source)
+{
+  static union mysockaddr src_addr;
+  static union all_addr dst_addr;
+  unsigned short type;
+  struct frec *f;
+  int count = 0;
+
+  for (f = daemon->frec_list; f; f = f->next)
+    if (f->sentto && (f->flags & FREC_INTERNAL) && difftime(now, f->time) < TIMEOUT)
+      count++;
+
+  if (count >= limit)
+    return 0;
+
+  /* Never matches a real client, and never gets a reply since udpfd == -1 */
+  src_addr.in.sin_family = AF_INET;
+  src_addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifdef HAVE_SOCKADDR_SA_LEN
+  src_addr.in.sin_len = sizeof(struct sockaddr_in);
+#endif
+
+  if (extract_request(header, plen, daemon->namebuff, &type, NULL))
+    {
+      daemon->log_display_id = ++daemon->log_id;
+      daemon->log_source_addr = NULL;
+      log_query(F_QUERY | F_FORWARD, daemon->namebuff, NULL, source, type);
+    }
+  
+  forward_query(-1, &src_addr, &dst_addr, 0, header, plen, daemon->edns_pktsz, now, NULL, FREC_INTERNAL, 0, NULL);
+
+  return 1;
+}
+
 /* Check if any frecs need to do a retry, and action that if so. 
    Return time in milliseconds until he next retry will be required,
    or -1 if none. */
@@ -638,7 +725,7 @@ int fast_retry(time_t now)
 	if (f->sentto && difftime(now, f->time) < daemon->fast_retry_timeout)
 	  {
 #ifdef HAVE_DNSSEC
-	    if (f->blocking_query || (f->flags & FREC_GONE_TO_TCP))
+	    if (f->blocking_query || (f->flags & (FREC_GONE_TO_TCP | FREC_CRYPTO_WAIT)))
 	      continue;
 #endif
 	    /* t is milliseconds since last query sent. */ 
@@ -658,7 +745,7 @@ int fast_retry(time_t now)
 		daemon->log_display_id = f->frec_src.log_id;
 		daemon->log_source_addr = NULL;
 		
-		forward_query(-1, NULL, NULL, 0, header, f->stash_len, 0, now, f, 0, 1);
+		forward_query(-1, NULL, NULL, 0, header, f->stash_len, 0, now, f, 0, 1, NULL);
 		
 		to_run = f->forward_delay = 2 * f->forward_delay;
 	      }
@@ -893,7 +980,7 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 			    ssize_t plen, int status, time_t now)
 {
   struct frec *orig;
-  int log_resource = 0;
+  int log_resource = 0, validate_save, jobs;
 
   daemon->log_display_id = forward->frec_src.log_id;
     
@@ -955,6 +1042,14 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 	     would invite infinite loops, since the answers to DNSKEY and DS queries
 	     will not be cached, so they'll be repeated. */
 	ds_retry:
+	  validate_save = orig->validate_counter;
+
+	  /* Hand the crypto to the worker threads, unless this is the re-run after
+	     they've finished, in which case anything not cached gets done now. */
+	  if (!(forward->flags & FREC_CRYPTO_RERUN))
+	    crypto_async_start(forward, forward->uid);
+	  forward->flags &= ~FREC_CRYPTO_RERUN;
+	  
 	  if (forward->flags & FREC_DNSKEY_QUERY)
 	    status = dnssec_validate_by_ds(now, header, plen, daemon->namebuff, daemon->keyname, forward->class, &orig->validate_counter);
 	  else if (forward->flags & FREC_DS_QUERY)
@@ -963,6 +1058,27 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 	    status = dnssec_validate_reply(now, header, plen, daemon->namebuff, daemon->keyname, &forward->class, 
 					   !option_bool(OPT_DNSSEC_IGN_NS), NULL, NULL, NULL, NULL, &orig->validate_counter);
 	  
+	  if ((jobs = crypto_async_end()) != 0)
+	    {
+	      /* The result is provisional, throw it away and put the reply aside
+		 until the worker threads are done. dnssec_crypto_done() will
+		 run the validation again. */
+	      struct blockdata *stash;
+
+	      orig->validate_counter = validate_save;
+	      forward->flags |= FREC_CRYPTO_RERUN;
+	      
+	      if (!(stash = blockdata_alloc((char *)header, plen)))
+		goto ds_retry;
+	      
+	      blockdata_free(forward->stash);
+	      forward->stash = stash;
+	      forward->stash_len = plen;
+	      forward->crypto_pending = jobs;
+	      forward->flags |= FREC_CRYPTO_WAIT;
+	      return;
+	    }
+	  
 	  if (STAT_ISEQUAL(status, STAT_ABANDONED))
 	    log_resource = 1;
 	}
@@ -981,7 +1097,10 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 	  unsigned int flags = STAT_ISEQUAL(status, STAT_NEED_KEY) ? FREC_DNSKEY_QUERY : FREC_DS_QUERY;
 	  struct frec *old;
 	  
-	  if ((old = lookup_frec(now, daemon->keyname, forward->class, -1, -1, flags, flags)))
+	  /* If there's already a query in flight for the same DNSKEY or DS, wait for that
+	     rather than sending another. All the queries waiting on it get
+	     woken together by pop_and_retry_query() when the answer arrives. */
+	  if ((old = lookup_key_frec(now, daemon->keyname, forward->class, flags)))
 	    {
 	      /* This is tricky; it detects loops in the dependency
 		 graph for DNSSEC validation, say validating A requires DS B
@@ -998,6 +1117,7 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 
 	      if (!f)
 		{
+		  daemon->metrics[METRIC_DNSSEC_SUBQUERIES_COALESCED]++;
 		  forward->next_dependent = old->dependent;
 		  old->dependent = forward;
 		  /* Make consistent, only replace query copy with unvalidated answer
@@ -1046,6 +1166,7 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 		  new->frec_src.next = NULL;
 		  new->flags &= ~(FREC_DNSKEY_QUERY | FREC_DS_QUERY);
 		  new->flags |= flags;
+		  new->key_hash = key_query_hash(daemon->keyname, forward->class, flags);
 		  new->forwardall = 0;
 		  new->frec_src.encode_bitmap = 0;
 		  new->frec_src.encode_bigmap = NULL;
@@ -1066,6 +1187,9 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 		  new->stash_len = nn;
 		  if (daemon->fast_retry_time != 0)
 		    new->forward_timestamp = dnsmasq_milliseconds();
+#ifdef HAVE_HISTOGRAMS
+		  new->forward_sent = dnsmasq_microseconds();
+#endif
 		  
 		  /* Don't resend this. */
 		  daemon->srv_save = NULL;
@@ -1079,6 +1203,9 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 		  server->queries++;
 #ifdef HAVE_DUMPFILE
 		  dump_packet_udp(DUMP_SEC_QUERY, (void *)header, (size_t)nn, NULL, &server->addr, fd);
+#endif
+#ifdef HAVE_DNSTAP
+		  dnstap_packet(DUMP_SEC_QUERY, (void *)header, (size_t)nn, NULL, &server->addr, 0, 0, EDE_UNSET);
 #endif
 		  log_query_mysockaddr(F_NOEXTRA | F_DNSSEC | F_SERVER, daemon->keyname, &server->addr,
 				       STAT_ISEQUAL(status, STAT_NEED_KEY) ? "dnssec-query[DNSKEY]" : "dnssec-query[DS]", 0);
@@ -1130,6 +1257,28 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
     pop_and_retry_query(forward, status, now);
 }
 
+/* Called as each job queued for the crypto worker threads completes.
+   There's a chance that the frec may have timed-out and been freed,
+   or even reused, before the result arrives, the uid check catches that. */
+void dnssec_crypto_done(struct frec *forward, int uid, time_t now)
+{
+  struct dns_header *header = (struct dns_header *)daemon->packet;
+
+  if (!forward->sentto || forward->uid != uid || !(forward->flags & FREC_CRYPTO_WAIT) ||
+      --forward->crypto_pending != 0)
+    return;
+
+  forward->flags &= ~FREC_CRYPTO_WAIT;
+  forward->flags |= FREC_CRYPTO_RERUN;
+  
+  /* packet buffer overwritten */
+  daemon->srv_save = NULL;
+  daemon->log_source_addr = &forward->frec_src.source;
+  
+  blockdata_retrieve(forward->stash, forward->stash_len, (void *)header);
+  dnssec_validate(forward, header, forward->stash_len, STAT_OK, now);
+}
+
 void pop_and_retry_query(struct frec *forward, int status, time_t now)
 {
   /* validated subsidiary query/queries, (and cached result)
@@ -1237,6 +1386,10 @@ void reply_query(int fd, time_t now)
   dump_packet_udp((forward->flags & (FREC_DNSKEY_QUERY | FREC_DS_QUERY)) ? DUMP_SEC_REPLY : DUMP_UP_REPLY,
 		  (void *)header, n, &serveraddr, NULL, fd);
 #endif
+#ifdef HAVE_DNSTAP
+  dnstap_packet((forward->flags & (FREC_DNSKEY_QUERY | FREC_DS_QUERY)) ? DUMP_SEC_REPLY : DUMP_UP_REPLY,
+		(void *)header, n, &serveraddr, NULL, 0, forward->forward_timestamp, EDE_UNSET);
+#endif
 
   if (daemon->ignore_addr && RCODE(header) == NOERROR &&
       check_for_ignored_address(header, n))
@@ -1247,8 +1400,9 @@ void reply_query(int fd, time_t now)
 	 the results of further queries, in which case
 	 the stash contains something else and we don't need to retry anyway.
 	 We may also have already got a truncated reply, and be in the process
-	 of doing the query by TCP so can ignore further, probably truncated, UDP answers. */
-      if (forward->blocking_query || (forward->flags & FREC_GONE_TO_TCP))
+	 of doing the query by TCP so can ignore further, probably truncated, UDP answers.
+	 Or the answer may be waiting for the crypto worker threads. */
+      if (forward->blocking_query || (forward->flags & (FREC_GONE_TO_TCP | FREC_CRYPTO_WAIT)))
 	return;
 #endif
       
@@ -1258,7 +1412,7 @@ void reply_query(int fd, time_t now)
       /* Get the saved query back. */
       blockdata_retrieve(forward->stash, forward->stash_len, (void *)header);
       
-      forward_query(-1, NULL, NULL, 0, header, forward->stash_len, 0, now, forward, 0, 0);
+      forward_query(-1, NULL, NULL, 0, header, forward->stash_len, 0, now, forward, 0, 0, NULL);
       return;
     }
 
@@ -1287,6 +1441,10 @@ void reply_query(int fd, time_t now)
     server->mma_latency += dnsmasq_milliseconds() - forward->forward_timestamp - server->query_latency;
   /* denominator controls how many queries we average over. */
   server->query_latency = server->mma_latency/128;
+
+#ifdef HAVE_HISTOGRAMS
+  record_server_rtt(server, forward->forward_sent);
+#endif
   
   /* Flip the bits back in the query name. */
     if (!extract_name(header, n, NULL, (char *)&forward->frec_src.encode_bitmap, EXTR_NAME_FLIP, 1))
@@ -1352,11 +1510,39 @@ static void flip_queryname(struct dns_header *header, ssize_t len, struct frec_s
   xor_array(arg1p, arg2p, arg2len); /* restore */
 }
 
+/* Find the scope of a reply to a query sent with client subnet *sent, and
+   return it in *reply_subnet, or return NULL if the subnet in the reply doesn't match. */
+static struct subnet_opt *get_reply_subnet(struct dns_header *header, size_t n, struct subnet_opt *sent,
+					   struct subnet_opt *reply_subnet)
+{
+  struct subnet_opt opt;
+  
+  *reply_subnet = *sent;
+  /* No option in the reply: answer doesn't depend on the subnet. */
+  reply_subnet->scope_netmask = 0;
+  
+  if (get_subnet_opt(header, n, &opt))
+    {
+      if (opt.family != sent->family || opt.source_netmask != sent->source_netmask ||
+	  (sent->source_netmask != 0 && memcmp(opt.addr, sent->addr, ((sent->source_netmask - 1) >> 3) + 1) != 0))
+	return NULL;
+
+      reply_subnet->scope_netmask = opt.scope_netmask;
+    }
+  
+  return reply_subnet;
+}
+
 void return_reply(time_t now, struct frec *forward, struct dns_header *header, ssize_t n, int status)
 {
   int check_rebind = 0, no_cache_dnssec = 0, cache_secure = 0, bogusanswer = 0;
   size_t nn;
   int ede = EDE_UNSET;
+  struct subnet_opt reply_subnet, *subnet = NULL;
+#ifdef HAVE_HISTOGRAMS
+  /* status is STAT_OK unless the reply was validated. */
+  int hist = STAT_ISEQUAL(status, STAT_OK) ? HIST_FORWARDED : HIST_DNSSEC;
+#endif
 
   (void)status;
 
@@ -1437,7 +1623,13 @@ void return_reply(time_t now, struct frec *forward, struct dns_header *header, s
   /* Never cache answers which are contingent on the source or MAC address EDSN0 option,
      since the cache is ignorant of such things. */
   if (forward->flags & FREC_NO_CACHE)
-    no_cache_dnssec = 1;
+    {
+      /* Unless the answer depends only on the client subnet, which the subnet cache handles. */
+      if (!no_cache_dnssec && forward->subnet.family != 0)
+	subnet = get_reply_subnet(header, (size_t)n, &forward->subnet, &reply_subnet);
+      
+      no_cache_dnssec = 1;
+    }
   
   if ((nn = process_reply(header, now, forward->sentto, (size_t)n, check_rebind, no_cache_dnssec, cache_secure, bogusanswer, 
 			  forward->flags & FREC_AD_QUESTION, forward->flags & FREC_DO_QUESTION, 
@@ -1446,6 +1638,9 @@ void return_reply(time_t now, struct frec *forward, struct dns_header *header, s
     {
       struct frec_src *src, *prev;
       int do_trunc;
+
+      if (subnet)
+	subnet_cache_insert(header, nn, subnet, forward->flags, now);
             
       for (do_trunc = 0, prev = NULL, src = &forward->frec_src; src; prev = src, src = src->next)
 	{
@@ -1476,8 +1671,14 @@ void return_reply(time_t now, struct frec *forward, struct dns_header *header, s
 		{
 		  send_from(src->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn, 
 			    &src->source, &src->dest, src->iface);
+#ifdef HAVE_HISTOGRAMS
+		  record_latency(hist, src->arrived);
+#endif
 #ifdef HAVE_DUMPFILE
 		  dump_packet_udp(DUMP_REPLY, daemon->packet, (size_t)nn, NULL, &src->source, src->fd);
+#endif
+#ifdef HAVE_DNSTAP
+		  dnstap_packet(DUMP_REPLY, daemon->packet, (size_t)nn, NULL, &src->source, 0, src->tap_arrived, ede);
 #endif
 		}
 	      else
@@ -1522,9 +1723,15 @@ void return_reply(time_t now, struct frec *forward, struct dns_header *header, s
 		  header->id = htons(src->orig_id);
 		  send_from(src->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, new, 
 			    &src->source, &src->dest, src->iface);
+#ifdef HAVE_HISTOGRAMS
+		  record_latency(hist, src->arrived);
+#endif
 		  
 #ifdef HAVE_DUMPFILE
 		  dump_packet_udp(DUMP_REPLY, daemon->packet, (size_t)new, NULL, &src->source, src->fd);
+#endif
+#ifdef HAVE_DNSTAP
+		  dnstap_packet(DUMP_REPLY, daemon->packet, (size_t)new, NULL, &src->source, 0, src->tap_arrived, ede);
 #endif
 		}
 	    }
@@ -1593,6 +1800,7 @@ void receive_query(struct listener *listen, time_t now)
   int stale = 0, filtered = 0, ede = EDE_UNSET, do_forward = 0;
   int metric, fd; 
   struct blockdata *saved_question = NULL;
+  struct subnet_opt subnet;
 #ifdef HAVE_CONNTRACK
   unsigned int mark = 0;
   int have_mark = 0;
@@ -1660,6 +1868,13 @@ void receive_query(struct listener *listen, time_t now)
       (header->hb3 & HB3_QR))
     return;
 
+#ifdef HAVE_HISTOGRAMS
+  query_arrived = dnsmasq_microseconds();
+#endif
+#ifdef HAVE_DNSTAP
+  query_tap_arrived = dnsmasq_milliseconds();
+#endif
+
   /* Clear buffer beyond request to avoid risk of
      information disclosure. */
   memset(daemon->packet + n, 0, daemon->edns_pktsz - n);
@@ -1830,6 +2045,9 @@ void receive_query(struct listener *listen, time_t now)
 #ifdef HAVE_DUMPFILE
   dump_packet_udp(DUMP_QUERY, daemon->packet, (size_t)n, &source_addr, NULL, listen->fd);
 #endif
+#ifdef HAVE_DNSTAP
+  dnstap_packet(DUMP_QUERY, daemon->packet, (size_t)n, &source_addr, NULL, 0, 0, EDE_UNSET);
+#endif
   
 #ifdef HAVE_CONNTRACK
   if (option_bool(OPT_CMARK_ALST_EN))
@@ -1945,14 +2163,26 @@ void receive_query(struct listener *listen, time_t now)
     {
       int cacheable;
 
-      n = add_edns0_config(header, n, daemon->edns_pktsz, &source_addr, now, &cacheable);
+      n = add_edns0_config(header, n, daemon->edns_pktsz, &source_addr, now, &cacheable, &subnet);
       saved_question = blockdata_alloc((char *) header, (size_t)n);
 
       if (!cacheable)
 	fwd_flags |= FREC_NO_CACHE;
 
-      m = answer_request(header, ((char *) header) + udp_size, (size_t)n, 
-			 dst_addr_4, netmask, now, fwd_flags & FREC_AD_QUESTION, do_bit, !cacheable, &stale, &filtered);
+      if (!cacheable || !(m = answer_cache_find(header, (size_t)n, do_bit, udp_size)))
+	{
+	  m = answer_request(header, ((char *) header) + udp_size, (size_t)n, 
+			     dst_addr_4, netmask, now, fwd_flags & FREC_AD_QUESTION, do_bit, !cacheable, &stale, &filtered);
+	  
+	  answer_cache_end(header, (stale || filtered) ? 0 : m);
+
+	  if (m == 0 && subnet.family != 0 && saved_question)
+	    {
+	      /* Get the question back, since it may have been mangled by answer_request() */
+	      blockdata_retrieve(saved_question, (size_t)n, (void *)header);
+	      m = subnet_cache_find(header, (size_t)n, &subnet, fwd_flags, udp_size, now);
+	    }
+	}
       
       metric = stale ? METRIC_DNS_STALE_ANSWERED : METRIC_DNS_LOCAL_ANSWERED;
       
@@ -1990,6 +2220,9 @@ void receive_query(struct listener *listen, time_t now)
 #ifdef HAVE_DUMPFILE
       dump_packet_udp(DUMP_REPLY, daemon->packet, m, NULL, &source_addr, listen->fd);
 #endif
+#ifdef HAVE_DNSTAP
+      dnstap_packet(DUMP_REPLY, daemon->packet, m, NULL, &source_addr, TAP_CACHED, query_tap_arrived, ede);
+#endif
       
 #if defined(HAVE_CONNTRACK) && defined(HAVE_UBUS)
       if (report)
@@ -1998,6 +2231,9 @@ void receive_query(struct listener *listen, time_t now)
       
       send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
 		(char *)header, m, &source_addr, &dst_addr, if_index);
+#ifdef HAVE_HISTOGRAMS
+      record_latency(HIST_CACHED, query_arrived);
+#endif
 
       daemon->metrics[metric]++;
       
@@ -2024,7 +2260,7 @@ void receive_query(struct listener *listen, time_t now)
       saved_question = NULL;
 
       forward_query(fd, &source_addr, &dst_addr, if_index, header, (size_t)n,
-		    udp_size, now, NULL, fwd_flags, 0);
+		    udp_size, now, NULL, fwd_flags, 0, &subnet);
     }
 
   blockdata_free(saved_question);
@@ -2390,6 +2626,13 @@ void tcp_request(int confd, time_t now, struct iovec *bigbuff,
   int have_mark = 0;
   int first, last, filtered, do_stale = 0;
   struct iovec out_iov[2];
+#ifdef HAVE_DNSTAP
+  int tap_flags = TAP_TCP;
+  u32 tap_started = 0;
+#endif
+#ifdef HAVE_HISTOGRAMS
+  u32 hist_started = 0;
+#endif
   
   bigbuff->iov_base = NULL;
   bigbuff->iov_len = 0;
@@ -2473,13 +2716,23 @@ void tcp_request(int confd, time_t now, struct iovec *bigbuff,
 
 	  if (size < (int)sizeof(struct dns_header) || (header->hb3 & HB3_QR))
 	    continue;
+
+#ifdef HAVE_HISTOGRAMS
+	  hist_started = dnsmasq_microseconds();
+#endif
+
+#ifdef HAVE_DNSTAP
+	  dnstap_packet(DUMP_QUERY, header, size, &peer_addr, NULL, TAP_TCP, 0, EDE_UNSET);
+	  tap_flags = TAP_TCP | TAP_CACHED;
+	  tap_started = dnsmasq_milliseconds();
+#endif
 	  
 	  /* Make sure we have a buffer big enough for the largest answer. */
 	  expand_buf(bigbuff, 65536 + MAXDNAME + RRFIXEDSZ);
 	  out_header = bigbuff->iov_base;
 	  
 	  /* Add edns0 pheader to query */
-	  size = add_edns0_config(header, size, daemon->packet_buff_sz, &peer_addr, now, &cacheable);
+	  size = add_edns0_config(header, size, daemon->packet_buff_sz, &peer_addr, now, &cacheable, NULL);
 
 	  /* Clear buffer to avoid risk of information disclosure. */
 	  memset(bigbuff->iov_base, 0, bigbuff->iov_len);
@@ -2578,8 +2831,11 @@ void tcp_request(int confd, time_t now, struct iovec *bigbuff,
 		m = answer_auth(out_header, ((char *) out_header) + 65536, (size_t)size, now, &peer_addr, local_auth);
 #endif
 	      else
-		m = answer_request(out_header, ((char *) out_header) + 65536, (size_t)size, 
-				   dst_addr_4, netmask, now, ad_reqd, do_bit, !cacheable, &stale, &filtered);
+		{
+		  cache_shared_import(now);
+		  m = answer_request(out_header, ((char *) out_header) + 65536, (size_t)size, 
+				     dst_addr_4, netmask, now, ad_reqd, do_bit, !cacheable, &stale, &filtered);
+		}
 	    }
 	}
       
@@ -2636,6 +2892,10 @@ void tcp_request(int confd, time_t now, struct iovec *bigbuff,
 		    {
 		      /* just in case tcp_talk() expanded buffer - should never happen */
 		      out_header = bigbuff->iov_base;
+#ifdef HAVE_DNSTAP
+		      dnstap_packet(DUMP_UP_REPLY, out_header, m, &serv->addr, NULL, TAP_TCP, tap_started, EDE_UNSET);
+		      tap_flags = TAP_TCP;
+#endif
 		      /* get query name again for logging - may have been overwritten */
 		      if (!extract_name(out_header, (unsigned int)size, NULL, daemon->namebuff, EXTR_NAME_EXTRACT, 0))
 			strcpy(daemon->namebuff, "query");
@@ -2762,6 +3022,10 @@ void tcp_request(int confd, time_t now, struct iovec *bigbuff,
 	  report_addresses(header, m, mark);
 #endif
       
+#ifdef HAVE_DNSTAP
+      dnstap_packet(DUMP_REPLY, bigbuff->iov_base, m, NULL, &peer_addr, tap_flags, tap_started, ede);
+#endif
+      
       /* use scatter-gather IO so that length doesn't end up in separate packet. */
       out_len = htons(m);
       out_iov[0].iov_len = sizeof(out_len);
@@ -2770,6 +3034,10 @@ void tcp_request(int confd, time_t now, struct iovec *bigbuff,
       out_iov[1].iov_base = bigbuff->iov_base;
       if (!read_writev(confd, out_iov, 2, RW_WRITE))
 	break;
+
+#ifdef HAVE_HISTOGRAMS
+      record_latency(HIST_TCP, hist_started);
+#endif
       
       /* If we answered with stale data, this process will now try and get fresh data into
 	 the cache and cannot therefore accept new queries. Close the incoming
@@ -2803,6 +3071,10 @@ static int random_sock(struct server *s)
 
   if ((fd = socket(s->source_addr.sa.sa_family, SOCK_DGRAM, 0)) != -1)
     {
+#ifdef HAVE_DUMPFILE
+      dump_forget_fd(fd);
+#endif
+
       /* We need to set IPV6ONLY so we can use the same ports
 	 for IPv4 and IPV6, otherwise, in restriced port situations,
 	 we can end up with all our available ports in use for 
@@ -3288,6 +3560,55 @@ static struct frec *lookup_frec(time_t now, char *target, int class, int rrtype,
   return NULL;
 }
 
+#ifdef HAVE_DNSSEC
+static unsigned int key_query_hash(char *name, int class, int flags)
+{
+  unsigned int c, val = (unsigned int)class ^ ((flags & FREC_DNSKEY_QUERY) ? 0x55555555 : 0);
+
+  while ((c = (unsigned char)*name++))
+    {
+      /* don't use tolower and friends here - they may be messed up by LOCALE */
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      val = ((val << 7) | (val >> (32 - 7))) ^ c;
+    }
+
+  return val;
+}
+
+/* Find an in-flight DNSKEY or DS query, as lookup_frec() does, but check the
+   hash of the question first, so that we don't have to unpack and compare the
+   stashed query of every frec in the list when many validations are
+   looking for keys at once. */
+static struct frec *lookup_key_frec(time_t now, char *name, int class, int flags)
+{
+  unsigned int hash = key_query_hash(name, class, flags);
+  struct frec *f;
+  struct dns_header *header;
+  
+  for (f = daemon->frec_list; f; f = f->next)
+    if (f->sentto &&
+	(f->flags & (FREC_DNSKEY_QUERY | FREC_DS_QUERY)) == flags &&
+	f->key_hash == hash &&
+	f->class == class &&
+	(header = blockdata_retrieve(f->stash, f->stash_len, NULL)))
+      {
+	unsigned char *p = (unsigned char *)(header+1);
+	
+	if (extract_name(header, f->stash_len, &p, name, EXTR_NAME_COMPARE, 4) != 1)
+	  continue;
+	
+	/* See lookup_frec() */
+	if (difftime(now, f->time) >= 4*TIMEOUT)
+	  return NULL;
+	
+	return f;
+      }
+  
+  return NULL;
+}
+#endif
+
 /* Send query packet again, if we can. */
 void resend_query(void)
 {
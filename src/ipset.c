@@ -204,8 +204,13 @@ int add_to_ipset(const char *setname, const union all_addr *ipaddr, int flags, i
 	}
     }
   
-  if (ret != -1) 
-    ret = old_kernel ? old_add_to_ipset(setname, ipaddr, remove) : new_add_to_ipset(setname, ipaddr, af, remove);
+  if (ret != -1)
+    {
+      u32 started = dnsmasq_microseconds();
+      
+      ret = old_kernel ? old_add_to_ipset(setname, ipaddr, remove) : new_add_to_ipset(setname, ipaddr, af, remove);
+      stall_site("ipset", started);
+    }
 
   if (ret == -1)
      my_syslog(LOG_ERR, _("failed to update ipset %s: %s"), setname, strerror(errno));
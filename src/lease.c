@@ -291,6 +291,8 @@ void lease_update_file(time_t now)
   
   if (file_dirty != 0 && daemon->lease_stream)
     {
+      u32 started = dnsmasq_microseconds();
+
       errno = 0;
       rewind(daemon->lease_stream);
       if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
@@ -410,6 +412,8 @@ void lease_update_file(time_t now)
       
       if (!err)
 	file_dirty = 0;
+
+      stall_site("lease file", started);
     }
   
   /* Set alarm for when the first lease expires. */
@@ -25,7 +25,12 @@
    syslogd, then the two daemons can deadlock. We get around this
    by not blocking when talking to syslog, instead we queue up to 
    MAX_LOGS messages. If more are queued, they will be dropped,
-   and the drop event itself logged. */
+   and the drop event itself logged. 
+
+   Messages are formatted into a fixed ring of entries and written
+   from the main loop, several at a time where the destination allows,
+   so that logging a query costs neither a system call nor a wait. 
+   The ring is only written in-line when it fills up. */
 
 /* The "wire" protocol for logging is defined in RFC 3164 */
 
@@ -38,7 +43,6 @@ static int log_stderr = 0;
 static int echo_stderr = 0;
 static int log_fd = -1;
 static int log_to_file = 0;
-static int entries_alloced = 0;
 static int entries_lost = 0;
 static int connection_good = 1;
 static int max_logs = 0;
@@ -47,13 +51,16 @@ static int connection_type = SOCK_DGRAM;
 struct log_entry {
   int offset, length;
   pid_t pid; /* to avoid duplicates over a fork */
-  struct log_entry *next;
   char payload[MAX_MESSAGE];
 };
 
-static struct log_entry *entries = NULL;
-static struct log_entry *free_entries = NULL;
+/* Queued entries are ring[ring_head] onwards, wrapping. */
+static struct log_entry *ring = NULL;
+static int ring_size = 0, ring_head = 0, ring_count = 0;
 
+/* ctime() once a second, not once a line. */
+static time_t stamp_time = 0;
+static char stamp[16];
 
 int log_start(struct passwd *ent_pw, int errfd)
 {
@@ -82,21 +89,17 @@ int log_start(struct passwd *ent_pw, int errfd)
   
   max_logs = daemon->max_logs;
 
+  /* If queuing is inhibited, writes block, so nothing is lost
+     by holding a batch of lines for one write. */
+  ring_size = max_logs == 0 ? LOG_BATCH : max_logs;
+  ring = safe_malloc(ring_size * sizeof(struct log_entry));
+
   if (!log_reopen(daemon->log_file))
     {
       send_event(errfd, EVENT_LOG_ERR, errno, daemon->log_file ? daemon->log_file : "");
       _exit(0);
     }
 
-  /* if queuing is inhibited, make sure we allocate
-     the one required buffer now. */
-  if (max_logs == 0)
-    {  
-      free_entries = safe_malloc(sizeof(struct log_entry));
-      free_entries->next = NULL;
-      entries_alloced = 1;
-    }
-
   /* If we're running as root and going to change uid later,
      change the ownership here so that the file is always owned by
      the dnsmasq user. Then logrotate can just copy the owner.
@@ -155,33 +158,31 @@ int log_reopen(char *log_file)
 
 static void free_entry(void)
 {
-  struct log_entry *tmp = entries;
-  entries = tmp->next;
-  tmp->next = free_entries;
-  free_entries = tmp;
+  ring_head = (ring_head + 1) % ring_size;
+  ring_count--;
 }      
 
 static void log_write(void)
 {
   ssize_t rc;
+  pid_t pid = getpid();
    
-  while (entries)
+  while (ring_count != 0)
     {
+      struct iovec iov[LOG_BATCH];
+      struct log_entry *entry = &ring[ring_head];
+      int i, iovcnt;
+      
       /* The data in the payload is written with a terminating zero character 
 	 and the length reflects this. For a stream connection we need to 
 	 send the zero as a record terminator, but this isn't done for a 
 	 datagram connection, so treat the length as one less than reality 
-	 to elide the zero. If we're logging to a file, turn the zero into 
-	 a newline, and leave the length alone. */
-      int len_adjust = 0;
-
-      if (log_to_file)
-	entries->payload[entries->offset + entries->length - 1] = '\n';
-      else if (connection_type == SOCK_DGRAM)
-	len_adjust = 1;
+	 to elide the zero. If we're logging to a file, the zero was turned
+	 into a newline when the entry was made, and the length is left alone. */
+      int len_adjust = (!log_to_file && connection_type == SOCK_DGRAM) ? 1 : 0;
 
       /* Avoid duplicates over a fork() */
-      if (entries->pid != getpid())
+      if (entry->pid != pid)
 	{
 	  free_entry();
 	  continue;
@@ -189,20 +190,40 @@ static void log_write(void)
 
       connection_good = 1;
 
-      if ((rc = write(log_fd, entries->payload + entries->offset, entries->length - len_adjust)) != -1)
+      /* Each datagram is a message, otherwise send as many as we can at once. */
+      for (iovcnt = 0, i = ring_head; iovcnt < ring_count && iovcnt < LOG_BATCH; iovcnt++, i = (i + 1) % ring_size)
+	{
+	  if (ring[i].pid != pid || (len_adjust && iovcnt == 1))
+	    break;
+	  iov[iovcnt].iov_base = ring[i].payload + ring[i].offset;
+	  iov[iovcnt].iov_len = ring[i].length - len_adjust;
+	}
+      
+      if ((rc = writev(log_fd, iov, iovcnt)) != -1)
 	{
-	  entries->length -= rc;
-	  entries->offset += rc;
-	  if (entries->length == len_adjust)
+	  daemon->metrics[METRIC_LOG_WRITES]++;
+	  
+	  for (i = 0; i < iovcnt; i++)
 	    {
-	      free_entry();
-	      if (entries_lost != 0)
+	      entry = &ring[ring_head];
+	      
+	      if ((size_t)rc < iov[i].iov_len)
 		{
-		  int e = entries_lost;
-		  entries_lost = 0; /* avoid wild recursion */
-		  my_syslog(LOG_WARNING, _("overflow: %d log entries lost"), e);
-		}	  
+		  entry->length -= rc;
+		  entry->offset += rc;
+		  break;
+		}
+	      
+	      rc -= iov[i].iov_len;
+	      free_entry();
 	    }
+	  
+	  if (entries_lost != 0 && ring_count < ring_size)
+	    {
+	      int e = entries_lost;
+	      entries_lost = 0; /* avoid wild recursion */
+	      my_syslog(LOG_WARNING, _("overflow: %d log entries lost"), e);
+	    }	  
 	  continue;
 	}
       
@@ -363,34 +384,37 @@ void my_syslog(int priority, const char *format, ...)
       return;
     }
   
-  if ((entry = free_entries))
-    free_entries = entry->next;
-  else if (entries_alloced < max_logs && (entry = malloc(sizeof(struct log_entry))))
-    entries_alloced++;
+  /* Make space by writing what's queued. This doesn't block with --log-async,
+     if syslog can't keep up we drop the line. After a failure to connect,
+     try again now. */
+  if (ring_count == ring_size || !connection_good)
+    log_write();
   
-  if (!entry)
-    entries_lost++;
+  if (ring_count == ring_size || log_fd == -1)
+    {
+      entries_lost++;
+      daemon->metrics[METRIC_LOG_LINES_DROPPED]++;
+    }
   else
     {
-      /* add to end of list, consumed from the start */
-      entry->next = NULL;
-      if (!entries)
-	entries = entry;
-      else
-	{
-	  struct log_entry *tmp;
-	  for (tmp = entries; tmp->next; tmp = tmp->next);
-	  tmp->next = entry;
-	}
+      /* add to end of ring, consumed from the start */
+      entry = &ring[(ring_head + ring_count++) % ring_size];
       
-      time(&time_now);
       p = entry->payload;
       if (!log_to_file)
 	p += sprintf(p, "<%d>", priority | log_fac);
 
       /* Omit timestamp for default daemontools situation */
       if (!log_stderr || !option_bool(OPT_NO_FORK)) 
-	p += sprintf(p, "%.15s ", ctime(&time_now) + 4);
+	{
+	  time(&time_now);
+	  if (time_now != stamp_time)
+	    {
+	      sprintf(stamp, "%.15s", ctime(&time_now) + 4);
+	      stamp_time = time_now;
+	    }
+	  p += sprintf(p, "%s ", stamp);
+	}
       
       p += sprintf(p, "dnsmasq%s[%d]: ", func, (int)pid);
         
@@ -401,50 +425,20 @@ void my_syslog(int priority, const char *format, ...)
       entry->length = len > MAX_MESSAGE ? MAX_MESSAGE : len;
       entry->offset = 0;
       entry->pid = pid;
-    }
-  
-  /* almost always, logging won't block, so try and write this now,
-     to save collecting too many log messages during a select loop. */
-  log_write();
-  
-  /* Since we're doing things asynchronously, a cache-dump, for instance,
-     can now generate log lines very fast. With a small buffer (desirable),
-     that means it can overflow the log-buffer very quickly,
-     so that the cache dump becomes mainly a count of how many lines 
-     overflowed. To avoid this, we delay here, the delay is controlled 
-     by queue-occupancy, and grows exponentially. The delay is limited to (2^8)ms.
-     The scaling stuff ensures that when the queue is bigger than 8, the delay
-     only occurs for the last 8 entries. Once the queue is full, we stop delaying
-     to preserve performance.
-  */
-
-  if (entries && max_logs != 0)
-    {
-      int d;
       
-      for (d = 0,entry = entries; entry; entry = entry->next, d++);
-      
-      if (d == max_logs)
-	d = 0;
-      else if (max_logs > 8)
-	d -= max_logs - 8;
+      if (log_to_file)
+	entry->payload[entry->length - 1] = '\n';
 
-      if (d > 0)
-	{
-	  struct timespec waiter;
-	  waiter.tv_sec = 0;
-	  waiter.tv_nsec = 1000000 << (d - 1); /* 1 ms */
-	  nanosleep(&waiter, NULL);
-      
-	  /* Have another go now */
-	  log_write();
-	}
-    } 
+      /* Child processes have no main loop to write the queue from, and
+	 TCP children can be ended by SIGALRM at any time, so write now. */
+      if (daemon->pipe_to_parent != -1)
+	log_write();
+    }
 }
 
 void set_log_writer(void)
 {
-  if (entries && log_fd != -1 && connection_good)
+  if (ring_count != 0 && log_fd != -1 && connection_good)
     poll_listen(log_fd, POLLOUT);
 }
 
@@ -462,7 +456,7 @@ void flush_log(void)
     {
       struct timespec waiter;
       log_write();
-      if (!entries || !connection_good)
+      if (ring_count == 0 || !connection_good)
 	{
 	  close(log_fd);	
 	  break;
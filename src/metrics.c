@@ -19,14 +19,29 @@
 const char * metric_names[] = {
     "dns_cache_inserted",
     "dns_cache_live_freed",
+    "dns_cache_reaped",
+    "dns_cache_reap_hwm",
+    "dns_cache_promoted",
+    "dns_cache_hits",
+    "dns_cache_misses",
     "dns_queries_forwarded",
     "dns_auth_answered",
     "dns_local_answered",
     "dns_stale_answered",
+    "dns_answer_cache_hits",
+    "dns_subnet_cache_hits",
     "dns_unanswered",
+    "dns_warmup_queries",
+    "dns_warmup_cached",
     "dnssec_max_crypto_use",
     "dnssec_max_sig_fail",
     "dnssec_max_work",
+    "dnssec_sig_cache_hits",
+    "dnssec_sig_cache_misses",
+    "dnssec_key_cache_hits",
+    "dnssec_key_cache_misses",
+    "dnssec_crypto_queued",
+    "dnssec_subqueries_coalesced",
     "bootp",
     "pxe",
     "dhcp_ack",
@@ -46,7 +61,12 @@ const char * metric_names[] = {
     "dhcp_leasequery",
     "dhcp_lease_unassigned",
     "dhcp_lease_actve",
-    "dhcp_lease_unknown"
+    "dhcp_lease_unknown",
+    "log_lines_dropped",
+    "log_writes",
+    "dnstap_frames",
+    "dnstap_dropped",
+    "loop_stalls"
 };
 
 const char* get_metric_name(int i) {
@@ -61,6 +81,12 @@ void clear_metrics(void)
   for (i = 0; i < __METRIC_MAX; i++)
     daemon->metrics[i] = 0;
 
+#ifdef HAVE_HISTOGRAMS
+  memset(daemon->latency, 0, sizeof(daemon->latency));
+#endif
+  memset(daemon->loop_time, 0, sizeof(daemon->loop_time));
+  memset(daemon->stalls, 0, sizeof(daemon->stalls));
+
   for (serv = daemon->servers; serv; serv = serv->next)
     {
       serv->queries = 0;
@@ -69,6 +95,308 @@ void clear_metrics(void)
       serv->retrys = 0;
       serv->nxdomain_replies = 0;
       serv->query_latency = 0;
+#ifdef HAVE_HISTOGRAMS
+      if (serv->rtt)
+	memset(serv->rtt, 0, sizeof(struct histogram));
+#endif
     }
 }
 	
+
+const char * loop_names[] = {
+    "dns",
+    "dhcp",
+    "dhcp6",
+    "ra",
+    "tftp",
+    "inotify",
+    "event",
+    "helper",
+    "log"
+};
+
+const char *get_loop_name(int i)
+{
+  return loop_names[i];
+}
+
+/* The main loop iteration in progress: when it started, and the
+   largest part of it so far, for blaming a stall. */
+static u32 iter_start;
+static int iter_running = 0;
+static struct stall iter;
+
+void loop_start(void)
+{
+  iter_start = dnsmasq_microseconds();
+  iter_running = 1;
+  iter.subsystem = -1;
+  iter.subsystem_usec = 0;
+  iter.site = NULL;
+  iter.site_usec = 0;
+}
+
+/* Charge the time since started, from dnsmasq_microseconds(), to
+   one subsystem called from the main loop. Nothing else runs whilst
+   it does, so a long call delays every client. */
+void loop_account(int which, u32 started)
+{
+  struct loop_time *t = &daemon->loop_time[which];
+  u32 usec = dnsmasq_microseconds() - started;
+
+  t->count++;
+  t->sum += usec;
+  if (usec > t->max)
+    t->max = usec;
+
+  if (usec > iter.subsystem_usec)
+    {
+      iter.subsystem = which;
+      iter.subsystem_usec = usec;
+    }
+}
+
+/* Note an operation which may be slow, such as a reload or a call
+   into the kernel, so that a stall can be blamed on it. site must be
+   a constant string. */
+void stall_site(const char *site, u32 started)
+{
+  u32 usec = dnsmasq_microseconds() - started;
+
+  if (usec > iter.site_usec)
+    {
+      iter.site = site;
+      iter.site_usec = usec;
+    }
+}
+
+/* Called before the main loop goes back to poll(): if this iteration
+   went over budget, log it and keep it if it is one of the worst. */
+void loop_end(time_t now)
+{
+  struct stall *s, *least;
+  
+  if (!iter_running)
+    return;
+
+  iter_running = 0;
+  iter.usec = dnsmasq_microseconds() - iter_start;
+  
+  if (daemon->stall_budget == 0 || iter.usec < (u32)daemon->stall_budget * 1000)
+    return;
+
+  daemon->metrics[METRIC_LOOP_STALLS]++;
+  
+  if (iter.site)
+    my_syslog(LOG_WARNING, _("main loop stalled for %ums, %ums in %s, %ums in %s"),
+	      iter.usec / 1000, iter.subsystem_usec / 1000,
+	      iter.subsystem == -1 ? "other" : loop_names[iter.subsystem],
+	      iter.site_usec / 1000, iter.site);
+  else
+    my_syslog(LOG_WARNING, _("main loop stalled for %ums, %ums in %s"),
+	      iter.usec / 1000, iter.subsystem_usec / 1000,
+	      iter.subsystem == -1 ? "other" : loop_names[iter.subsystem]);
+
+  /* Replace the least bad, empty entries are zero. */
+  for (least = s = daemon->stalls; s < daemon->stalls + STALL_RECORDS; s++)
+    if (s->usec < least->usec)
+      least = s;
+
+  if (iter.usec > least->usec)
+    {
+      iter.when = now;
+      *least = iter;
+    }
+}
+
+void loop_report(time_t now)
+{
+  struct stall *sorted[STALL_RECORDS], *s;
+  int i, j, count;
+
+  for (i = 0; i < __LOOP_MAX; i++)
+    {
+      struct loop_time *t = &daemon->loop_time[i];
+
+      if (t->count != 0)
+	my_syslog(LOG_INFO, _("main loop time in %s: %u calls, total %llums, mean %uus, max %uus"),
+		  loop_names[i], t->count, (unsigned long long)(t->sum / 1000),
+		  (unsigned int)(t->sum / t->count), t->max);
+    }
+
+  /* Worst first. */
+  for (count = 0, s = daemon->stalls; s < daemon->stalls + STALL_RECORDS; s++)
+    if (s->usec != 0)
+      {
+	for (j = count++; j > 0 && sorted[j-1]->usec < s->usec; j--)
+	  sorted[j] = sorted[j-1];
+	sorted[j] = s;
+      }
+
+  if (daemon->stall_budget != 0)
+    my_syslog(LOG_INFO, _("main loop stalls over %dms: %u"), daemon->stall_budget, daemon->metrics[METRIC_LOOP_STALLS]);
+  
+  for (i = 0; i < count; i++)
+    {
+      s = sorted[i];
+      if (s->site)
+	my_syslog(LOG_INFO, _("main loop stall %lds ago for %ums, %ums in %s, %ums in %s"),
+		  (long)difftime(now, s->when), s->usec / 1000, s->subsystem_usec / 1000,
+		  s->subsystem == -1 ? "other" : loop_names[s->subsystem],
+		  s->site_usec / 1000, s->site);
+      else
+	my_syslog(LOG_INFO, _("main loop stall %lds ago for %ums, %ums in %s"),
+		  (long)difftime(now, s->when), s->usec / 1000, s->subsystem_usec / 1000,
+		  s->subsystem == -1 ? "other" : loop_names[s->subsystem]);
+    }
+}
+
+#ifdef HAVE_HISTOGRAMS
+const char * histogram_names[] = {
+    "cached",
+    "forwarded",
+    "dnssec",
+    "tcp"
+};
+
+const char *get_histogram_name(int i)
+{
+  return histogram_names[i];
+}
+
+static int hist_bucket(u32 usec)
+{
+  int e, b;
+
+  if (usec < HIST_SUB)
+    return usec;
+
+  /* e is the position of the top bit, the next HIST_SUB_BITS below it
+     choose the bucket within that power of two. */
+  for (e = HIST_SUB_BITS; e < 31 && (usec >> (e + 1)); e++);
+  
+  b = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((usec >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+
+  /* The last bucket also holds anything too big for the others. */
+  return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/* The smallest time which is too big for the bucket. */
+u32 hist_bucket_limit(int bucket)
+{
+  int e;
+
+  if (++bucket < HIST_SUB)
+    return bucket;
+
+  e = bucket / HIST_SUB - 1;
+
+  return (u32)(HIST_SUB + (bucket % HIST_SUB)) << e;
+}
+
+void hist_add(struct histogram *h, u32 usec)
+{
+  h->bucket[hist_bucket(usec)]++;
+  h->count++;
+  h->sum += usec;
+  if (usec > h->max)
+    h->max = usec;
+}
+
+void hist_merge(struct histogram *dst, struct histogram *src)
+{
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    dst->bucket[i] += src->bucket[i];
+
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/* An upper bound for the given percentile: the top of the bucket
+   it falls in, or the largest time seen if that's smaller. */
+u32 hist_percentile(struct histogram *h, unsigned int percent)
+{
+  u64 want, seen = 0;
+  u32 limit;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+
+  if ((want = ((u64)h->count * percent + 99) / 100) == 0)
+    want = 1;
+
+  for (i = 0; i < HIST_BUCKETS - 1; i++)
+    if ((seen += h->bucket[i]) >= want)
+      break;
+
+  if (i == HIST_BUCKETS - 1)
+    return h->max;
+
+  limit = hist_bucket_limit(i) - 1;
+  
+  return limit < h->max ? limit : h->max;
+}
+
+/* An answer has just been sent to a client, started is when the query
+   arrived, from dnsmasq_microseconds(). TCP children send the time
+   to the main process, which keeps the histograms. */
+void record_latency(int which, u32 started)
+{
+  u32 usec = dnsmasq_microseconds() - started;
+
+  if (daemon->pipe_to_parent != -1)
+    {
+      unsigned char op = PIPE_OP_LATENCY;
+      
+      read_write(daemon->pipe_to_parent, &op, sizeof(op), RW_WRITE);
+      read_write(daemon->pipe_to_parent, (unsigned char *)&which, sizeof(which), RW_WRITE);
+      read_write(daemon->pipe_to_parent, (unsigned char *)&usec, sizeof(usec), RW_WRITE);
+    }
+  else
+    hist_add(&daemon->latency[which], usec);
+}
+
+int latency_recv(int fd)
+{
+  int which;
+  u32 usec;
+
+  if (!read_write(fd, (unsigned char *)&which, sizeof(which), RW_READ) ||
+      !read_write(fd, (unsigned char *)&usec, sizeof(usec), RW_READ))
+    return 0;
+
+  if (which >= 0 && which < __HIST_MAX)
+    hist_add(&daemon->latency[which], usec);
+
+  return 1;
+}
+
+/* A reply has come from serv to a query sent at started. */
+void record_server_rtt(struct server *serv, u32 started)
+{
+  if (!serv->rtt && !(serv->rtt = whine_malloc(sizeof(struct histogram))))
+    return;
+
+  hist_add(serv->rtt, dnsmasq_microseconds() - started);
+}
+
+void latency_report(void)
+{
+  int i;
+
+  for (i = 0; i < __HIST_MAX; i++)
+    {
+      struct histogram *h = &daemon->latency[i];
+
+      if (h->count != 0)
+	my_syslog(LOG_INFO, _("latency of %s answers: %u answers, mean %uus, 50%% %uus, 90%% %uus, 99%% %uus, max %uus"),
+		  get_histogram_name(i), h->count, (unsigned int)(h->sum / h->count),
+		  hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99), h->max);
+    }
+}
+#endif
@@ -18,14 +18,29 @@
 enum {
   METRIC_DNS_CACHE_INSERTED,
   METRIC_DNS_CACHE_LIVE_FREED,
+  METRIC_DNS_CACHE_REAPED,
+  METRIC_DNS_CACHE_REAP_HWM,
+  METRIC_DNS_CACHE_PROMOTED,
+  METRIC_DNS_CACHE_HITS,
+  METRIC_DNS_CACHE_MISSES,
   METRIC_DNS_QUERIES_FORWARDED,
   METRIC_DNS_AUTH_ANSWERED,
   METRIC_DNS_LOCAL_ANSWERED,
   METRIC_DNS_STALE_ANSWERED,
+  METRIC_DNS_ANSWER_CACHE_HITS,
+  METRIC_DNS_SUBNET_CACHE_HITS,
   METRIC_DNS_UNANSWERED_QUERY,
+  METRIC_DNS_WARMUP_QUERIES,
+  METRIC_DNS_WARMUP_CACHED,
   METRIC_CRYPTO_HWM,
   METRIC_SIG_FAIL_HWM,
   METRIC_WORK_HWM,
+  METRIC_DNSSEC_SIG_CACHE_HITS,
+  METRIC_DNSSEC_SIG_CACHE_MISSES,
+  METRIC_DNSSEC_KEY_CACHE_HITS,
+  METRIC_DNSSEC_KEY_CACHE_MISSES,
+  METRIC_DNSSEC_CRYPTO_QUEUED,
+  METRIC_DNSSEC_SUBQUERIES_COALESCED,
   METRIC_BOOTP,
   METRIC_PXE,
   METRIC_DHCPACK,
@@ -46,9 +61,43 @@ enum {
   METRIC_DHCPLEASEUNASSIGNED,
   METRIC_DHCPLEASEACTIVE,
   METRIC_DHCPLEASEUNKNOWN,
+  METRIC_LOG_LINES_DROPPED,
+  METRIC_LOG_WRITES,
+  METRIC_DNSTAP_FRAMES,
+  METRIC_DNSTAP_DROPPED,
+  METRIC_LOOP_STALLS,
   
   __METRIC_MAX,
 };
 
+#ifdef HAVE_HISTOGRAMS
+/* Latency histograms for answers to clients, by how the answer was made.
+   If you modify this list, please keep the labels in metrics.c in sync. */
+enum {
+  HIST_CACHED,
+  HIST_FORWARDED,
+  HIST_DNSSEC,
+  HIST_TCP,
+
+  __HIST_MAX,
+};
+#endif
+
+/* Work dispatched from the main loop, for the time accounting.
+   If you modify this list, please keep the labels in metrics.c in sync. */
+enum {
+  LOOP_DNS,
+  LOOP_DHCP,
+  LOOP_DHCP6,
+  LOOP_RA,
+  LOOP_TFTP,
+  LOOP_INOTIFY,
+  LOOP_EVENT,
+  LOOP_HELPER,
+  LOOP_LOG,
+
+  __LOOP_MAX,
+};
+
 const char* get_metric_name(int);
 void clear_metrics(void);
@@ -941,6 +941,10 @@ static int make_sock(union mysockaddr *addr, int type, int dienow)
       
       return -1;
     }	
+
+#ifdef HAVE_DUMPFILE
+  dump_forget_fd(fd);
+#endif
   
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 || !fix_fd(fd))
     goto err;
@@ -1494,6 +1498,10 @@ static struct serverfd *allocate_sfd(union mysockaddr *addr, char *intname, unsi
       return NULL;
     }
 
+#ifdef HAVE_DUMPFILE
+  dump_forget_fd(sfd->fd);
+#endif
+
   if ((addr->sa.sa_family == AF_INET6 && setsockopt(sfd->fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1) ||
       !local_bind(sfd->fd, addr, intname, ifindex, 0) || !fix_fd(sfd->fd))
     { 
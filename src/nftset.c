@@ -47,6 +47,7 @@ int add_to_nftset(const char *setname, const union all_addr *ipaddr, int flags,
   const char *err;
   static char *cmd_buf = NULL;
   static size_t cmd_buf_sz = 0;
+  u32 started;
 
   inet_ntop(af, ipaddr, daemon->addrbuff, ADDRSTRLEN);
 
@@ -78,7 +79,9 @@ int add_to_nftset(const char *setname, const union all_addr *ipaddr, int flags,
       snprintf(cmd_buf, cmd_buf_sz, cmd, setname, daemon->addrbuff);
     }
 
+  started = dnsmasq_microseconds();
   ret = nft_run_cmd_from_buffer(ctx, cmd_buf);
+  stall_site("nftset", started);
   err = nft_ctx_get_error_buffer(ctx);
 
   if (ret != 0)
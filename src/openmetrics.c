@@ -0,0 +1,550 @@
+/* dnsmasq is Copyright (c) 2000-2026 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_OPENMETRICS
+
+/* --metrics-listen: a tiny HTTP server which answers GET /metrics with
+   the metrics in OpenMetrics text format. Everything is non-blocking and
+   driven from the poll loop. When a request arrives the numbers are copied,
+   then rendered into a small buffer a few lines at a time as the client
+   reads them, so a slow or stalled scraper never holds up DNS. */
+
+#define OM_READ  0
+#define OM_WRITE 1
+
+#define OM_LINE_MAX 512 /* most rendered by one call of om_line() */
+
+/* The output, in order. */
+enum {
+  FAM_METRIC,
+  FAM_CACHE_SIZE,
+  FAM_SHARD_LIVE,
+  FAM_SHARD_PROBATION,
+  FAM_SERVER_QUERIES,
+  FAM_SERVER_RETRIES,
+  FAM_SERVER_FAILED,
+  FAM_SERVER_NXDOMAIN,
+  FAM_SERVER_LATENCY,
+  FAM_LOOP_SECONDS,
+  FAM_LOOP_CALLS,
+  FAM_LOOP_MAX,
+#ifdef HAVE_HISTOGRAMS
+  FAM_ANSWER_LATENCY,
+  FAM_SERVER_RTT,
+#endif
+  FAM_EOF,
+  FAM_DONE
+};
+
+struct om_server {
+  char addr[ADDRSTRLEN];
+  int port;
+  unsigned int queries, failed_queries, nxdomain_replies, retrys, latency;
+#ifdef HAVE_HISTOGRAMS
+  struct histogram rtt;
+#endif
+};
+
+struct om_conn {
+  int fd, state;
+  time_t last; /* last progress, for the timeout */
+  size_t in_len, out_start, out_len;
+  char in[OPENMETRICS_REQUEST_MAX];
+  char out[OPENMETRICS_BUFSIZE];
+  /* Position in the output: family, item within it, -1 for its header,
+     and for histograms the bucket and the running total. */
+  int family, item, bucket;
+  u64 cumulative;
+  /* Copy of the numbers, taken when the request arrived. */
+  u32 metrics[__METRIC_MAX];
+  int cache_size, shard_count, server_count;
+  int *shard_live, *shard_probation;
+  struct om_server *servers;
+  struct loop_time loop_time[__LOOP_MAX];
+#ifdef HAVE_HISTOGRAMS
+  struct histogram latency[__HIST_MAX];
+#endif
+  struct om_conn *next;
+};
+
+static int om_listener = -1;
+static int om_conn_count = 0;
+static struct om_conn *om_conns = NULL;
+
+static void om_snapshot(struct om_conn *c);
+static void om_render(struct om_conn *c);
+
+void openmetrics_init(void)
+{
+  union mysockaddr *addr = &daemon->metrics_addr;
+  int opt = 1;
+
+  if (daemon->metrics_path)
+    {
+      struct sockaddr_un un;
+
+      memset(&un, 0, sizeof(un));
+#ifdef HAVE_SOCKADDR_SA_LEN
+      un.sun_len = sizeof(un);
+#endif
+      un.sun_family = AF_UNIX;
+      safe_strncpy(un.sun_path, daemon->metrics_path, sizeof(un.sun_path));
+
+      /* Left over from the last run. */
+      unlink(daemon->metrics_path);
+
+      if ((om_listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	  bind(om_listener, (struct sockaddr *)&un, sizeof(un)) == -1)
+	die(_("cannot create metrics socket %s: %s"), daemon->metrics_path, EC_BADNET);
+    }
+  else
+    {
+      if ((om_listener = socket(addr->sa.sa_family, SOCK_STREAM, 0)) == -1 ||
+	  setsockopt(om_listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+	  bind(om_listener, &addr->sa, sa_len(addr)) == -1)
+	{
+	  prettyprint_addr(addr, daemon->addrbuff);
+	  die(_("cannot create metrics socket %s: %s"), daemon->addrbuff, EC_BADNET);
+	}
+    }
+
+  if (listen(om_listener, 5) == -1 || !fix_fd(om_listener))
+    die(_("cannot listen for metrics requests: %s"), NULL, EC_BADNET);
+}
+
+static void om_close(struct om_conn *c)
+{
+  struct om_conn **up;
+
+  for (up = &om_conns; *up; up = &(*up)->next)
+    if (*up == c)
+      {
+	*up = c->next;
+	break;
+      }
+
+  /* TCP children share the descriptor, so close() alone wouldn't end
+     the connection. */
+  shutdown(c->fd, SHUT_RDWR);
+  close(c->fd);
+  free(c->shard_live);
+  free(c->shard_probation);
+  free(c->servers);
+  free(c);
+  om_conn_count--;
+}
+
+static void om_accept(time_t now)
+{
+  struct om_conn *c;
+  int fd;
+
+  if ((fd = accept(om_listener, NULL, NULL)) == -1)
+    return;
+
+  if (om_conn_count >= OPENMETRICS_MAX_CONNS || !fix_fd(fd) ||
+      !(c = whine_malloc(sizeof(struct om_conn))))
+    {
+      close(fd);
+      return;
+    }
+
+  c->fd = fd;
+  c->state = OM_READ;
+  c->last = now;
+  c->next = om_conns;
+  om_conns = c;
+  om_conn_count++;
+}
+
+static void om_respond(struct om_conn *c, const char *status)
+{
+  c->out_len = sprintf(c->out, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s\n",
+		       status, status);
+  c->family = FAM_DONE;
+}
+
+/* Return 0 if the connection is finished with. */
+static int om_read(struct om_conn *c, time_t now)
+{
+  ssize_t n;
+  char *path, *end;
+
+  if ((n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1)) <= 0)
+    return n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+
+  c->last = now;
+  c->in_len += n;
+  c->in[c->in_len] = 0;
+
+  if (!strstr(c->in, "\r\n\r\n") && !strstr(c->in, "\n\n"))
+    {
+      if (c->in_len == sizeof(c->in) - 1)
+	om_respond(c, "413 Request Entity Too Large");
+      else
+	return 1;
+    }
+  else if (strncmp(c->in, "GET ", 4) != 0)
+    om_respond(c, "405 Method Not Allowed");
+  else
+    {
+      path = c->in + 4;
+      if ((end = strpbrk(path, " \r\n")))
+	*end = 0;
+
+      if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0)
+	om_respond(c, "404 Not Found");
+      else
+	{
+	  c->out_len = sprintf(c->out, "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nConnection: close\r\n\r\n");
+	  om_snapshot(c);
+	}
+    }
+
+  c->state = OM_WRITE;
+  return 1;
+}
+
+/* Return 0 if the connection is finished with. */
+static int om_write(struct om_conn *c, time_t now)
+{
+  ssize_t n;
+
+  if (c->out_start == c->out_len)
+    {
+      if (c->family == FAM_DONE)
+	return 0;
+      om_render(c);
+    }
+
+  if ((n = write(c->fd, c->out + c->out_start, c->out_len - c->out_start)) == -1)
+    return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+
+  c->last = now;
+  c->out_start += n;
+
+  return c->out_start != c->out_len || c->family != FAM_DONE;
+}
+
+/* Return non-zero if there are connections open. */
+int set_openmetrics_listeners(void)
+{
+  struct om_conn *c;
+
+  if (om_listener == -1)
+    return 0;
+
+  if (om_conn_count < OPENMETRICS_MAX_CONNS)
+    poll_listen(om_listener, POLLIN);
+
+  for (c = om_conns; c; c = c->next)
+    poll_listen(c->fd, c->state == OM_READ ? POLLIN : POLLOUT);
+
+  return om_conns != NULL;
+}
+
+void check_openmetrics_listeners(time_t now)
+{
+  struct om_conn *c, *next;
+
+  if (om_listener == -1)
+    return;
+
+  for (c = om_conns; c; c = next)
+    {
+      int more = 1;
+
+      next = c->next;
+
+      if (c->state == OM_READ)
+	{
+	  if (poll_check(c->fd, POLLIN | POLLHUP | POLLERR))
+	    more = om_read(c, now);
+	}
+      else if (poll_check(c->fd, POLLOUT | POLLHUP | POLLERR))
+	more = om_write(c, now);
+
+      if (!more || difftime(now, c->last) > OPENMETRICS_TIMEOUT)
+	om_close(c);
+    }
+
+  if (poll_check(om_listener, POLLIN))
+    om_accept(now);
+}
+
+static void om_snapshot(struct om_conn *c)
+{
+  struct server *serv, *serv1;
+  int i, size;
+
+  memcpy(c->metrics, daemon->metrics, sizeof(c->metrics));
+  memcpy(c->loop_time, daemon->loop_time, sizeof(c->loop_time));
+#ifdef HAVE_HISTOGRAMS
+  memcpy(c->latency, daemon->latency, sizeof(c->latency));
+#endif
+
+  c->cache_size = daemon->cachesize;
+  c->shard_count = daemon->cache_shards;
+  c->shard_live = whine_malloc(c->shard_count * sizeof(int));
+  c->shard_probation = whine_malloc(c->shard_count * sizeof(int));
+
+  if (!c->shard_live || !c->shard_probation)
+    c->shard_count = 0;
+
+  for (i = 0; i < c->shard_count; i++)
+    cache_shard_stats(i, &size, &c->shard_live[i], &c->shard_probation[i]);
+
+  /* sum counts from different records for same server */
+  for (c->server_count = 0, serv = daemon->servers; serv; serv = serv->next)
+    c->server_count++;
+
+  if (c->server_count != 0 && !(c->servers = whine_malloc(c->server_count * sizeof(struct om_server))))
+    c->server_count = 0;
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    serv->flags &= ~SERV_MARK;
+
+  for (i = 0, serv = daemon->servers; serv && c->servers; serv = serv->next)
+    if (!(serv->flags & SERV_MARK))
+      {
+	struct om_server *s = &c->servers[i++];
+	unsigned int sigma_latency = 0, count_latency = 0;
+
+	s->port = prettyprint_addr(&serv->addr, s->addr);
+
+	for (serv1 = serv; serv1; serv1 = serv1->next)
+	  if (!(serv1->flags & SERV_MARK) && sockaddr_isequal(&serv->addr, &serv1->addr))
+	    {
+	      serv1->flags |= SERV_MARK;
+	      s->queries += serv1->queries;
+	      s->failed_queries += serv1->failed_queries;
+	      s->nxdomain_replies += serv1->nxdomain_replies;
+	      s->retrys += serv1->retrys;
+	      sigma_latency += serv1->query_latency;
+	      count_latency++;
+#ifdef HAVE_HISTOGRAMS
+	      if (serv1->rtt)
+		hist_merge(&s->rtt, serv1->rtt);
+#endif
+	    }
+
+	s->latency = sigma_latency/count_latency;
+      }
+
+  c->server_count = i;
+  c->family = FAM_METRIC;
+  c->item = 0;
+}
+
+static void om_printf(struct om_conn *c, const char *format, ...)
+{
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(c->out + c->out_len, sizeof(c->out) - c->out_len, format, ap);
+  va_end(ap);
+
+  if (len > 0)
+    c->out_len += ((size_t)len < sizeof(c->out) - c->out_len) ? (size_t)len : sizeof(c->out) - c->out_len - 1;
+}
+
+static void om_next(struct om_conn *c)
+{
+  c->family++;
+  c->item = -1;
+  c->bucket = 0;
+  c->cumulative = 0;
+}
+
+/* A family with one sample per server: the header, then the servers. */
+static void om_server_family(struct om_conn *c, const char *name, const char *type, const char *suffix, unsigned int val)
+{
+  if (c->item == -1)
+    om_printf(c, "# TYPE dnsmasq_%s %s\n", name, type);
+  else
+    om_printf(c, "dnsmasq_%s%s{server=\"%s\",port=\"%d\"} %u\n", name, suffix,
+	      c->servers[c->item].addr, c->servers[c->item].port, val);
+
+  if (++c->item == c->server_count)
+    om_next(c);
+}
+
+static void om_shard_family(struct om_conn *c, const char *name, int *val)
+{
+  if (c->item == -1)
+    om_printf(c, "# TYPE dnsmasq_%s gauge\n", name);
+  else
+    om_printf(c, "dnsmasq_%s{shard=\"%d\"} %d\n", name, c->item, val[c->item]);
+
+  if (++c->item == c->shard_count)
+    om_next(c);
+}
+
+/* A family with one sample per main loop subsystem. Times are in
+   microseconds, as seconds when usec is set; otherwise a count. */
+static void om_loop_family(struct om_conn *c, const char *name, const char *type, const char *suffix, int usec, u64 val)
+{
+  if (c->item == -1)
+    om_printf(c, "# TYPE dnsmasq_%s %s\n", name, type);
+  else if (usec)
+    om_printf(c, "dnsmasq_%s%s{subsystem=\"%s\"} %llu.%06llu\n", name, suffix,
+	      get_loop_name(c->item), val / 1000000, val % 1000000);
+  else
+    om_printf(c, "dnsmasq_%s%s{subsystem=\"%s\"} %llu\n", name, suffix, get_loop_name(c->item), val);
+
+  if (++c->item == __LOOP_MAX)
+    om_next(c);
+}
+
+#ifdef HAVE_HISTOGRAMS
+/* One line of a histogram, labels identifies which one. Times are
+   in microseconds, OpenMetrics wants seconds. */
+static void om_histogram(struct om_conn *c, const char *name, char *labels, struct histogram *h)
+{
+  if (c->bucket < HIST_BUCKETS - 1)
+    {
+      u32 limit = hist_bucket_limit(c->bucket);
+
+      c->cumulative += h->bucket[c->bucket];
+      om_printf(c, "dnsmasq_%s_bucket{%s,le=\"%u.%06u\"} %llu\n", name, labels,
+		limit / 1000000, limit % 1000000, c->cumulative);
+      c->bucket++;
+    }
+  else
+    {
+      om_printf(c, "dnsmasq_%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, h->count);
+      om_printf(c, "dnsmasq_%s_count{%s} %u\n", name, labels, h->count);
+      om_printf(c, "dnsmasq_%s_sum{%s} %llu.%06llu\n", name, labels, h->sum / 1000000, h->sum % 1000000);
+      c->bucket = 0;
+      c->cumulative = 0;
+      c->item++;
+    }
+}
+#endif
+
+/* Add the next line or few to the output buffer. */
+static void om_line(struct om_conn *c)
+{
+#ifdef HAVE_HISTOGRAMS
+  char labels[ADDRSTRLEN + 32];
+#endif
+
+  switch (c->family)
+    {
+    case FAM_METRIC:
+      /* These are a mixture of counts and high-water marks. */
+      om_printf(c, "# TYPE dnsmasq_%s unknown\ndnsmasq_%s %u\n",
+		get_metric_name(c->item), get_metric_name(c->item), c->metrics[c->item]);
+      if (++c->item == __METRIC_MAX)
+	om_next(c);
+      break;
+
+    case FAM_CACHE_SIZE:
+      om_printf(c, "# TYPE dnsmasq_cache_size gauge\ndnsmasq_cache_size %d\n", c->cache_size);
+      om_next(c);
+      break;
+
+    case FAM_SHARD_LIVE:
+      om_shard_family(c, "cache_live", c->shard_live);
+      break;
+
+    case FAM_SHARD_PROBATION:
+      om_shard_family(c, "cache_probation", c->shard_probation);
+      break;
+
+    case FAM_SERVER_QUERIES:
+      om_server_family(c, "server_queries", "counter", "_total", c->item == -1 ? 0 : c->servers[c->item].queries);
+      break;
+
+    case FAM_SERVER_RETRIES:
+      om_server_family(c, "server_retries", "counter", "_total", c->item == -1 ? 0 : c->servers[c->item].retrys);
+      break;
+
+    case FAM_SERVER_FAILED:
+      om_server_family(c, "server_failed_queries", "counter", "_total", c->item == -1 ? 0 : c->servers[c->item].failed_queries);
+      break;
+
+    case FAM_SERVER_NXDOMAIN:
+      om_server_family(c, "server_nxdomain_replies", "counter", "_total", c->item == -1 ? 0 : c->servers[c->item].nxdomain_replies);
+      break;
+
+    case FAM_SERVER_LATENCY:
+      om_server_family(c, "server_latency_milliseconds", "gauge", "", c->item == -1 ? 0 : c->servers[c->item].latency);
+      break;
+
+    case FAM_LOOP_SECONDS:
+      om_loop_family(c, "loop_seconds", "counter", "_total", 1, c->item == -1 ? 0 : c->loop_time[c->item].sum);
+      break;
+
+    case FAM_LOOP_CALLS:
+      om_loop_family(c, "loop_calls", "counter", "_total", 0, c->item == -1 ? 0 : c->loop_time[c->item].count);
+      break;
+
+    case FAM_LOOP_MAX:
+      om_loop_family(c, "loop_max_seconds", "gauge", "", 1, c->item == -1 ? 0 : c->loop_time[c->item].max);
+      break;
+
+#ifdef HAVE_HISTOGRAMS
+    case FAM_ANSWER_LATENCY:
+      if (c->item == -1)
+	{
+	  om_printf(c, "# TYPE dnsmasq_answer_latency_seconds histogram\n");
+	  c->item = 0;
+	}
+      else
+	{
+	  sprintf(labels, "answers=\"%s\"", get_histogram_name(c->item));
+	  om_histogram(c, "answer_latency_seconds", labels, &c->latency[c->item]);
+	  if (c->item == __HIST_MAX)
+	    om_next(c);
+	}
+      break;
+
+    case FAM_SERVER_RTT:
+      if (c->item == -1)
+	{
+	  om_printf(c, "# TYPE dnsmasq_server_rtt_seconds histogram\n");
+	  c->item = 0;
+	}
+      else
+	{
+	  sprintf(labels, "server=\"%s\",port=\"%d\"", c->servers[c->item].addr, c->servers[c->item].port);
+	  om_histogram(c, "server_rtt_seconds", labels, &c->servers[c->item].rtt);
+	}
+      if (c->item == c->server_count)
+	om_next(c);
+      break;
+#endif
+
+    case FAM_EOF:
+      om_printf(c, "# EOF\n");
+      om_next(c);
+      break;
+    }
+}
+
+static void om_render(struct om_conn *c)
+{
+  c->out_start = c->out_len = 0;
+
+  while (c->family != FAM_DONE && sizeof(c->out) - c->out_len >= OM_LINE_MAX)
+    om_line(c);
+}
+
+#endif
@@ -201,6 +201,19 @@ struct myoption {
 #define LOPT_LEASEQUERY    389
 #define LOPT_SPLIT_RELAY   390
 #define LOPT_LOG_MALLOC    391
+#define LOPT_DNSSEC_THREADS 392
+#define LOPT_ANSWER_CACHE  393
+#define LOPT_CACHE_POLICY  394
+#define LOPT_SUBNET_CACHE  395
+#define LOPT_SHARED_CACHE  396
+#define LOPT_CACHE_SNAPSHOT 397
+#define LOPT_CACHE_WARMUP  398
+#define LOPT_CACHE_SHARDS  399
+#define LOPT_DNSTAP        400
+#define LOPT_METRICS_LISTEN 401
+#define LOPT_DUMPFORMAT    402
+#define LOPT_DUMPRING      403
+#define LOPT_STALL_BUDGET  404
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -378,6 +391,14 @@ static const struct myoption opts[] =
     { "dnssec-no-timecheck", 0, 0, LOPT_DNSSEC_TIME },
     { "dnssec-timestamp", 1, 0, LOPT_DNSSEC_STAMP },
     { "dnssec-limits", 1, 0, LOPT_DNSSEC_LIMITS },
+    { "dnssec-threads", 1, 0, LOPT_DNSSEC_THREADS },
+    { "answer-cache", 1, 0, LOPT_ANSWER_CACHE },
+    { "cache-policy", 1, 0, LOPT_CACHE_POLICY },
+    { "subnet-cache", 1, 0, LOPT_SUBNET_CACHE },
+    { "shared-cache", 1, 0, LOPT_SHARED_CACHE },
+    { "cache-snapshot", 1, 0, LOPT_CACHE_SNAPSHOT },
+    { "cache-warmup", 1, 0, LOPT_CACHE_WARMUP },
+    { "cache-shards", 1, 0, LOPT_CACHE_SHARDS },
     { "dhcp-relay", 1, 0, LOPT_RELAY },
     { "dhcp-split-relay", 1, 0, LOPT_SPLIT_RELAY },
     { "ra-param", 1, 0, LOPT_RA_PARAM },
@@ -391,6 +412,11 @@ static const struct myoption opts[] =
     { "dhcp-rapid-commit", 0, 0, LOPT_RAPID_COMMIT },
     { "dumpfile", 1, 0, LOPT_DUMPFILE },
     { "dumpmask", 1, 0, LOPT_DUMPMASK },
+    { "dumpformat", 1, 0, LOPT_DUMPFORMAT },
+    { "dumpring", 1, 0, LOPT_DUMPRING },
+    { "dnstap", 1, 0, LOPT_DNSTAP },
+    { "metrics-listen", 1, 0, LOPT_METRICS_LISTEN },
+    { "stall-budget", 1, 0, LOPT_STALL_BUDGET },
     { "dhcp-ignore-clid", 0, 0,  LOPT_IGNORE_CLID },
     { "dynamic-host", 1, 0, LOPT_DYNHOST },
     { "log-debug", 0, 0, LOPT_LOG_DEBUG },
@@ -424,6 +450,13 @@ static struct {
   { 'b', OPT_BOGUSPRIV, NULL, gettext_noop("Fake reverse lookups for RFC1918 private address ranges."), NULL },
   { 'B', ARG_DUP, "<ipaddr>", gettext_noop("Treat ipaddr as NXDOMAIN (defeats Verisign wildcard)."), NULL }, 
   { 'c', ARG_ONE, "<integer>", gettext_noop("Specify the size of the cache in entries (defaults to %s)."), "$" },
+  { LOPT_ANSWER_CACHE, ARG_ONE, "<integer>", gettext_noop("Number of complete replies from local data to keep."), NULL },
+  { LOPT_CACHE_POLICY, ARG_ONE, "lru|2q", gettext_noop("Choose how entries are evicted when the cache is full."), NULL },
+  { LOPT_SUBNET_CACHE, ARG_ONE, "<integer>[,<integer>]", gettext_noop("Number of replies which depend on client subnet to keep, and subnets per name."), NULL },
+  { LOPT_SHARED_CACHE, ARG_ONE, "<integer>", gettext_noop("Number of new cache entries to share with TCP children."), NULL },
+  { LOPT_CACHE_SNAPSHOT, ARG_ONE, "<path>", gettext_noop("Save the cache to this file on exit, and load it on startup."), NULL },
+  { LOPT_CACHE_WARMUP, ARG_ONE, "<path>[,<rate>]", gettext_noop("Query the names listed in this file at startup to fill the cache."), NULL },
+  { LOPT_CACHE_SHARDS, ARG_ONE, "<integer>", gettext_noop("Split the cache into this many shards."), NULL },
   { 'C', ARG_DUP, "<path>", gettext_noop("Specify configuration file (defaults to %s)."), CONFFILE },
   { 'd', OPT_DEBUG, NULL, gettext_noop("Do NOT fork into the background: run in debug mode."), NULL },
   { 'D', OPT_NODOTS_LOCAL, NULL, gettext_noop("Do NOT forward queries with no domain part."), NULL }, 
@@ -589,6 +622,7 @@ static struct {
   { LOPT_DNSSEC_TIME, OPT_DNSSEC_TIME, NULL, gettext_noop("Don't check DNSSEC signature timestamps until first cache-reload"), NULL },
   { LOPT_DNSSEC_STAMP, ARG_ONE, "<path>", gettext_noop("Timestamp file to verify system clock for DNSSEC"), NULL },
   { LOPT_DNSSEC_LIMITS, ARG_ONE, "<limit>,..", gettext_noop("Set resource limits for DNSSEC validation"), NULL },
+  { LOPT_DNSSEC_THREADS, ARG_ONE, "<integer>", gettext_noop("Number of threads for DNSSEC signature verification."), NULL },
   { LOPT_RA_PARAM, ARG_DUP, "<iface>,[mtu:<value>|<interface>|off,][<prio>,]<intval>[,<lifetime>]", gettext_noop("Set MTU, priority, resend-interval and router-lifetime"), NULL },
   { LOPT_QUIET_DHCP, OPT_QUIET_DHCP, NULL, gettext_noop("Do not log routine DHCP."), NULL },
   { LOPT_QUIET_DHCP6, OPT_QUIET_DHCP6, NULL, gettext_noop("Do not log routine DHCPv6."), NULL },
@@ -602,6 +636,11 @@ static struct {
   { LOPT_RAPID_COMMIT, OPT_RAPID_COMMIT, NULL, gettext_noop("Enables DHCPv4 Rapid Commit option."), NULL },
   { LOPT_DUMPFILE, ARG_ONE, "<path>", gettext_noop("Path to debug packet dump file."), NULL },
   { LOPT_DUMPMASK, ARG_ONE, "<hex>", gettext_noop("Mask which packets to dump."), NULL },
+  { LOPT_DUMPFORMAT, ARG_ONE, "pcap|pcapng", gettext_noop("Format of new packet dump files."), NULL },
+  { LOPT_DUMPRING, ARG_ONE, "<integer>", gettext_noop("Keep packets to dump in memory until a failure or request."), NULL },
+  { LOPT_DNSTAP, ARG_ONE, "<path>|unix:<path>", gettext_noop("Log DNS messages in dnstap format to a file or unix socket."), NULL },
+  { LOPT_METRICS_LISTEN, ARG_ONE, "[<addr>#]<port>|unix:<path>", gettext_noop("Serve metrics in OpenMetrics format over HTTP."), NULL },
+  { LOPT_STALL_BUDGET, ARG_ONE, "<ms>", gettext_noop("Log and record main loop iterations longer than this (defaults to %s)."), "100" },
   { LOPT_SCRIPT_TIME, OPT_LEASE_RENEW, NULL, gettext_noop("Call dhcp-script when lease expiry changes."), NULL },
   { LOPT_UMBRELLA, ARG_ONE, "[=<optspec>]", gettext_noop("Send Cisco Umbrella identifiers including remote IP."), NULL },
   { LOPT_QUIET_TFTP, OPT_QUIET_TFTP, NULL, gettext_noop("Do not log routine TFTP."), NULL },
@@ -2378,6 +2417,71 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
     case LOPT_DUMPMASK:  /* --dumpmask */
       daemon->dump_mask = strtol(arg, NULL, 0);
       break;
+
+    case LOPT_DUMPFORMAT:  /* --dumpformat */
+      if (strcmp(arg, "pcapng") == 0)
+	set_option_bool(OPT_DUMP_PCAPNG);
+      else if (strcmp(arg, "pcap") == 0)
+	reset_option_bool(OPT_DUMP_PCAPNG);
+      else
+	ret_err(gen_err);
+      break;
+
+    case LOPT_DUMPRING:  /* --dumpring */
+      if (!atoi_check(arg, &daemon->dump_ring))
+	ret_err(gen_err);
+      break;
+
+    case LOPT_STALL_BUDGET:  /* --stall-budget */
+      if (!atoi_check(arg, &daemon->stall_budget))
+	ret_err(gen_err);
+      break;
+
+    case LOPT_DNSTAP:  /* --dnstap */
+      daemon->dnstap = opt_string_alloc(arg);
+      break;
+
+    case LOPT_METRICS_LISTEN:  /* --metrics-listen */
+      if (strncmp(arg, "unix:", 5) == 0)
+	daemon->metrics_path = opt_string_alloc(arg + 5);
+      else
+	{
+	  union mysockaddr *addr = &daemon->metrics_addr;
+	  char *address = arg, *portno;
+	  int port;
+
+	  /* Just a port means the loopback address. */
+	  if (!(portno = split_chr(arg, '#')))
+	    {
+	      portno = arg;
+	      address = "127.0.0.1";
+	    }
+	  
+	  if (!atoi_check16(portno, &port) || port == 0)
+	    ret_err(gen_err);
+
+	  memset(addr, 0, sizeof(*addr));
+	  
+	  if (inet_pton(AF_INET, address, &addr->in.sin_addr) > 0)
+	    {
+	      addr->in.sin_family = AF_INET;
+	      addr->in.sin_port = htons(port);
+#ifdef HAVE_SOCKADDR_SA_LEN
+	      addr->in.sin_len = sizeof(struct sockaddr_in);
+#endif
+	    }
+	  else if (inet_pton(AF_INET6, address, &addr->in6.sin6_addr) > 0)
+	    {
+	      addr->in6.sin6_family = AF_INET6;
+	      addr->in6.sin6_port = htons(port);
+#ifdef HAVE_SOCKADDR_SA_LEN
+	      addr->in6.sin6_len = sizeof(struct sockaddr_in6);
+#endif
+	    }
+	  else
+	    ret_err(gen_err);
+	}
+      break;
       
 #ifdef HAVE_DHCP      
     case 'l':  /* --dhcp-leasefile */
@@ -3435,6 +3539,59 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	  }
 	break;
       }
+
+    case LOPT_ANSWER_CACHE:  /* --answer-cache */
+      if (!atoi_check(arg, &daemon->answer_cache_size) || daemon->answer_cache_size < 0)
+	ret_err(gen_err);
+      break;
+
+    case LOPT_CACHE_POLICY:  /* --cache-policy */
+      if (strcmp(arg, "lru") == 0)
+	daemon->cache_policy = CACHE_POLICY_LRU;
+      else if (strcmp(arg, "2q") == 0)
+	daemon->cache_policy = CACHE_POLICY_2Q;
+      else
+	ret_err(_("bad cache policy"));
+      break;
+
+    case LOPT_SUBNET_CACHE:  /* --subnet-cache */
+      {
+	char *comma = split(arg);
+	
+	if (!atoi_check(arg, &daemon->subnet_cache_size) || daemon->subnet_cache_size < 0)
+	  ret_err(gen_err);
+	
+	if (comma && (!atoi_check(comma, &daemon->subnet_cache_scopes) || daemon->subnet_cache_scopes < 1))
+	  ret_err(gen_err);
+	break;
+      }
+
+    case LOPT_SHARED_CACHE:  /* --shared-cache */
+      if (!atoi_check(arg, &daemon->shared_cache_size) || daemon->shared_cache_size < 0)
+	ret_err(gen_err);
+      break;
+
+    case LOPT_CACHE_SNAPSHOT:  /* --cache-snapshot */
+      daemon->cache_snapshot = opt_string_alloc(arg);
+      break;
+
+    case LOPT_CACHE_WARMUP:  /* --cache-warmup */
+      {
+	char *comma = split(arg);
+
+	daemon->cache_warmup_rate = CACHE_WARMUP_RATE;
+	if (comma && (!atoi_check(comma, &daemon->cache_warmup_rate) ||
+		      daemon->cache_warmup_rate < 1 || daemon->cache_warmup_rate > 1000))
+	  ret_err(gen_err);
+	daemon->cache_warmup = opt_string_alloc(arg);
+	break;
+      }
+      
+    case LOPT_CACHE_SHARDS:  /* --cache-shards */
+      if (!atoi_check(arg, &daemon->cache_shards) ||
+	  daemon->cache_shards < 1 || daemon->cache_shards > 1024)
+	ret_err(gen_err);
+      break;
       
     case 'p':  /* --port */
       if (!atoi_check16(arg, &daemon->port))
@@ -5369,6 +5526,13 @@ err:
 	break;
       }
       
+#ifdef HAVE_DNSSEC_THREADS
+    case LOPT_DNSSEC_THREADS: /* --dnssec-threads */
+      if (!atoi_check(arg, &daemon->dnssec_threads) || daemon->dnssec_threads < 0)
+	ret_err(gen_err);
+      break;
+#endif
+      
     case LOPT_DNSSEC_STAMP: /* --dnssec-timestamp */
       daemon->timestamp_file = opt_string_alloc(arg); 
       break;
@@ -5966,6 +6130,8 @@ void read_opts(int argc, char **argv, char *compile_opts)
   
   /* Set defaults - everything else is zero or NULL */
   daemon->cachesize = CACHESIZ;
+  daemon->cache_shards = CACHE_SHARDS;
+  daemon->subnet_cache_scopes = SUBNET_CACHE_SCOPES;
   daemon->ftabsize = FTABSIZ;
   daemon->port = NAMESERVER_PORT;
   daemon->dhcp_client_port = DHCP_CLIENT_PORT;
@@ -5978,6 +6144,7 @@ void read_opts(int argc, char **argv, char *compile_opts)
   daemon->dhcp_max = MAXLEASES;
   daemon->tftp_max = TFTP_MAX_CONNECTIONS;
   daemon->edns_pktsz = EDNS_PKTSZ;
+  daemon->stall_budget = STALL_BUDGET;
   daemon->log_fac = -1;
   daemon->auth_ttl = AUTH_TTL; 
   daemon->soa_refresh = SOA_REFRESH;
@@ -6105,6 +6272,8 @@ void read_opts(int argc, char **argv, char *compile_opts)
       add_txt("evictions.bind", NULL, TXT_STAT_EVICTIONS);
       add_txt("misses.bind", NULL, TXT_STAT_MISSES);
       add_txt("hits.bind", NULL, TXT_STAT_HITS);
+      add_txt("hitratio.bind", NULL, TXT_STAT_HITRATIO);
+      add_txt("shards.bind", NULL, TXT_STAT_SHARDS);
 #ifdef HAVE_AUTH
       add_txt("auth.bind", NULL, TXT_STAT_AUTH);
 #endif
@@ -520,7 +520,49 @@ int do_doctor(struct dns_header *header, size_t qlen, char *namebuff)
   return done;
 }
 
-/* Find SOA RR in auth section to get TTL for negative caching of name. 
+/* Subtract age from the TTL of every RR in a reply except the pseudoheader,
+   and return the smallest TTL left, or zero if the packet is bad or has no RRs. */
+unsigned long age_reply(struct dns_header *header, size_t qlen, unsigned long age)
+{
+  unsigned char *p;
+  int i, qtype, rdlen;
+  unsigned long ttl, minttl = 0;
+  int found = 0;
+
+  if (!(p = skip_questions(header, qlen)))
+    return 0;
+
+  for (i = ntohs(header->ancount) + ntohs(header->nscount) + ntohs(header->arcount); i != 0; i--)
+    {
+      if (!(p = skip_name(p, header, qlen, 10)))
+	return 0;
+
+      GETSHORT(qtype, p);
+      p += 2; /* class */
+
+      if (qtype != T_OPT)
+	{
+	  GETLONG(ttl, p);
+	  ttl = (ttl > age) ? ttl - age : 0;
+	  p -= 4;
+	  PUTLONG(ttl, p);
+
+	  if (!found || ttl < minttl)
+	    minttl = ttl;
+	  found = 1;
+	}
+      else
+	p += 4;
+
+      GETSHORT(rdlen, p);
+      if (!ADD_RDLEN(header, p, qlen, rdlen))
+	return 0;
+    }
+
+  return minttl;
+}
+
+/* Find SOA RR in auth section to get TTL for negative caching of name.
    Cache said SOA and return the difference in length between name and the name of the 
    SOA RR so we can look it up again.
 */
@@ -1754,6 +1796,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 	      if (t->stat != 0)
 		{
 		  ttl = 0;
+		  /* Statistics change with every query. */
+		  answer_cache_volatile();
 		  if (!cache_make_stat(t))
 		    ok = 0;
 		}
@@ -1963,6 +2007,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 	      struct addrlist *addrlist;
 	      int gotit = 0, localise = 0;
 	      
+	      /* Interface addresses come and go. */
+	      answer_cache_volatile();
 	      enumerate_interfaces(0);
 	      
 	      /* See if a putative address is on the network from which we received
@@ -2313,6 +2359,10 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   if (!ans)
     return 0; /* failed to answer a question */
 
+  /* auth is cleared by data from upstream servers, which makes this a hit for hitratio.bind. */
+  if (!auth && !notimp)
+    daemon->metrics[METRIC_DNS_CACHE_HITS]++;
+
   /* We found a negative record. See if we have an SOA record to 
      return in the AUTH section. 
      
@@ -315,6 +315,10 @@ static void tftp_request(char *packet, ssize_t plen, struct listener *listen, ti
       free(transfer);
       return;
     }
+#ifdef HAVE_DUMPFILE
+  else
+    dump_forget_fd(transfer->sockfd);
+#endif
   
   transfer->peer = peer;
   transfer->source = addra;
@@ -26,6 +26,14 @@ static int error_logged = 0;
 static int ubus_handle_metrics(struct ubus_context *ctx, struct ubus_object *obj,
 			       struct ubus_request_data *req, const char *method,
 			       struct blob_attr *msg);
+static int ubus_handle_loop(struct ubus_context *ctx, struct ubus_object *obj,
+			    struct ubus_request_data *req, const char *method,
+			    struct blob_attr *msg);
+#ifdef HAVE_HISTOGRAMS
+static int ubus_handle_latency(struct ubus_context *ctx, struct ubus_object *obj,
+			       struct ubus_request_data *req, const char *method,
+			       struct blob_attr *msg);
+#endif
 
 #ifdef HAVE_CONNTRACK
 enum {
@@ -56,6 +64,10 @@ static void ubus_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj)
 
 static const struct ubus_method ubus_object_methods[] = {
   UBUS_METHOD_NOARG("metrics", ubus_handle_metrics),
+  UBUS_METHOD_NOARG("loop", ubus_handle_loop),
+#ifdef HAVE_HISTOGRAMS
+  UBUS_METHOD_NOARG("latency", ubus_handle_latency),
+#endif
 #ifdef HAVE_CONNTRACK
   UBUS_METHOD("set_connmark_allowlist", ubus_handle_set_connmark_allowlist, set_connmark_allowlist_policy),
 #endif
@@ -200,6 +212,127 @@ static int ubus_handle_metrics(struct ubus_context *ctx, struct ubus_object *obj
   return UBUS_STATUS_OK;
 }
 
+static int ubus_handle_loop(struct ubus_context *ctx, struct ubus_object *obj,
+			    struct ubus_request_data *req, const char *method,
+			    struct blob_attr *msg)
+{
+  void *table;
+  int i;
+
+  (void)obj;
+  (void)method;
+  (void)msg;
+
+  CHECK(blob_buf_init(&b, BLOBMSG_TYPE_TABLE));
+
+  for (i = 0; i < __LOOP_MAX; i++)
+    {
+      if (!(table = blobmsg_open_table(&b, get_loop_name(i))))
+	return UBUS_STATUS_UNKNOWN_ERROR;
+      CHECK(blobmsg_add_u32(&b, "calls", daemon->loop_time[i].count));
+      CHECK(blobmsg_add_u64(&b, "total", daemon->loop_time[i].sum));
+      CHECK(blobmsg_add_u32(&b, "max", daemon->loop_time[i].max));
+      blobmsg_close_table(&b, table);
+    }
+  
+  CHECK(ubus_send_reply(ctx, req, b.head));
+  return UBUS_STATUS_OK;
+}
+
+#ifdef HAVE_HISTOGRAMS
+/* Fill in the fields of a histogram in the currently open table. Buckets
+   are keyed by the smallest time which is too big for them. */
+static int ubus_add_histogram(struct histogram *h)
+{
+  void *buckets;
+  char limit[16];
+  int i;
+
+  CHECK(blobmsg_add_u32(&b, "count", h->count));
+  CHECK(blobmsg_add_u32(&b, "mean", h->count ? (u32)(h->sum / h->count) : 0));
+  CHECK(blobmsg_add_u32(&b, "p50", hist_percentile(h, 50)));
+  CHECK(blobmsg_add_u32(&b, "p90", hist_percentile(h, 90)));
+  CHECK(blobmsg_add_u32(&b, "p99", hist_percentile(h, 99)));
+  CHECK(blobmsg_add_u32(&b, "max", h->max));
+
+  if (!(buckets = blobmsg_open_table(&b, "buckets")))
+    return UBUS_STATUS_UNKNOWN_ERROR;
+  
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if (h->bucket[i] != 0)
+      {
+	if (i == HIST_BUCKETS - 1)
+	  strcpy(limit, "inf");
+	else
+	  sprintf(limit, "%u", hist_bucket_limit(i));
+	CHECK(blobmsg_add_u32(&b, limit, h->bucket[i]));
+      }
+  
+  blobmsg_close_table(&b, buckets);
+  
+  return UBUS_STATUS_OK;
+}
+
+static int ubus_handle_latency(struct ubus_context *ctx, struct ubus_object *obj,
+			       struct ubus_request_data *req, const char *method,
+			       struct blob_attr *msg)
+{
+  struct server *serv, *serv1;
+  void *table, *servers;
+  int i, port;
+
+  (void)obj;
+  (void)method;
+  (void)msg;
+
+  CHECK(blob_buf_init(&b, BLOBMSG_TYPE_TABLE));
+
+  for (i = 0; i < __HIST_MAX; i++)
+    {
+      if (!(table = blobmsg_open_table(&b, get_histogram_name(i))))
+	return UBUS_STATUS_UNKNOWN_ERROR;
+      CHECK(ubus_add_histogram(&daemon->latency[i]));
+      blobmsg_close_table(&b, table);
+    }
+
+  if (!(servers = blobmsg_open_array(&b, "servers")))
+    return UBUS_STATUS_UNKNOWN_ERROR;
+  
+  /* sum counts from different records for same server */
+  for (serv = daemon->servers; serv; serv = serv->next)
+    serv->flags &= ~SERV_MARK;
+  
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (!(serv->flags & SERV_MARK))
+      {
+	struct histogram rtt;
+
+	memset(&rtt, 0, sizeof(rtt));
+	
+	for (serv1 = serv; serv1; serv1 = serv1->next)
+	  if (!(serv1->flags & SERV_MARK) && sockaddr_isequal(&serv->addr, &serv1->addr))
+	    {
+	      serv1->flags |= SERV_MARK;
+	      if (serv1->rtt)
+		hist_merge(&rtt, serv1->rtt);
+	    }
+
+	if (!(table = blobmsg_open_table(&b, NULL)))
+	  return UBUS_STATUS_UNKNOWN_ERROR;
+	port = prettyprint_addr(&serv->addr, daemon->addrbuff);
+	CHECK(blobmsg_add_string(&b, "address", daemon->addrbuff));
+	CHECK(blobmsg_add_u32(&b, "port", port));
+	CHECK(ubus_add_histogram(&rtt));
+	blobmsg_close_table(&b, table);
+      }
+  
+  blobmsg_close_array(&b, servers);
+  
+  CHECK(ubus_send_reply(ctx, req, b.head));
+  return UBUS_STATUS_OK;
+}
+#endif
+
 #ifdef HAVE_CONNTRACK
 static int ubus_handle_set_connmark_allowlist(struct ubus_context *ctx, struct ubus_object *obj,
 					      struct ubus_request_data *req, const char *method,
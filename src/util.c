@@ -424,9 +424,69 @@ int hostname_order(const char *a, const char *b)
   return 0;
 }
 
+/* Fold the ASCII upper-case letters in eight bytes of a name to lower case.
+   Bytes with the top bit set are left alone, as in hostname_order(). */
+static u64 fold_case(u64 w)
+{
+  const u64 ones = 0x0101010101010101ULL;
+  u64 low = w & (0x7f * ones);
+  u64 upper = (low + (0x80 - 'A') * ones) & ~(low + (0x7f - 'Z') * ones) & ~w & (0x80 * ones);
+  
+  return w | (upper >> 2);
+}
+
+/* Compare and hash names eight bytes at a time. */
 int hostname_isequal(const char *a, const char *b)
 {
-  return strlen(a) == strlen(b) && hostname_order(a, b) == 0;
+  size_t len = strlen(a);
+  u64 wa, wb;
+  
+  if (len != strlen(b))
+    return 0;
+  
+  for (; len >= sizeof(u64); len -= sizeof(u64), a += sizeof(u64), b += sizeof(u64))
+    {
+      memcpy(&wa, a, sizeof(u64));
+      memcpy(&wb, b, sizeof(u64));
+      if (wa != wb && fold_case(wa) != fold_case(wb))
+	return 0;
+    }
+  
+  if (len == 0)
+    return 1;
+  
+  wa = wb = 0;
+  memcpy(&wa, a, len);
+  memcpy(&wb, b, len);
+  
+  return wa == wb || fold_case(wa) == fold_case(wb);
+}
+
+/* Case-insensitive hash of a name, for the cache hash table. */
+unsigned int hostname_hash(const char *name)
+{
+  const u64 mult = 0x9e3779b97f4a7c15ULL;
+  size_t len = strlen(name);
+  u64 w, val = 017465 + len; /* Barker code - minimum self-correlation in cyclic shift */
+  
+  for (; len >= sizeof(u64); len -= sizeof(u64), name += sizeof(u64))
+    {
+      memcpy(&w, name, sizeof(u64));
+      val = (val ^ fold_case(w)) * mult;
+      val ^= val >> 29;
+    }
+  
+  if (len != 0)
+    {
+      w = 0;
+      memcpy(&w, name, len);
+      val = (val ^ fold_case(w)) * mult;
+    }
+  
+  val ^= val >> 32;
+  val *= mult;
+  
+  return (unsigned int)(val >> 32);
 }
 
 /* is b equal to or a subdomain of a return 2 for equal, 1 for subdomain */
@@ -493,6 +553,17 @@ u32 dnsmasq_milliseconds(void)
   return (tv.tv_sec) * 1000 + (tv.tv_usec / 1000);
 }
 
+/* For measuring intervals, so unaffected by changes to the clock. Wraps
+   after about 71 minutes; only differences are meaningful. */
+u32 dnsmasq_microseconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec) * 1000000 + (ts.tv_nsec / 1000);
+}
+
 int netmask_length(struct in_addr mask)
 {
   int zero_count = 0;
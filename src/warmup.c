@@ -0,0 +1,248 @@
+/* dnsmasq is Copyright (c) 2000-2026 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dnsmasq.h"
+
+/* --cache-warmup: read a list of popular names at startup and send a query
+   for each one, at a limited rate, so that the cache is filled before the
+   clients arrive. The list is either plain "name [type]" lines or the output
+   of --log-queries, in which case the "query[type] name" items are used. */
+
+static FILE *warmup_file = NULL;
+static off_t warmup_size;
+static u32 warmup_next;
+static int warmup_done = 0;
+static int warmup_pending = 0;
+static unsigned short warmup_type;
+static char warmup_name[MAXDNAME + 1];
+
+static int warmup_parse(char *line, char **name, unsigned short *type);
+static int warmup_cached(char *name, unsigned short type, time_t now);
+static size_t warmup_make_query(char *name, unsigned short type);
+
+void warmup_init(void)
+{
+  struct stat statbuf;
+
+  if (!daemon->cache_warmup || warmup_file || warmup_done)
+    return;
+
+  if (!(warmup_file = fopen(daemon->cache_warmup, "r")))
+    {
+      my_syslog(LOG_ERR, _("cannot read %s: %s"), daemon->cache_warmup, strerror(errno));
+      warmup_done = 1;
+      return;
+    }
+
+  warmup_size = (fstat(fileno(warmup_file), &statbuf) == 0) ? statbuf.st_size : 0;
+  warmup_next = dnsmasq_milliseconds();
+
+  my_syslog(LOG_INFO, _("warming cache from %s at %d queries per second"),
+	    daemon->cache_warmup, daemon->cache_warmup_rate);
+}
+
+/* Send the warm-up queries which are due. Return the time in milliseconds
+   until more are due, or -1 if there are none. */
+int warmup_run(time_t now)
+{
+  u32 millis, interval;
+  char line[MAXDNAME + 100];
+
+  if (!warmup_file)
+    return -1;
+
+  /* Nowhere to send them yet. */
+  if (daemon->serverarraysz == 0)
+    return 1000;
+
+  millis = dnsmasq_milliseconds();
+  interval = 1000 / daemon->cache_warmup_rate;
+
+  /* Don't make up for time lost whilst blocked in one burst. */
+  if ((int)(millis - warmup_next) > 1000)
+    warmup_next = millis;
+
+  while ((int)(millis - warmup_next) >= 0)
+    {
+      size_t plen;
+
+      if (!warmup_pending)
+	{
+	  char *name, *canon;
+	  unsigned short type;
+	  
+	  if (!fgets(line, sizeof(line), warmup_file))
+	    {
+	      fclose(warmup_file);
+	      warmup_file = NULL;
+	      warmup_done = 1;
+	      my_syslog(LOG_INFO, _("cache warm-up complete: %u queries sent, %u names already cached"),
+			daemon->metrics[METRIC_DNS_WARMUP_QUERIES], daemon->metrics[METRIC_DNS_WARMUP_CACHED]);
+	      return -1;
+	    }
+	  
+	  /* Discard the rest of an over-long line. */
+	  if (!strchr(line, '\n'))
+	    {
+	      int c;
+	      while ((c = getc(warmup_file)) != EOF && c != '\n');
+	    }
+	  
+	  if (!warmup_parse(line, &name, &type) || !(canon = canonicalise(name, NULL)))
+	    continue;
+
+	  safe_strncpy(warmup_name, canon, sizeof(warmup_name));
+	  free(canon);
+	  
+	  if (warmup_cached(warmup_name, type, now))
+	    {
+	      daemon->metrics[METRIC_DNS_WARMUP_CACHED]++;
+	      continue;
+	    }
+
+	  warmup_type = type;
+	  warmup_pending = 1;
+	}
+      
+      if ((plen = warmup_make_query(warmup_name, warmup_type)))
+	{
+	  /* Too many outstanding, try again shortly. Answers
+	     arriving will wake us anyway. */
+	  if (!forward_internal_query((struct dns_header *)daemon->packet, plen, now,
+				      CACHE_WARMUP_INFLIGHT, "cache warm-up"))
+	    return interval;
+	  
+	  daemon->metrics[METRIC_DNS_WARMUP_QUERIES]++;
+	  warmup_next += interval;
+	}
+
+      warmup_pending = 0;
+    }
+
+  return (int)(warmup_next - millis);
+}
+
+void warmup_report(void)
+{
+  long pos;
+
+  if (!daemon->cache_warmup)
+    return;
+
+  if (!warmup_done && warmup_file && warmup_size != 0 && (pos = ftell(warmup_file)) != -1)
+    my_syslog(LOG_INFO, _("cache warm-up queries sent %u, names already cached %u, %u%% of list read"),
+	      daemon->metrics[METRIC_DNS_WARMUP_QUERIES], daemon->metrics[METRIC_DNS_WARMUP_CACHED],
+	      (unsigned int)((100 * (long long)pos) / warmup_size));
+  else
+    my_syslog(LOG_INFO, _("cache warm-up queries sent %u, names already cached %u"),
+	      daemon->metrics[METRIC_DNS_WARMUP_QUERIES], daemon->metrics[METRIC_DNS_WARMUP_CACHED]);
+}
+
+static int warmup_parse(char *line, char **name, unsigned short *type)
+{
+  char *p, *t = NULL;
+  size_t len;
+
+  if ((p = strstr(line, "query[")))
+    {
+      /* --log-queries output: "query[A] example.com from 192.168.0.1" */
+      t = p + 6;
+      if (!(p = strchr(t, ']')))
+	return 0;
+      *p++ = 0;
+      *name = strtok(p, " \t\r\n");
+    }
+  else
+    {
+      if (*(p = line + strspn(line, " \t")) == '#')
+	return 0;
+
+      if ((*name = strtok(p, " \t\r\n")))
+	t = strtok(NULL, " \t\r\n");
+    }
+
+  if (!*name)
+    return 0;
+
+  if (!t)
+    *type = T_A;
+  else if (strncmp(t, "type=", 5) == 0)
+    *type = atoi(t + 5);
+  else
+    *type = rrtype(t);
+
+  if (*type == 0)
+    return 0;
+
+  /* Names in the log have no trailing dot. */
+  if ((len = strlen(*name)) > 1 && (*name)[len - 1] == '.')
+    (*name)[len - 1] = 0;
+
+  /* Empty labels would end the name early in the packet. */
+  return **name != '.' && !strstr(*name, "..");
+}
+
+static int warmup_cached(char *name, unsigned short type, time_t now)
+{
+  struct crec *crecp = NULL;
+  unsigned int prot = F_RR;
+
+  if (type == T_A)
+    prot = F_IPV4;
+  else if (type == T_AAAA)
+    prot = F_IPV6;
+
+  while ((crecp = cache_find_by_name(crecp, name, now, prot | F_CNAME)))
+    {
+      if (crecp->flags & (F_IPV4 | F_IPV6 | F_CNAME))
+	return 1;
+
+      if (crecp->flags & F_KEYTAG)
+	{
+	  if (crecp->addr.rrblock.rrtype == type)
+	    return 1;
+	}
+      else if (crecp->addr.rrdata.rrtype == type)
+	return 1;
+    }
+
+  return 0;
+}
+
+static size_t warmup_make_query(char *name, unsigned short type)
+{
+  struct dns_header *header = (struct dns_header *)daemon->packet;
+  unsigned char *p = (unsigned char *)(header+1);
+
+  /* packet buffer overwritten */
+  daemon->srv_save = NULL;
+
+  header->id = rand16();
+  header->ancount = header->nscount = header->arcount = htons(0);
+  header->qdcount = htons(1);
+  header->hb3 = HB3_RD;
+  header->hb4 = 0;
+  SET_OPCODE(header, QUERY);
+
+  if (!(p = do_rfc1035_name(p, name, NULL)))
+    return 0;
+
+  *p++ = 0;
+  PUTSHORT(type, p);
+  PUTSHORT(C_IN, p);
+
+  return p - (unsigned char *)header;
+}